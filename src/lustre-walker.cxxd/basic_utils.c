@@ -11,50 +11,31 @@
 #include <sys/syscall.h>
 #include <lustre/lustre_user.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <stddef.h>
+#include <linux/limits.h>
+#include <pthread.h>
 
 #include "paranoia.h"
 #include "basic_utils.h"
 
-/**********************************************************************/
-/** These types come from /usr/include/lustre/lustre_idl.h which
-    cannot be included directly outside of the kernel.  These are
-    needed to get the size of the block of memory to send to ioctl
-    when directly calling lustre's lstat implementation. **/
-
-#define lov_ost_data lov_ost_data_v1
-struct lov_ost_data_v1 {          /* per-stripe data structure (little-endian)*/
-  __u64 l_object_id;        /* OST object ID */
-  __u64 l_object_seq;       /* OST object seq number */
-  __u32 l_ost_gen;          /* generation of this l_ost_idx */
-  __u32 l_ost_idx;          /* OST index in LOV (lov_tgt_desc->tgts) */
-};
-
-#define lov_mds_md lov_mds_md_v1
-struct lov_mds_md_v1 {            /* LOV EA mds/wire data (little-endian) */
-  __u32 lmm_magic;          /* magic number = LOV_MAGIC_V1 */
-  __u32 lmm_pattern;        /* LOV_PATTERN_RAID0, LOV_PATTERN_RAID1 */
-  __u64 lmm_object_id;      /* LOV object ID */
-  __u64 lmm_object_seq;     /* LOV object seq number */
-  __u32 lmm_stripe_size;    /* size of stripe in bytes */
-  __u32 lmm_stripe_count;   /* num stripes in use for this object */
-  struct lov_ost_data_v1 lmm_objects[0]; /* per-stripe data */
-};
-
-struct lov_mds_md_v3 {            /* LOV EA mds/wire data (little-endian) */
-  __u32 lmm_magic;          /* magic number = LOV_MAGIC_V3 */
-  __u32 lmm_pattern;        /* LOV_PATTERN_RAID0, LOV_PATTERN_RAID1 */
-  __u64 lmm_object_id;      /* LOV object ID */
-  __u64 lmm_object_seq;     /* LOV object seq number */
-  __u32 lmm_stripe_size;    /* size of stripe in bytes */
-  __u32 lmm_stripe_count;   /* num stripes in use for this object */
-  char  lmm_pool_name[LOV_MAXPOOLNAME]; /* must be 32bit aligned */
-  struct lov_ost_data_v1 lmm_objects[0]; /* per-stripe data */
-};
-/**********************************************************************/
-
-/* verbosity -- what level of verbosity did the user request?  Used to
-   decide which warning and debug messages to print */
-static int verbosity=VERB_WARN;
+/* LOV_PATTERN_F_RELEASED -- layout pattern flag of a file whose data
+   HSM has released, which has a stripe count but no OST objects.
+   Older lustre_user.h files do not have it. */
+#ifndef LOV_PATTERN_F_RELEASED
+#define LOV_PATTERN_F_RELEASED 0x80000000
+#endif
+
+/* LOV_PATTERN_MDT -- layout pattern of a data-on-MDT component, which
+   has no OST objects.  Older lustre_user.h files do not have it. */
+#ifndef LOV_PATTERN_MDT
+#define LOV_PATTERN_MDT 0x100
+#endif
+
+/* log_verbosity -- what level of verbosity did the user request?
+   Used to decide which warning and debug messages to print */
+int log_verbosity=VERB_WARN;
 
 /* use_lustre_stat -- should we use the lustre implementation of
    lstat?  If false, we use fstatfd in lstat mode instead. */
@@ -69,52 +50,185 @@ int get_use_lustre_stat(void) {
   return use_lustre_stat;
 }
 
+/* statx_mask/statx_flags -- if statx_mask is non-zero, stats that do
+   not use the lustre lstat use statx with this mask and these flags,
+   instead of fstatat. */
+static unsigned statx_mask=0;
+static int statx_flags=0;
+
+/* set_statx_mask/get_statx_mask -- use to get or modify statx_mask
+   outside of this object file */
+void set_statx_mask(unsigned mask,int dont_sync) {
+#ifdef STATX_BASIC_STATS
+  statx_mask=mask;
+  statx_flags=AT_SYMLINK_NOFOLLOW|(dont_sync ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT);
+#else
+  if(mask)
+    fail("This program was built without statx support.\n");
+#endif
+}
+unsigned get_statx_mask(void) {
+  return statx_mask;
+}
+int get_statx_flags(void) {
+  return statx_flags;
+}
+
 /* increment_verbosity/set_verbosity -- use these to modify verbosity
    outside of this object file */
 void increment_verbosity() {
-  verbosity++;
+  log_verbosity++;
 }
 void set_verbosity(int x) {
-  verbosity=x;
+  log_verbosity=x;
 }
 
-/* fail/warn/debug/debugn -- print messages to stderr if the verbosity
-   has reached a certain level.  Fail always prints and then exits the
-   program. */
-void fail(const char *format,...) {
-  va_list ap;
-  va_start(ap,format);
-  vfprintf(stderr,format,ap);
-  va_end(ap);
-  exit(2);
-  abort(); /* should never reach here */
+/* The message queue.  Threads append formatted messages to queue,
+   and the writer thread swaps it for its own empty buffer and writes
+   out what it took.  All of this is protected by log_lock.
+     queue, queued, queue_size -- the queue, its length and allocation
+     writing -- true while the writer thread is writing
+     log_started -- true once the writer thread is running
+   Appending waits on log_space while the queue holds LOG_QUEUE_MAX
+   bytes, so a flood of messages slows the walk down rather than
+   using unbounded memory.  The writer waits on log_ready, and
+   log_flush waits on log_drained. */
+#define LOG_QUEUE_MAX (4*1048576)
+#define LOG_LINE 1024 /* messages shorter than this are formatted without malloc */
+static char *queue=NULL;
+static size_t queued=0, queue_size=0;
+static int writing=0, log_started=0;
+static pthread_mutex_t log_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_ready=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_space=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained=PTHREAD_COND_INITIALIZER;
+
+/* write_stderr -- write all of len bytes of buf to stderr, giving up
+   quietly on errors: there is nowhere left to report them. */
+static void write_stderr(const char *buf,size_t len) {
+  ssize_t n;
+  while(len>0) {
+    if((n=write(STDERR_FILENO,buf,len))<0) {
+      if(errno==EINTR)
+        continue;
+      return;
+    }
+    buf+=n;
+    len-=n;
+  }
 }
 
-void warn(const char *format,...) {
-  va_list ap;
-  if(verbosity>=VERB_WARN) {
-    va_start(ap,format);
-    vfprintf(stderr,format,ap);
-    va_end(ap);
+/* log_writer -- the writer thread */
+static void *log_writer(void *arg) {
+  char *buf=NULL, *tmp;
+  size_t len, size=0, tmpsize;
+  (void)arg;
+  pthread_mutex_lock(&log_lock);
+  for(;;) {
+    while(!queued)
+      pthread_cond_wait(&log_ready,&log_lock);
+    /* Take the whole queue, leaving our old buffer in its place */
+    tmp=queue;
+    queue=buf;
+    buf=tmp;
+    tmpsize=queue_size;
+    queue_size=size;
+    size=tmpsize;
+    len=queued;
+    queued=0;
+    writing=1;
+    pthread_cond_broadcast(&log_space);
+    pthread_mutex_unlock(&log_lock);
+    write_stderr(buf,len);
+    pthread_mutex_lock(&log_lock);
+    writing=0;
+    if(!queued)
+      pthread_cond_broadcast(&log_drained);
   }
+  return NULL;
 }
 
-void debug(const char *format,...) {
-  va_list ap;
-  if(verbosity>=VERB_DEBUG) {
-    va_start(ap,format);
-    vfprintf(stderr,format,ap);
-    va_end(ap);
+/* log_start -- start the writer thread, the first time a message is
+   queued.  Caller must hold log_lock.  Returns 0 if it cannot be
+   started, in which case messages are written directly. */
+static int log_start(void) {
+  pthread_t thread;
+  pthread_attr_t attr;
+  if(log_started)
+    return 1;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+  if(!pthread_create(&thread,&attr,log_writer,NULL)) {
+    log_started=1;
+    atexit(log_flush);
   }
+  pthread_attr_destroy(&attr);
+  return log_started;
+}
+
+void log_flush(void) {
+  pthread_mutex_lock(&log_lock);
+  while(queued || writing)
+    pthread_cond_wait(&log_drained,&log_lock);
+  pthread_mutex_unlock(&log_lock);
 }
 
-void debugn(int level,const char *format,...) {
+void log_message(const char *format,...) {
+  char line[LOG_LINE], *msg=line, *grown;
   va_list ap;
-  if(verbosity>=level) {
+  int len;
+
+  /* Format the message in this thread, on the stack if it fits */
+  va_start(ap,format);
+  len=vsnprintf(line,sizeof(line),format,ap);
+  va_end(ap);
+  if(len<0)
+    return;
+  if((size_t)len>=sizeof(line)) {
+    if(!(msg=(char*)malloc(len+1)))
+      fail("Cannot allocate %llu bytes: %s\n",(unsigned long long)len+1,strerror(errno));
     va_start(ap,format);
-    vfprintf(stderr,format,ap);
+    vsnprintf(msg,len+1,format,ap);
     va_end(ap);
   }
+
+  pthread_mutex_lock(&log_lock);
+  if(!log_start()) {
+    pthread_mutex_unlock(&log_lock);
+    write_stderr(msg,len);
+  } else {
+    while(queued && queued+len>LOG_QUEUE_MAX)
+      pthread_cond_wait(&log_space,&log_lock);
+    if(queued+len>queue_size) {
+      size_t size=queue_size ? queue_size : 65536;
+      while(size<queued+len)
+        size*=2;
+      if(!(grown=(char*)realloc(queue,size))) {
+        pthread_mutex_unlock(&log_lock);
+        fail("Cannot allocate %llu bytes: %s\n",(unsigned long long)size,strerror(errno));
+      }
+      queue=grown;
+      queue_size=size;
+    }
+    memcpy(queue+queued,msg,len);
+    queued+=len;
+    pthread_cond_signal(&log_ready);
+    pthread_mutex_unlock(&log_lock);
+  }
+  if(msg!=line)
+    free(msg);
+}
+
+/* fail -- print a message to stderr, after anything already queued,
+   and exit the program */
+void fail(const char *format,...) {
+  va_list ap;
+  log_flush();
+  va_start(ap,format);
+  vfprintf(stderr,format,ap);
+  va_end(ap);
+  exit(2);
+  abort(); /* should never reach here */
 }
 
 /* fulltime -- get the unix epoch time including fractions.  Should
@@ -125,69 +239,218 @@ double fulltime() {
   return tv.tv_sec + tv.tv_usec*1e-6;
 }
 
-/* max_fileinfo_buffer_size -- Calculates the size of the buffer
-   needed to call ioctl with request number IOC_MDC_GETFILEINFO, the
-   request number for Lustre's lstat implementation.  This calculation
-   may need to be changed for new Lustre versions.  For that reason,
-   we add a huge amount (add_just_in_case) to the estimated size
-   required, just in case. */
-size_t max_fileinfo_buffer_size(void) {
-  /* WARNING: MUST BE CHANGED FOR NEW LUSTRE VERSIONS 
-   We use add_just_in_case as a safeguard against that. */
-
-  /* This calculation comes from lov_mds_md_size in
-     lustre/include/obd_lov.h inside the Lustre repository, except for
-     the MAX_LOV_UUID_COUNT which is the maximum number of striping
-     entries, which comes from lustre/utils/liblustreapi.c in the
-     Lustre repository. */
-
-  const size_t basesize=sizeof(lstat_t) + sizeof(struct lov_user_md_v3) + sizeof(struct lov_mds_md_v3);
-  const size_t per_entry=sizeof(struct lov_ost_data_v1);
-  const size_t MAX_LOV_UUID_COUNT=1000;
-  const size_t add_just_in_case=500000; /* just in case the numbers are wrong, add padding */
-
-  const size_t returnvalue= basesize + MAX_LOV_UUID_COUNT*per_entry + add_just_in_case;
-
-  return returnvalue;
+/* FILEINFO_BUFFER_SIZE -- the size of the buffer given to ioctl
+   with request number IOC_MDC_GETFILEINFO, the request number for
+   Lustre's lstat implementation.  The request is the file name; the
+   reply is an lstat_t followed by the file's layout, the lov_user_md
+   the kernel copies out of the trusted.lov extended attribute without
+   checking how much room there is.  An extended attribute cannot be
+   longer than XATTR_SIZE_MAX, so that bounds the reply for every
+   Lustre version and layout, including composite (PFL) layouts, whose
+   stripe counts alone do not.  This is 64 KiB, where a v3 layout
+   with the most stripes Lustre allows (LOV_MAX_STRIPE_COUNT, 2000)
+   takes under 48 KiB. */
+#define FILEINFO_BUFFER_SIZE (sizeof(lstat_t)+XATTR_SIZE_MAX)
+
+/* LMM_OFFSET -- where the layout starts in the reply */
+#define LMM_OFFSET offsetof(struct lov_user_mds_data,lmd_lmm)
+
+/* fileinfo_buffer -- this thread's ioctl buffer, allocated the first
+   time this thread does a Lustre stat.  Each thread needs its own,
+   since the reply is read in place after the ioctl. */
+static __thread char *fileinfo_buffer=NULL;
+
+/* parse_layout -- fill in layout from the lov_user_md at lmm, which
+   must end by limit.  Sizes and stripe counts are checked against
+   limit, so that a bad reply cannot send lustre_layout_ost or
+   lustre_layout_comp off the end of the buffer. */
+static void parse_layout(const char *lmm,const char *limit,lustre_layout *layout) {
+  const struct lov_user_md_v1 *v1=(const struct lov_user_md_v1*)lmm;
+  const struct lov_user_md_v3 *v3=(const struct lov_user_md_v3*)lmm;
+  size_t head=0;
+  memset(layout,0,sizeof(lustre_layout));
+  layout->kind=LUSTRE_LAYOUT_UNKNOWN;
+  if(lmm+sizeof(uint32_t)>limit)
+    return;
+  if(v1->lmm_magic==LOV_USER_MAGIC_V1)
+    head=sizeof(struct lov_user_md_v1);
+  else if(v1->lmm_magic==LOV_USER_MAGIC_V3)
+    head=sizeof(struct lov_user_md_v3);
+#ifdef LOV_USER_MAGIC_COMP_V1
+  else if(v1->lmm_magic==LOV_USER_MAGIC_COMP_V1) {
+    const struct lov_comp_md_v1 *comp=(const struct lov_comp_md_v1*)lmm;
+    if(lmm+sizeof(struct lov_comp_md_v1)>limit
+       || lmm+sizeof(struct lov_comp_md_v1)
+          +(size_t)comp->lcm_entry_count*sizeof(struct lov_comp_md_entry_v1)>limit)
+      return;
+    layout->kind=LUSTRE_LAYOUT_COMPOSITE;
+    layout->ncomps=comp->lcm_entry_count;
+    layout->comps=lmm;
+    layout->limit=limit;
+    return;
+  }
+#endif
+  if(!head || lmm+head>limit)
+    return;
+
+  /* A plain layout: released files and data-on-MDT components have
+     a stripe count but no OST objects */
+  layout->start=0;
+  layout->end=UINT64_MAX;
+  if((v1->lmm_pattern&(LOV_PATTERN_F_RELEASED|LOV_PATTERN_MDT)) || !v1->lmm_stripe_count) {
+    layout->kind=LUSTRE_LAYOUT_NONE;
+    return;
+  }
+  if(lmm+head+(size_t)v1->lmm_stripe_count*sizeof(struct lov_user_ost_data_v1)>limit)
+    return;
+  layout->kind=LUSTRE_LAYOUT_PLAIN;
+  layout->stripe_count=v1->lmm_stripe_count;
+  layout->stripe_size=v1->lmm_stripe_size;
+  layout->objects=lmm+head;
+  if(v1->lmm_magic==LOV_USER_MAGIC_V3) {
+    layout->pool=v3->lmm_pool_name;
+    layout->poollen=strnlen(v3->lmm_pool_name,sizeof(v3->lmm_pool_name));
+  }
+}
+
+/* lustre_stat -- see basic_utils.h.  The name is the one thing
+   copied: the ioctl reads it from the start of the buffer it then
+   overwrites with the reply. */
+const struct stat *lustre_stat(int dirfd,const char *path,size_t pathlen,lustre_layout *layout) {
+  struct lov_user_mds_data *buf;
+  const struct lov_user_md_v1 *lmm;
+  uint32_t magic=0;
+  assert(sizeof(lstat_t)==sizeof(struct stat));
+  if(!fileinfo_buffer && !(fileinfo_buffer=malloc(FILEINFO_BUFFER_SIZE)))
+    fail("Cannot allocate %llu bytes: %s\n",
+         (unsigned long long)FILEINFO_BUFFER_SIZE,strerror(errno));
+  buf=(struct lov_user_mds_data*)fileinfo_buffer;
+  if(!pathlen)
+    pathlen=path_length(path,1);
+  if(pathlen>=FILEINFO_BUFFER_SIZE)
+    fail("Attempted to open a file with a name longer than allowed by lustre's stat (%llu>%llu)\n",
+         (unsigned long long)pathlen+1,(unsigned long long)FILEINFO_BUFFER_SIZE);
+
+  /* A file with no layout gets no lov_user_md in the reply, so
+     whatever was in its place before the ioctl is still there.  Clear
+     the magic number, if the name does not cover it.  If it does,
+     remember what the name put there. */
+  memcpy(buf,path,pathlen+1);
+  if(pathlen+1<LMM_OFFSET+sizeof(magic))
+    memset(fileinfo_buffer+LMM_OFFSET,0,sizeof(magic));
+  else
+    memcpy(&magic,fileinfo_buffer+LMM_OFFSET,sizeof(magic));
+
+  if(ioctl(dirfd,IOC_MDC_GETFILEINFO,(void*)buf))
+    return NULL;
+
+  if(layout) {
+    /* If the "magic number" is exactly what the name left there, we
+       cannot tell whether the reply has a layout.  A file with no
+       layout has its magic number still zero. */
+    lmm=&buf->lmd_lmm;
+    if(pathlen+1>=LMM_OFFSET+sizeof(magic) && lmm->lmm_magic==magic) {
+      memset(layout,0,sizeof(lustre_layout));
+      layout->kind=LUSTRE_LAYOUT_UNKNOWN;
+    } else if(!lmm->lmm_magic) {
+      memset(layout,0,sizeof(lustre_layout));
+      layout->kind=LUSTRE_LAYOUT_NONE;
+    } else
+      parse_layout(fileinfo_buffer+LMM_OFFSET,fileinfo_buffer+FILEINFO_BUFFER_SIZE,layout);
+  }
+  return (const struct stat*)(fileinfo_buffer+offsetof(struct lov_user_mds_data,lmd_st));
+}
+
+unsigned lustre_layout_ost(const lustre_layout *layout,unsigned i) {
+  assert(i<layout->stripe_count);
+  return ((const struct lov_user_ost_data_v1*)layout->objects)[i].l_ost_idx;
+}
+
+int lustre_layout_comp(const lustre_layout *layout,unsigned i,lustre_layout *comp) {
+#ifdef LOV_USER_MAGIC_COMP_V1
+  const char *base=(const char*)layout->comps;
+  const struct lov_comp_md_entry_v1 *e;
+  assert(layout->kind==LUSTRE_LAYOUT_COMPOSITE && i<layout->ncomps);
+  e=(const struct lov_comp_md_entry_v1*)
+    (base+sizeof(struct lov_comp_md_v1)+(size_t)i*sizeof(struct lov_comp_md_entry_v1));
+  if((e->lcme_flags&LCME_FL_INIT) && e->lcme_offset<(size_t)((const char*)layout->limit-base)) {
+    parse_layout(base+e->lcme_offset,(const char*)layout->limit,comp);
+    if(comp->kind==LUSTRE_LAYOUT_PLAIN) {
+      comp->start=e->lcme_extent.e_start;
+      comp->end=e->lcme_extent.e_end;
+      return 1;
+    }
+  }
+#else
+  (void)layout; (void)i;
+  assert(0); /* no composite layouts without LOV_USER_MAGIC_COMP_V1 */
+#endif
+  memset(comp,0,sizeof(lustre_layout));
+  comp->kind=LUSTRE_LAYOUT_NONE;
+  return 0;
 }
 
 /* lustre_lstatfd -- uses lustre's lstat implementation as a
    replacement for fstatfd.  Arguments:
 
-    dir -- the directory in which the file resides
+    dirfd -- open file descriptor of the directory in which the file resides
     path -- the filename within that directory.
     pathlen -- length of the path in chars.  Optional.  Set to zero and it
               will be calculated for you
     sb -- stat structure to contain the output
 
-    Returns 0 on success, non-zero on failure.  Memory allocation failures 
-    will cause fail() to be called.
+    Returns 0 on success, non-zero on failure.  This is lustre_stat,
+    with the result copied to sb.
 */
-int lustre_lstatfd(DIR *dir,const char *path,size_t pathlen,struct stat *sb) {
-  static int allocated=0;
-  static struct lov_user_mds_data *buf;
-  static size_t bufsize=0;
-  int ret;
+int lustre_lstatfd(int dirfd,const char *path,size_t pathlen,struct stat *sb) {
+  const struct stat *reply;
   assert(sb);
-  if(!pathlen)
-    pathlen=path_length(path,1);
-  if(!allocated) {
-    allocated=1;
-    bufsize=max_fileinfo_buffer_size();
-    assert(bufsize);
-    if(!(buf=malloc(bufsize)))
-      fail("Cannot allocate %llu bytes: %s\n",
-           (unsigned long long)bufsize,strerror(errno));
-  }
-  if(pathlen>bufsize)
-    fail("Attempted to open a file with a name longer than allowed by lustre's stat (%llu>%llu)\n",
-         (unsigned long long)pathlen+1,(unsigned long long)bufsize);
+  if(!(reply=lustre_stat(dirfd,path,pathlen,NULL)))
+    return -1;
+  memcpy(sb,reply,sizeof(struct stat));
+  return 0;
+}
 
-  memcpy(buf,path,pathlen+1);
-  ret=ioctl(dirfd(dir), IOC_MDC_GETFILEINFO, (void*)buf);
-  memcpy(sb,&(buf->lmd_st),sizeof(struct stat));
-  return ret;
+/* statx_lstatfd -- uses statx, with the mask and flags given to
+   set_statx_mask, as a replacement for fstatat in lstat mode.  Only
+   the fields in the mask are guaranteed to be filled in; the rest
+   may be zero.  Arguments and return value are the same as for
+   lustre_lstatfd, except that errno is set on failure. */
+int statx_lstatfd(int dirfd,const char *path,struct stat *sb) {
+#ifdef STATX_BASIC_STATS
+  struct statx stx;
+  assert(sb);
+  if(statx(dirfd,path,statx_flags,statx_mask,&stx))
+    return -1;
+  statx_to_stat(&stx,sb);
+  return 0;
+#else
+  return fstatat(dirfd,path,sb,AT_SYMLINK_NOFOLLOW);
+#endif
+}
+
+#ifdef STATX_BASIC_STATS
+/* statx_to_stat -- converts statx output to a stat structure */
+void statx_to_stat(const struct statx *stx,struct stat *sb) {
+  memset(sb,0,sizeof(struct stat));
+  sb->st_dev=makedev(stx->stx_dev_major,stx->stx_dev_minor);
+  sb->st_ino=stx->stx_ino;
+  sb->st_mode=stx->stx_mode;
+  sb->st_nlink=stx->stx_nlink;
+  sb->st_uid=stx->stx_uid;
+  sb->st_gid=stx->stx_gid;
+  sb->st_rdev=makedev(stx->stx_rdev_major,stx->stx_rdev_minor);
+  sb->st_size=stx->stx_size;
+  sb->st_blksize=stx->stx_blksize;
+  sb->st_blocks=stx->stx_blocks;
+  sb->st_atim.tv_sec=stx->stx_atime.tv_sec;
+  sb->st_atim.tv_nsec=stx->stx_atime.tv_nsec;
+  sb->st_mtim.tv_sec=stx->stx_mtime.tv_sec;
+  sb->st_mtim.tv_nsec=stx->stx_mtime.tv_nsec;
+  sb->st_ctim.tv_sec=stx->stx_ctime.tv_sec;
+  sb->st_ctim.tv_nsec=stx->stx_ctime.tv_nsec;
 }
+#endif /* STATX_BASIC_STATS */
 
 /* Splits a path into directory and basename components.  Uses static
    storage. */
@@ -328,7 +591,7 @@ int parent_fstatfd(DIR *dir,const char *path,size_t pathlen,struct stat *sb) {
   assert(sb);
 
   if(BAD_LEN==(pathlen=path_length(path,0))) {
-    warn("%*s...: pathname is longer than allowed\n",path,MAX_PATH_LEN_CHAR-1);
+    warn("%.*s...: pathname is longer than allowed\n",(int)(MAX_PATH_LEN_CHAR-1),path);
     return 1;
   }
 
@@ -350,7 +613,7 @@ int parent_fstatfd(DIR *dir,const char *path,size_t pathlen,struct stat *sb) {
   return ret;
 }
 
-/* similar_lstat -- uses either fstatfd or lustre_fstatfd to stat a
+/* similar_lstat -- uses fstatfd, statx or lustre_fstatfd to stat a
    file when a DIR* is not available.  You MUST use this function
    instead of stat or lstat otherwise the device and inode numbers
    will be wrong */
@@ -369,12 +632,17 @@ int similar_lstat(const char *name,struct stat *statbuf) {
     struct dirent *dent;
     while((dent=readdir(d)))
       if(!strcmp(bn,dent->d_name)) {
-        if((lustre_lstatfd(d,bn,0,statbuf)))
+        if((lustre_lstatfd(dirfd(d),bn,0,statbuf)))
           warn("%s: cannot stat using lustre stat: %s\n",name,strerror(errno));
         else
           statted=1;
         break;
       }
+  } else if(statx_mask) {
+    if((statx_lstatfd(dirfd(d),bn,statbuf)))
+      warn("%s: cannot stat using statx: %s\n",name,strerror(errno));
+    else
+      statted=1;
   } else if((fstatat(dirfd(d),bn,statbuf,AT_SYMLINK_NOFOLLOW)))
       warn("%s: cannot stat: %s\n",name,strerror(errno));
   else
@@ -28,13 +28,38 @@ extern "C" {
 
        fail -- abort the program with a message sent to stderr
 
-       warn/debug/debugn -- print a message at a specific verbosity level */
+       warn/debug/debugn -- print a message at a specific verbosity level
+
+     warn, debug and debugn are macros that test the verbosity inline,
+     so a message that is not wanted costs one compare and branch: the
+     function is not called and its arguments are not evaluated.  Do
+     not pass them arguments with side effects.
+
+     Messages that are wanted are formatted by the calling thread and
+     queued for a writer thread, which writes them to stderr in large
+     blocks, so the walker threads do not wait on stderr.  Messages
+     from one thread stay in order.  The queue is flushed by fail, by
+     log_flush and at exit; messages still queued when the program
+     crashes are lost. */
   void set_verbosity(int level);
   void increment_verbosity();
-  void fail(const char *format,...);
-  void warn(const char *format,...);
-  void debug(const char *format,...);
-  void debugn(int level,const char *format,...);
+  void fail(const char *format,...) __attribute__((noreturn,format(printf,1,2)));
+
+  /* log_verbosity -- the verbosity level.  Only change it with
+     set_verbosity or increment_verbosity. */
+  extern int log_verbosity;
+
+  /* log_message -- queue a message for stderr, regardless of the
+     verbosity.  Used by the macros below. */
+  void log_message(const char *format,...) __attribute__((format(printf,1,2)));
+
+  /* log_flush -- wait until every queued message has been written */
+  void log_flush(void);
+
+#define log_wanted(level) __builtin_expect(log_verbosity>=(level),0)
+#define warn(...) (log_wanted(VERB_WARN) ? log_message(__VA_ARGS__) : (void)0)
+#define debug(...) (log_wanted(VERB_DEBUG) ? log_message(__VA_ARGS__) : (void)0)
+#define debugn(level,...) (log_wanted(level) ? log_message(__VA_ARGS__) : (void)0)
 
   /* Verbosity levels: */
 
@@ -50,16 +75,84 @@ extern "C" {
   void set_use_lustre_stat(int yesno);
   int get_use_lustre_stat(void);
 
+  /* set/get statx_mask: when the mask is non-zero and Lustre stat is
+     not in use, stat with statx, requesting only the fields in this
+     STATX_* mask.  If dont_sync is set, AT_STATX_DONT_SYNC lets the
+     filesystem return cached, possibly stale, attributes. */
+  void set_statx_mask(unsigned mask,int dont_sync);
+  unsigned get_statx_mask(void);
+  int get_statx_flags(void);
+
   /* similar_lstat: an lstat implementation similar to the one used by
      the filesystem walker implementation.  This is needed as a
      workaround for a bug in the Lustre filesystem: the inode and
      device numbers for a file depend on how you stat the file. */
   int similar_lstat(const char *name,struct stat *sb);
 
-  /* Implementation of similar_lstat; don't call these two directly
+  /* lustre_layout -- the striping of a file, as found in the reply to
+     Lustre's stat ioctl.  pool, objects and comps point into that
+     reply.
+       kind -- one of the LUSTRE_LAYOUT_* below
+       stripe_count -- number of OST objects of a plain layout
+       stripe_size -- bytes per stripe of a plain layout
+       pool, poollen -- the OST pool, which is not null-terminated
+           (poollen is 0 if there is none)
+       objects -- the OST objects; see lustre_layout_ost
+       start, end -- the file offsets a plain layout holds: all of
+           them, or one component's extent (see lustre_layout_comp)
+       ncomps -- number of components of a composite layout
+       comps, limit -- the components and the end of the reply, for
+           lustre_layout_comp */
+#define LUSTRE_LAYOUT_NONE      0 /* no OST objects: no layout, released by HSM, or data on the MDT */
+#define LUSTRE_LAYOUT_PLAIN     1 /* one set of stripes (v1 or v3) */
+#define LUSTRE_LAYOUT_COMPOSITE 2 /* components, each plain (PFL, FLR) */
+#define LUSTRE_LAYOUT_UNKNOWN   3 /* anything else, or unreadable */
+  typedef struct lustre_layout {
+    int kind;
+    unsigned stripe_count, stripe_size;
+    const char *pool;
+    size_t poollen;
+    const void *objects;
+    uint64_t start, end;
+    unsigned ncomps;
+    const void *comps, *limit;
+  } lustre_layout;
+
+  /* lustre_stat -- stat name, in the directory open as dirfd, with
+     Lustre's lstat implementation: one IOC_MDC_GETFILEINFO ioctl,
+     which returns the file's layout as well as its attributes.
+     pathlen is the length of name, or 0 to have it worked out.  If
+     layout is non-NULL, it is filled in from the reply.
+
+     Returns the attributes, or NULL on failure with errno set.  They
+     and the layout are read in place from this thread's ioctl
+     buffer, so they are only valid until this thread's next
+     lustre_stat or lustre_lstatfd call.  Calls fail() if the buffer
+     cannot be allocated. */
+  const struct stat *lustre_stat(int dirfd,const char *name,size_t pathlen,
+                                 lustre_layout *layout);
+
+  /* lustre_layout_ost -- the OST index of object i (less than
+     stripe_count) of a plain layout */
+  unsigned lustre_layout_ost(const lustre_layout *layout,unsigned i);
+
+  /* lustre_layout_comp -- fill in comp with component i (less than
+     ncomps) of a composite layout, as a plain layout whose start and
+     end are the component's extent.  Returns 1 if the component has
+     OST objects, or 0 if it has none (it is not instantiated yet, or
+     holds data on the MDT) or cannot be read. */
+  int lustre_layout_comp(const lustre_layout *layout,unsigned i,lustre_layout *comp);
+
+  /* Implementation of similar_lstat; don't call these directly
      unless you know what you're doing.  See basic_utils.c for details. */
-  int lustre_lstatfd(DIR *dir,const char *name,size_t pathlen,struct stat *sb);
+  int lustre_lstatfd(int dirfd,const char *name,size_t pathlen,struct stat *sb);
   int parent_fstatfd(DIR *dir,const char *name,size_t pathlen,struct stat *sb);
+  int statx_lstatfd(int dirfd,const char *name,struct stat *sb);
+
+#ifdef STATX_BASIC_STATS
+  /* statx_to_stat: copy the fields of a statx structure to a stat structure */
+  void statx_to_stat(const struct statx *stx,struct stat *sb);
+#endif
 
   /* inthash32/64: integer hash functions */
   uint32_t inthash32(uint32_t key);
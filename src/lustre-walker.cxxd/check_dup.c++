@@ -5,45 +5,242 @@
 #define _ATFILE_SOURCE
 #endif
 
-#include <utility>
-#include <ext/hash_set>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "check_dup.h"
 #include "basic_utils.h"
+#include "checkpoint.h"
 
-using namespace std;
-using namespace __gnu_cxx;
+/* The set of files seen so far is kept in flat open-addressing hash
+   tables with linear probing: one array of fixed-size entries, with
+   no per-file allocations and no pointers.  A lookup and an insert
+   are the same probe: walk from the key's hash slot until finding
+   the key (already seen) or an empty slot (not seen; store it
+   there).  An all-zero entry is empty.
 
-typedef std::pair<dev_t,ino_t> devino;
+   Nearly every file fits in a 64-bit PackedKey: a small index into
+   the table of devices seen, and the inode number.  Lustre's inode
+   numbers are flattened FIDs, which use about 58 bits on current
+   filesystems, so 60 bits are kept for the inode.  Files on a 16th
+   device, or with larger inode numbers, go in a separate table of
+   128-bit WideKeys instead.  A given file always goes to the same
+   table, so the two never overlap. */
 
-namespace __gnu_cxx {
-  /* hash<devino>: implementation of the hash function for
-     device/inode number pairs.  This is needed for the "which files
-     have I seen" hashtable. */
-template<> struct hash<devino> {
-  size_t operator() (const devino &value) const {
-    return inthash64(value.first) ^ inthash64(value.second);
-  };
+/* PACKED_INO_BITS -- number of bits for the inode in a PackedKey.
+   The rest hold the device index plus one, so no PackedKey is zero. */
+#define PACKED_INO_BITS 60
+#define PACKED_INO_MASK ((((uint64_t)1)<<PACKED_INO_BITS)-1)
+#define MAX_PACKED_DEVS ((1<<(64-PACKED_INO_BITS))-1)
+
+/* MIN_TABLE_SIZE -- initial number of slots in a table.  Must be a
+   power of two. */
+#define MIN_TABLE_SIZE 1024
+
+struct PackedKey {
+  uint64_t bits;
+  inline bool empty() const { return !bits; }
+  inline uint64_t hash() const { return inthash64(bits); }
+  inline bool operator == (const PackedKey &k) const { return bits==k.bits; }
+};
+
+/* WideKey -- the device is stored plus one, so no WideKey is zero */
+struct WideKey {
+  uint64_t dev1,ino;
+  inline bool empty() const { return !dev1 && !ino; }
+  inline uint64_t hash() const { return inthash64(dev1) ^ inthash64(ino); }
+  inline bool operator == (const WideKey &k) const { return dev1==k.dev1 && ino==k.ino; }
+};
+
+/* FlatSet -- an open-addressing hash set of K, which must be a plain
+   struct whose all-zero value is the empty slot.  The table doubles
+   when it is 3/4 full, so it is between 3/8 and 3/4 full. */
+template<class K> class FlatSet {
+public:
+  FlatSet(): table(NULL),mask(0),count(0) {}
+  ~FlatSet() { free(table); }
+
+  /* test_and_insert -- returns true if k is in the set; otherwise,
+     inserts it and returns false */
+  bool test_and_insert(const K &k) {
+    if((count+1)*4>(mask+1)*3)
+      grow();
+    size_t i=k.hash()&mask;
+    while(!table[i].empty()) {
+      if(table[i]==k)
+        return true;
+      i=(i+1)&mask;
+    }
+    table[i]=k;
+    count++;
+    return false;
+  }
+
+  /* Number of keys, and bytes allocated for them */
+  inline size_t size() const { return count; }
+  inline size_t bytes() const { return table ? (mask+1)*sizeof(K) : 0; }
+
+  /* Visit every key */
+  template<class F> void foreach(F &f) const {
+    for(size_t i=0;table && i<=mask;i++)
+      if(!table[i].empty())
+        f(table[i]);
+  }
+
+  void clear() {
+    free(table);
+    table=NULL;
+    mask=count=0;
+  }
+private:
+  /* grow -- double the table size (or allocate the first table) and
+     move every key to its slot in the new table */
+  void grow() {
+    size_t oldsize=table ? mask+1 : 0, newsize=oldsize ? oldsize*2 : MIN_TABLE_SIZE;
+    K *old=table;
+    if(!(table=(K*)calloc(newsize,sizeof(K))))
+      fail("Cannot allocate %llu bytes for the duplicate file table: %s\n",
+           (unsigned long long)(newsize*sizeof(K)),strerror(errno));
+    mask=newsize-1;
+    for(size_t j=0;j<oldsize;j++)
+      if(!old[j].empty()) {
+        size_t i=old[j].hash()&mask;
+        while(!table[i].empty())
+          i=(i+1)&mask;
+        table[i]=old[j];
+      }
+    free(old);
+    debug("Duplicate file table now has %llu slots (%llu bytes) for %llu files\n",
+          (unsigned long long)newsize,(unsigned long long)(newsize*sizeof(K)),
+          (unsigned long long)count);
+  }
+
+  K *table;       // the slots, or NULL before the first insert
+  size_t mask;    // number of slots minus one
+  size_t count;   // number of keys
 };
+
+/* packed_hits, wide_hits -- the files seen so far.  devs is the
+   table of devices for packed_hits, with ndevs entries. */
+static FlatSet<PackedKey> packed_hits;
+static FlatSet<WideKey> wide_hits;
+static uint64_t devs[MAX_PACKED_DEVS];
+static size_t ndevs=0;
+
+/* hits_lock -- protects all of the above, since the walker may call
+   hit_file from many threads at once */
+static pthread_mutex_t hits_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/* dev_index -- returns the index of device in devs, adding it if
+   there is room, or -1 if it is not there and there is no room.
+   There are rarely more than one or two devices, so a linear search
+   is fine. */
+static int dev_index(uint64_t device) {
+  size_t i;
+  for(i=0;i<ndevs;i++)
+    if(devs[i]==device)
+      return (int)i;
+  if(ndevs>=MAX_PACKED_DEVS)
+    return -1;
+  devs[ndevs]=device;
+  return (int)ndevs++;
 }
 
-/* hits -- a set of files seen so far, identified only by the
-   device/inode number pair.  This is implemented by a GNU C++
-   hash_set, which is a hashtable implementation of a set. */
-static hash_set<devino> hits;
+/* test_and_insert -- hit_file without the lock */
+static int test_and_insert(uint64_t device,uint64_t inode) {
+  int index;
+  if(!(inode&~PACKED_INO_MASK) && (index=dev_index(device))>=0) {
+    PackedKey k;
+    k.bits=(((uint64_t)index+1)<<PACKED_INO_BITS) | inode;
+    return packed_hits.test_and_insert(k);
+  } else {
+    WideKey k;
+    k.dev1=device+1;
+    k.ino=inode;
+    return wide_hits.test_and_insert(k);
+  }
+}
+
+/* track_after -- files with one link and a ctime before this are
+   not tracked; see hit_file_policy.  track_all is set if every file
+   is tracked. */
+static time_t track_after=0;
+static int track_all=1;
+
+/* hit_file_policy: see check_dup.h */
+void hit_file_policy(double start_time,double window) {
+  track_all=(window<0);
+  track_after=(time_t)(start_time-window);
+  if(!track_all)
+    debug("Tracking duplicates only for directories, hard links and files changed since %lld\n",
+          (long long)track_after);
+}
+
+/* hit_file_tracked: see check_dup.h */
+int hit_file_tracked(const struct stat *s) {
+  return track_all || S_ISDIR(s->st_mode) || s->st_nlink!=1 || s->st_ctime>=track_after;
+}
 
 /* hit_file: called to indicate that a specific file has been seen.
    Returns 1 if we already saw the file before now, or 0 if we
    didn't. */
 int hit_file(dev_t device,ino_t inode) {
-  try {
-    devino di(device,inode);
-    if(hits.find(di)==hits.end()) {
-      hits.insert(di);
-      return 0;
-    } else
-      return 1;
-  } catch(...) {
-    return 0;
+  int ret;
+  pthread_mutex_lock(&hits_lock);
+  ret=test_and_insert(device,inode);
+  pthread_mutex_unlock(&hits_lock);
+  return ret;
+}
+
+/* hit_file_stats: see check_dup.h */
+void hit_file_stats(size_t *files,size_t *bytes) {
+  pthread_mutex_lock(&hits_lock);
+  *files=packed_hits.size()+wide_hits.size();
+  *bytes=packed_hits.bytes()+wide_hits.bytes();
+  pthread_mutex_unlock(&hits_lock);
+}
+
+/* SaveHit -- FlatSet::foreach callback for hit_file_save */
+struct SaveHit {
+  SaveHit(FILE *f): f(f) {}
+  void operator() (const PackedKey &k) {
+    ckpt_put_u64(f,devs[(k.bits>>PACKED_INO_BITS)-1]);
+    ckpt_put_u64(f,k.bits&PACKED_INO_MASK);
+  }
+  void operator() (const WideKey &k) {
+    ckpt_put_u64(f,k.dev1-1);
+    ckpt_put_u64(f,k.ino);
+  }
+  FILE *f;
+};
+
+/* hit_file_save: see check_dup.h */
+void hit_file_save(FILE *f) {
+  SaveHit save(f);
+  pthread_mutex_lock(&hits_lock);
+  ckpt_put_tag(f,"HITS");
+  ckpt_put_u64(f,packed_hits.size()+wide_hits.size());
+  packed_hits.foreach(save);
+  wide_hits.foreach(save);
+  pthread_mutex_unlock(&hits_lock);
+}
+
+/* hit_file_load: see check_dup.h */
+void hit_file_load(FILE *f) {
+  uint64_t n,dev,ino;
+  pthread_mutex_lock(&hits_lock);
+  ckpt_get_tag(f,"HITS");
+  packed_hits.clear();
+  wide_hits.clear();
+  ndevs=0;
+  for(n=ckpt_get_u64(f);n;n--) {
+    dev=ckpt_get_u64(f);
+    ino=ckpt_get_u64(f);
+    test_and_insert(dev,ino);
   }
+  pthread_mutex_unlock(&hits_lock);
 }
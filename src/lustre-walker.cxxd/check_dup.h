@@ -12,14 +12,42 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
   
   /* hit_file: returns 1 if hit_file has been called on this file
-     before, 0 otherwise. */
+     before, 0 otherwise.  Thread-safe. */
   int hit_file(dev_t device,ino_t inode);
 
+  /* hit_file_policy: decides which files hit_file_tracked wants.
+     Hard links are not the only way to see a file twice: a file can
+     be renamed from a directory already walked into one not yet
+     walked.  Files that change are the ones that get renamed, so a
+     file with only one link is tracked if its ctime is no more than
+     window seconds before the walk's start_time.  A file that was
+     unchanged for longer than that, and then renamed during the walk,
+     is counted twice, so this is only approximate.  A negative
+     window, the default, tracks every file. */
+  void hit_file_policy(double start_time,double window);
+
+  /* hit_file_tracked: returns 1 if hit_file must be called for the
+     object with stat structure s: directories, files with more than
+     one link, and files changed recently enough per
+     hit_file_policy.  Other files cannot be seen twice. */
+  int hit_file_tracked(const struct stat *s);
+
+  /* hit_file_stats: the number of files hit_file has seen, and the
+     number of bytes used to remember them */
+  void hit_file_stats(size_t *files,size_t *bytes);
+
+  /* hit_file_save/hit_file_load: write the set of files seen to a
+     checkpoint, or replace it with the set read from one.  See
+     checkpoint.h. */
+  void hit_file_save(FILE *f);
+  void hit_file_load(FILE *f);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "paranoia.h"
+#include "basic_utils.h"
+#include "checkpoint.h"
+
+/* CKPT_MAGIC -- first bytes of every checkpoint file.  Change the
+   version number whenever the contents change. */
+#define CKPT_MAGIC "LWCKPT10"
+#define CKPT_MAGIC_LEN 8
+
+/* tmp_path -- returns the malloced name of the temporary file used
+   while writing the checkpoint at path */
+static char *tmp_path(const char *path) {
+  size_t len=path_length(path,1);
+  char *tmp=(char*)malloc(len+5);
+  if(!tmp)
+    fail("Cannot allocate %llu bytes: %s\n",(unsigned long long)(len+5),strerror(errno));
+  memcpy(tmp,path,len);
+  memcpy(tmp+len,".tmp",5);
+  return tmp;
+}
+
+FILE *ckpt_create(const char *path) {
+  char *tmp=tmp_path(path);
+  FILE *f=fopen(tmp,"wb");
+  if(!f)
+    warn("%s: cannot create checkpoint: %s\n",tmp,strerror(errno));
+  else
+    ckpt_put(f,CKPT_MAGIC,CKPT_MAGIC_LEN);
+  free(tmp);
+  return f;
+}
+
+int ckpt_commit(FILE *f,const char *path) {
+  char *tmp=tmp_path(path);
+  int ret=-1;
+  ckpt_put_tag(f,"END.");
+  if(ferror(f) || fflush(f) || fsync(fileno(f))) {
+    warn("%s: cannot write checkpoint: %s\n",tmp,strerror(errno));
+    fclose(f);
+  } else if(fclose(f))
+    warn("%s: cannot write checkpoint: %s\n",tmp,strerror(errno));
+  else if(rename(tmp,path))
+    warn("%s: cannot rename checkpoint to %s: %s\n",tmp,path,strerror(errno));
+  else
+    ret=0;
+  if(ret)
+    unlink(tmp);
+  free(tmp);
+  return ret;
+}
+
+FILE *ckpt_reopen(const char *path,int64_t offset) {
+  char *tmp=tmp_path(path);
+  FILE *f=NULL;
+  if(truncate(tmp,(off_t)offset))
+    warn("%s: cannot truncate to checkpoint position: %s\n",tmp,strerror(errno));
+  else if(!(f=fopen(tmp,"ab")))
+    warn("%s: cannot reopen: %s\n",tmp,strerror(errno));
+  free(tmp);
+  return f;
+}
+
+FILE *ckpt_open(const char *path) {
+  FILE *f=ckpt_try_open(path);
+  if(!f)
+    fail("%s: cannot read checkpoint\n",path);
+  return f;
+}
+
+/* ckpt_try_open -- see checkpoint.h */
+FILE *ckpt_try_open(const char *path) {
+  char magic[CKPT_MAGIC_LEN];
+  FILE *f=fopen(path,"rb");
+  if(!f) {
+    warn("%s: cannot open checkpoint: %s\n",path,strerror(errno));
+    return NULL;
+  }
+  if(fread(magic,1,CKPT_MAGIC_LEN,f)!=CKPT_MAGIC_LEN || memcmp(magic,CKPT_MAGIC,CKPT_MAGIC_LEN)) {
+    warn("%s: not a lustre-walker checkpoint, or from an incompatible version\n",path);
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+int ckpt_sync_path(const char *path) {
+  int fd=open(path,O_RDONLY|O_CLOEXEC),ret;
+  if(fd<0)
+    return -1;
+  ret=fsync(fd);
+  close(fd);
+  return ret;
+}
+
+void ckpt_put(FILE *f,const void *data,size_t len) {
+  if(len)
+    fwrite(data,1,len,f);
+}
+
+void ckpt_get(FILE *f,void *data,size_t len) {
+  if(len && fread(data,1,len,f)!=len)
+    fail("Checkpoint is truncated or corrupt.\n");
+}
+
+void ckpt_put_tag(FILE *f,const char *tag) {
+  assert(strlen(tag)==4);
+  ckpt_put(f,tag,4);
+}
+
+void ckpt_get_tag(FILE *f,const char *tag) {
+  char got[4];
+  assert(strlen(tag)==4);
+  ckpt_get(f,got,4);
+  if(memcmp(got,tag,4))
+    fail("Checkpoint is corrupt: expected section %s, found %.4s\n",tag,got);
+}
+
+void ckpt_put_u64(FILE *f,uint64_t value) {
+  ckpt_put(f,&value,sizeof(value));
+}
+
+uint64_t ckpt_get_u64(FILE *f) {
+  uint64_t value;
+  ckpt_get(f,&value,sizeof(value));
+  return value;
+}
+
+void ckpt_put_double(FILE *f,double value) {
+  ckpt_put(f,&value,sizeof(value));
+}
+
+double ckpt_get_double(FILE *f) {
+  double value;
+  ckpt_get(f,&value,sizeof(value));
+  return value;
+}
+
+void ckpt_put_str(FILE *f,const char *str,size_t len) {
+  ckpt_put_u64(f,len);
+  ckpt_put(f,str,len);
+}
+
+char *ckpt_get_str(FILE *f,size_t *len) {
+  uint64_t n=ckpt_get_u64(f);
+  char *str;
+  if(n>MAX_PATH_LEN_CHAR)
+    fail("Checkpoint is corrupt: string of length %llu\n",(unsigned long long)n);
+  if(!(str=(char*)malloc(n+1)))
+    fail("Cannot allocate %llu bytes: %s\n",(unsigned long long)(n+1),strerror(errno));
+  ckpt_get(f,str,n);
+  str[n]='\0';
+  if(len)
+    *len=n;
+  return str;
+}
@@ -0,0 +1,83 @@
+#ifndef INC_CHECKPOINT
+#define INC_CHECKPOINT
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Checkpoint file input and output.  A checkpoint is a binary file
+     made of sections, each starting with a four-character tag, so a
+     truncated or mismatched file is detected rather than misread.
+     Numbers are written in the host's byte order, and stat
+     structures are written as-is: a checkpoint is only meant to be
+     read by the same program on the same kind of machine.
+
+     Writing: ckpt_create opens a temporary file next to the
+     checkpoint.  The ckpt_put* routines never fail; errors are
+     remembered by the FILE and reported by ckpt_commit, which
+     replaces the old checkpoint only if everything was written.
+
+     Reading: ckpt_open opens a checkpoint.  The ckpt_get* routines
+     call fail() if the file is truncated or corrupt, since a resumed
+     run cannot continue from half a checkpoint. */
+
+  /* ckpt_create -- start writing a new checkpoint for path.  Returns
+     NULL, after a warning, if the temporary file cannot be created. */
+  FILE *ckpt_create(const char *path);
+
+  /* ckpt_commit -- finish writing, flush the data to disk and
+     atomically replace the checkpoint at path.  Returns 0 on success,
+     or -1 after a warning, in which case the previous checkpoint (if
+     any) is untouched. */
+  int ckpt_commit(FILE *f,const char *path);
+
+  /* ckpt_reopen -- continue writing the file that ckpt_create
+     started for path, discarding anything after offset.  Used when a
+     file is written over the course of a walk that is resumed.
+     Returns NULL, after a warning, on failure. */
+  FILE *ckpt_reopen(const char *path,int64_t offset);
+
+  /* ckpt_open -- open the checkpoint at path for reading.  Calls
+     fail() if it cannot be opened or is not a checkpoint. */
+  FILE *ckpt_open(const char *path);
+
+  /* ckpt_try_open -- like ckpt_open, but returns NULL after a
+     warning instead of calling fail() */
+  FILE *ckpt_try_open(const char *path);
+
+  /* ckpt_sync_path -- flush the file at path to disk.  Used to make
+     sure report files are on disk up to the offsets a checkpoint
+     records.  Returns 0 on success. */
+  int ckpt_sync_path(const char *path);
+
+  /* Tags, raw data, integers and strings: */
+  void ckpt_put_tag(FILE *f,const char *tag);
+  void ckpt_get_tag(FILE *f,const char *tag);
+  void ckpt_put(FILE *f,const void *data,size_t len);
+  void ckpt_get(FILE *f,void *data,size_t len);
+  void ckpt_put_u64(FILE *f,uint64_t value);
+  uint64_t ckpt_get_u64(FILE *f);
+  void ckpt_put_double(FILE *f,double value);
+  double ckpt_get_double(FILE *f);
+  void ckpt_put_str(FILE *f,const char *str,size_t len);
+
+  /* ckpt_get_str -- returns a malloced, null-terminated string and
+     sets *len (if len is not NULL) to its length */
+  char *ckpt_get_str(FILE *f,size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_CHECKPOINT */
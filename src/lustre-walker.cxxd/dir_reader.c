@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "basic_utils.h"
+#include "dir_reader.h"
+
+/* linux_dirent64 -- the record format returned by getdents64.  Older
+   C libraries do not declare it, so we declare it ourselves. */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct dir_reader {
+  int fd;              /* directory being read */
+  char *buf;           /* getdents64 buffer */
+  size_t bufsize;      /* size of buf */
+  dir_entry *entries;  /* decoded entries from buf */
+  size_t maxentries;   /* allocated size of entries */
+};
+
+dir_reader *dr_create(size_t bufsize) {
+  dir_reader *r;
+  if(bufsize<DR_MIN_BUFFER)
+    bufsize=DR_MIN_BUFFER;
+  if(!(r=(dir_reader*)calloc(1,sizeof(dir_reader))) || !(r->buf=(char*)malloc(bufsize)))
+    fail("Cannot allocate %llu bytes for directory reading: %s\n",
+         (unsigned long long)bufsize,strerror(errno));
+  r->bufsize=bufsize;
+  r->fd=-1;
+  /* Each record is at least 24 bytes, so this is enough for a full buffer */
+  r->maxentries=bufsize/(offsetof(struct linux_dirent64,d_name)+1)+1;
+  if(!(r->entries=(dir_entry*)malloc(r->maxentries*sizeof(dir_entry))))
+    fail("Cannot allocate %llu bytes for directory reading: %s\n",
+         (unsigned long long)(r->maxentries*sizeof(dir_entry)),strerror(errno));
+  return r;
+}
+
+void dr_destroy(dir_reader *r) {
+  if(!r) return;
+  free(r->buf);
+  free(r->entries);
+  free(r);
+}
+
+void dr_start(dir_reader *r,int fd) {
+  r->fd=fd;
+}
+
+ssize_t dr_read_batch(dir_reader *r,const dir_entry **entries) {
+  long nread;
+  size_t off,count;
+  struct linux_dirent64 *d;
+  dir_entry *e;
+  assert(r->fd>=0);
+
+  /* A batch may consist of only . and .., so keep reading until we
+     have something to return or reach the end. */
+  do {
+    nread=syscall(SYS_getdents64,r->fd,r->buf,r->bufsize);
+    if(nread<=0)
+      return nread<0 ? -1 : 0;
+
+    count=0;
+    for(off=0;off<(size_t)nread;off+=d->d_reclen) {
+      d=(struct linux_dirent64*)(r->buf+off);
+      if(d->d_name[0]=='.' && (d->d_name[1]=='\0' ||
+                               (d->d_name[1]=='.' && d->d_name[2]=='\0')))
+        continue; /* skip . and .. */
+      assert(count<r->maxentries);
+      e=&r->entries[count++];
+      e->name=d->d_name;
+      e->namelen=strnlen(d->d_name,d->d_reclen-offsetof(struct linux_dirent64,d_name));
+      e->ino=d->d_ino;
+      e->type=d->d_type;
+    }
+  } while(!count);
+
+  *entries=r->entries;
+  return (ssize_t)count;
+}
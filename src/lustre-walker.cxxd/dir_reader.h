@@ -0,0 +1,63 @@
+#ifndef INC_DIR_READER
+#define INC_DIR_READER
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <dirent.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* dir_reader -- reads directory entries in large batches using the
+     getdents64 system call directly.  The C library's readdir uses a
+     small buffer, which on Lustre means many small readdir RPCs for
+     a big directory.  A dir_reader owns one buffer, which is reused
+     for every directory it reads, so each walker thread should have
+     its own.
+
+     The . and .. entries are never returned. */
+  typedef struct dir_reader dir_reader;
+
+  /* dir_entry -- one directory entry in a batch.  The name is
+     null-terminated and points into the reader's buffer, so it is
+     only valid until the next dr_read_batch call. */
+  typedef struct dir_entry {
+    const char *name;    /* file basename */
+    size_t namelen;      /* strlen(name) */
+    uint64_t ino;        /* inode number from the directory */
+    unsigned char type;  /* DT_* file type, or DT_UNKNOWN if the filesystem does not say */
+  } dir_entry;
+
+  /* DR_MIN_BUFFER/DR_DEFAULT_BUFFER -- the smallest allowed and the
+     default buffer sizes in bytes */
+#define DR_MIN_BUFFER 32768
+#define DR_DEFAULT_BUFFER 1048576
+
+  /* dr_create -- create a reader with a bufsize-byte buffer.
+     Allocation failures call fail(). */
+  dir_reader *dr_create(size_t bufsize);
+  void dr_destroy(dir_reader *r);
+
+  /* dr_start -- start reading the open directory fd from its
+     current position.  The reader does not close fd. */
+  void dr_start(dir_reader *r,int fd);
+
+  /* dr_read_batch -- read the next batch of entries.  Sets *entries
+     to an array of them and returns the number in the array.
+     Returns 0 at the end of the directory, or -1 with errno set on
+     error. */
+  ssize_t dr_read_batch(dir_reader *r,const dir_entry **entries);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_DIR_READER */
@@ -12,10 +12,15 @@
 #include <grp.h>
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
 
 #include <iomanip>
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <iostream>
@@ -24,6 +29,9 @@
 
 #include "basic_utils.h"
 #include "disk_usage.h"
+#include "checkpoint.h"
+#include "file_list.h"
+#include "task_queue.h"
 
 using namespace std;
 using namespace __gnu_cxx;
@@ -36,6 +44,69 @@ string str_hostname();
 string xmlify(const string &str);
 string globify(const string &str);
 
+/* xml_escape_needed -- true if xmlify would change any of the n
+   characters at str.  xml_escape appends them to out as xmlify
+   would. */
+bool xml_escape_needed(const char *str,size_t n);
+void xml_escape(string &out,const char *str,size_t n);
+
+/* XmlText -- a string to be escaped as xmlify does when written to an
+   XmlWriter */
+struct XmlText {
+  XmlText(const string &s): s(s) {}
+  const string &s;
+};
+inline XmlText xml_text(const string &s) { return XmlText(s); }
+
+/* XmlWriter -- output for the XML usage reports.  Reports can have
+   hundreds of thousands of entries, so rather than an ostream, which
+   flushes at every endl and formats numbers through the locale, this
+   fills a large buffer and writes it with write(2) when it is full.
+   Numbers are formatted by hand, and strings that need no escaping
+   are copied straight in.  Errors are warned about, once, and the
+   rest of the report is dropped. */
+#define XML_BUFFER_SIZE (4*1048576)
+class XmlWriter {
+public:
+  XmlWriter(const string &where);
+  ~XmlWriter() { close(); }
+  inline bool is_open() const { return fd>=0; }
+  /* close -- write what is buffered and close the file.  Returns
+     false if the report could not be created or written in full. */
+  bool close();
+
+  XmlWriter &write(const char *s,size_t n) {
+    if(used+n>XML_BUFFER_SIZE) {
+      flush();
+      if(n>XML_BUFFER_SIZE)
+        return write_direct(s,n);
+    }
+    memcpy(buffer+used,s,n);
+    used+=n;
+    return *this;
+  }
+  inline XmlWriter &operator<<(const char *s) { return write(s,strlen(s)); }
+  inline XmlWriter &operator<<(const string &s) { return write(s.data(),s.size()); }
+  inline XmlWriter &operator<<(char c) { return write(&c,1); }
+  XmlWriter &operator<<(const XmlText &t);
+  XmlWriter &operator<<(unsigned long long n);
+  XmlWriter &operator<<(long long n);
+  inline XmlWriter &operator<<(unsigned long n) { return *this<<(unsigned long long)n; }
+  inline XmlWriter &operator<<(unsigned n) { return *this<<(unsigned long long)n; }
+  inline XmlWriter &operator<<(long n) { return *this<<(long long)n; }
+  inline XmlWriter &operator<<(int n) { return *this<<(long long)n; }
+  /* doubles are written with 16 significant digits */
+  XmlWriter &operator<<(double d);
+private:
+  void flush();
+  XmlWriter &write_direct(const char *s,size_t n);
+  string where;
+  int fd;
+  char *buffer;
+  size_t used;
+  bool ok;
+};
+
 /* inthash -- hash function for integers, accepting unsigned 32 or
    64-bit integers */
 inline uint32_t inthash(uint32_t u) { return inthash32(u); }
@@ -81,6 +152,9 @@ public:
   /* get_path: gets the name of this file */
   inline const string &get_path() const { return dirname; }  
 
+  /* get_stat: gets the stat structure for this file */
+  inline const struct stat &get_stat() const { return info; }
+
   /* Is this file a directory targeted for usage information? */
   inline bool is_targeted() const {
     if(have_targeted)
@@ -148,7 +222,7 @@ protected:
   /* find_name: used to determine the username if it is not yet known */
   const string &find_name() const;
 private:
-  mutable string name; /* for caching results of find_name */
+  mutable string name; /* for caching results of find_name (see NameCache) */
   uid_t uid;
 };
 
@@ -178,6 +252,78 @@ private:
   gid_t gid;
 };
 
+/* SIZE_BUCKETS, AGE_BUCKETS -- number of buckets in the size and age
+   histograms.  Bucket 0 holds size 0 (or ages under a day), and
+   bucket b>0 holds [2^(b-1),2^b) bytes (or days).  The last bucket
+   also holds everything larger. */
+#define SIZE_BUCKETS 48
+#define AGE_BUCKETS 20
+
+/* NEVER -- a time later than any other */
+#define NEVER ((int64_t)(~(uint64_t)0>>1))
+
+/* log2_bucket -- the histogram bucket for n, without branches */
+inline unsigned log2_bucket(uint64_t n,unsigned nbuckets) {
+  unsigned b=64-__builtin_clzll(n|1)-(n==0);
+  return b<nbuckets ? b : nbuckets-1;
+}
+
+/* Histogram -- number and total size of files in each of N buckets
+   of a size or age histogram.  Counting a file is two adds to fixed
+   slots, with no search or allocation, since it happens for every
+   file while the usage lock is held.  Only the non-empty buckets are
+   written to checkpoints, the index and reports, since most usage
+   entries only see a few buckets. */
+template<unsigned N> class Histogram {
+public:
+  Histogram() { clear(); }
+
+  /* add -- count a file of this many bytes in bucket b */
+  inline void add(unsigned b,uint64_t size) {
+    count[b]++;
+    bytes[b]+=size;
+  }
+
+  /* merge -- add the counts of another histogram */
+  void merge(const Histogram &h) {
+    for(unsigned b=0;b<N;b++) {
+      count[b]+=h.count[b];
+      bytes[b]+=h.bytes[b];
+    }
+  }
+
+  void clear() {
+    memset(count,0,sizeof(count));
+    memset(bytes,0,sizeof(bytes));
+  }
+
+  /* save/load -- the number of non-empty buckets, then each one */
+  void save(FILE *f) const {
+    unsigned b,n=0;
+    for(b=0;b<N;b++)
+      n+=(count[b]!=0);
+    ckpt_put_u64(f,n);
+    for(b=0;b<N;b++)
+      if(count[b]) {
+        ckpt_put_u64(f,b);
+        ckpt_put_u64(f,count[b]);
+        ckpt_put_u64(f,bytes[b]);
+      }
+  }
+  void load(FILE *f) {
+    uint64_t n=ckpt_get_u64(f), b;
+    clear();
+    while(n--) {
+      if((b=ckpt_get_u64(f))>=N || count[b])
+        fail("Checkpoint is corrupt: histogram bucket %llu\n",(unsigned long long)b);
+      count[b]=ckpt_get_u64(f);
+      bytes[b]=ckpt_get_u64(f);
+    }
+  }
+
+  uint64_t count[N],bytes[N];
+};
+
 /* UsageInfo: records disk usage information for a set of files.  This
    object has no idea what the set of files may be.  All it knows is
    the statistics it has collected. */
@@ -193,12 +339,20 @@ public:
   */
   void add(const struct stat *s,int type);
 
+  /* merge -- add the statistics collected by another UsageInfo */
+  void merge(const UsageInfo &u);
+
   /* clear -- clear all usage statistics */
   void clear();
 
+  /* save/load -- write the statistics to a checkpoint, or replace
+     them with ones read from a checkpoint */
+  void save(FILE *f) const;
+  void load(FILE *f);
+
   /* xml_report -- generate an XML report on the usage, and send it to
      ostream &o.  The indent is prepended to each line */
-  void xml_report(ostream &o,const string &indent="") const;
+  void xml_report(XmlWriter &o,const string &indent="") const;
 private:
   /* MEMBER VARIABLES
 
@@ -219,6 +373,11 @@ private:
 
      duplicate_objects -- number of duplicate device/inode pairs
      deleted_fsobj -- number of filesystem objects deleted
+
+     sizes -- number and total size of regular files in each log2
+       size bucket (see log2_bucket)
+     ages -- the same, by log2 of days since the last modification
+       (see age_bucket)
   */
   size_t regulars,dirs,links,others,bytes;
   time_t latest_a,latest_m,latest_c;
@@ -226,6 +385,8 @@ private:
   size_t big_files;
   size_t dir_unopenable,dir_too_deep,filename_too_long,path_too_long;
   size_t duplicate_objects,deleted_fsobj;
+  Histogram<SIZE_BUCKETS> sizes;
+  Histogram<AGE_BUCKETS> ages;
 };
 
 // hash function wrappers for __gnu_cxx::hash_set and hash_map:
@@ -247,21 +408,287 @@ template<> struct hash<FObjInfo> {
 };
 }
 
+/* DirKey -- identifies a directory in the incremental index */
+struct DirKey {
+  DirKey(): dev(0),ino(0) {}
+  DirKey(const struct stat *s): dev(s->st_dev),ino(s->st_ino) {}
+  inline bool operator == (const DirKey &k) const { return dev==k.dev && ino==k.ino; }
+  uint64_t dev,ino;
+};
+namespace __gnu_cxx {
+template<> struct hash<DirKey> {
+  size_t operator() (const DirKey &value) const {
+    return inthash(value.dev) ^ inthash(value.ino);
+  };
+};
+}
+
+/* UsageLock -- holds usage_lock for the lifetime of the object.  All
+   access to the usage statistics and reports must happen while
+   holding this lock, since the walker may call us_* functions from
+   many threads. */
+static pthread_mutex_t usage_lock=PTHREAD_MUTEX_INITIALIZER;
+class UsageLock {
+public:
+  UsageLock() { pthread_mutex_lock(&usage_lock); }
+  ~UsageLock() { pthread_mutex_unlock(&usage_lock); }
+};
+
 /* typedefs needed for static members: */
-typedef vector<FObjInfo> FObjList;
 typedef hash_set<FObjInfo> FObjSet;
-typedef vector<FObjInfo>::iterator dir_iterator;
 
-typedef hash_map<UserInfo,UsageInfo> UserUsage;
-typedef hash_map<FObjInfo,UsageInfo> DirUsage;
-typedef hash_map<FObjInfo,UserUsage> DirUserUsage;
-typedef hash_map<UserInfo,DirUsage> UserDirUsage;
+/* PairUsage -- usage by owner and group.  The key is either an
+   owner_key (uid and gid) or an id_key (interned ids; see IdTable). */
+typedef hash_map<uint64_t,UsageInfo> PairUsage;
+inline uint64_t owner_key(const struct stat *s) {
+  return (((uint64_t)s->st_uid)<<32) | (uint32_t)s->st_gid;
+}
+inline uint64_t id_key(uint32_t first,uint32_t second) {
+  return (((uint64_t)first)<<32) | second;
+}
+inline uint32_t key_first(uint64_t key) { return (uint32_t)(key>>32); }
+inline uint32_t key_second(uint64_t key) { return (uint32_t)key; }
+
+/* IdTable -- interns the owners or groups (T is UserInfo or
+   GroupInfo) seen in the usage statistics, numbering them densely
+   from 0, so that per-owner and per-group statistics can be kept in
+   vectors.  The T for each id holds the name, once it is looked
+   up. */
+template<class T> class IdTable {
+public:
+  /* intern -- returns the id for uid or gid raw, adding it if needed */
+  uint32_t intern(uint32_t raw) {
+    hash_map<uint32_t,uint32_t>::const_iterator i=ids.find(raw);
+    if(i!=ids.end())
+      return i->second;
+    uint32_t id=(uint32_t)items.size();
+    items.push_back(T(raw));
+    ids[raw]=id;
+    return id;
+  }
+  inline size_t size() const { return items.size(); }
+  inline const T &operator[](size_t id) const { return items[id]; }
+  void clear() { ids.clear(); items.clear(); }
+private:
+  hash_map<uint32_t,uint32_t> ids; // uid or gid to id
+  vector<T> items;                 // id to user or group
+};
+
+/* TopPaths -- the paths of the files in the TopFiles heaps, stored
+   once each however many heaps hold the file, and freed when the
+   last heap drops it.  This keeps memory proportional to the heap
+   sizes. */
+class TopPaths {
+public:
+  /* add -- store path, with no references yet */
+  uint32_t add(const string &path) {
+    uint32_t id;
+    if(!unused.empty()) {
+      id=unused.back();
+      unused.pop_back();
+      paths[id]=path;
+    } else {
+      id=(uint32_t)paths.size();
+      paths.push_back(path);
+      refs.push_back(0);
+    }
+    return id;
+  }
+  inline void ref(uint32_t id) { refs[id]++; }
+  void unref(uint32_t id) {
+    if(!--refs[id]) {
+      string().swap(paths[id]);
+      unused.push_back(id);
+    }
+  }
+  inline const string &operator[](uint32_t id) const { return paths[id]; }
+  void clear() { paths.clear(); refs.clear(); unused.clear(); }
+private:
+  vector<string> paths;
+  vector<uint32_t> refs;
+  vector<uint32_t> unused; // ids of freed paths, for reuse
+};
+
+/* TopEntry -- one file in a TopFiles heap: its size and the id of
+   its path in a TopPaths */
+struct TopEntry {
+  uint64_t size;
+  uint32_t path;
+};
+/* top_larger -- heap order for TopFiles: the smallest file on top */
+inline bool top_larger(const TopEntry &a,const TopEntry &b) {
+  return a.size>b.size;
+}
+
+/* TopFiles -- the largest files seen for one owner, group or
+   targeted directory: a min-heap of at most top_n entries, so a new
+   file only has to be compared to the smallest kept. */
+class TopFiles {
+public:
+  /* wants -- true if a file of this size would be kept */
+  inline bool wants(uint64_t size,size_t max) const {
+    return max && (heap.size()<max || size>heap.front().size);
+  }
+  /* insert -- keep the file, dropping the smallest if there are more
+     than max.  The file must be wanted. */
+  void insert(const TopEntry &e,size_t max,TopPaths &paths) {
+    if(heap.size()>=max) {
+      pop_heap(heap.begin(),heap.end(),top_larger);
+      paths.unref(heap.back().path);
+      heap.pop_back();
+    }
+    heap.push_back(e);
+    push_heap(heap.begin(),heap.end(),top_larger);
+    paths.ref(e.path);
+  }
+  /* sorted -- the entries, largest first */
+  vector<TopEntry> sorted() const {
+    vector<TopEntry> v(heap);
+    sort(v.begin(),v.end(),top_larger);
+    return v;
+  }
+  inline bool empty() const { return heap.empty(); }
+  void clear() { heap.clear(); }
+private:
+  vector<TopEntry> heap;
+};
+
+/* FileCount -- a number of files (or objects) and their bytes */
+struct FileCount {
+  FileCount(): files(0),bytes(0) {}
+  uint64_t files,bytes;
+};
 
-typedef hash_map<GroupInfo,UsageInfo> GroupUsage;
-typedef hash_map<FObjInfo,GroupUsage> DirGroupUsage;
-typedef hash_map<UserInfo,GroupUsage> UserGroupUsage;
-typedef hash_map<GroupInfo,UserUsage> GroupUserUsage;
-typedef hash_map<FObjInfo,GroupUserUsage> DirGroupUserUsage;
+/* PurgeTotals -- what each simulated purge candidate would delete for
+   one owner, group or targeted directory: the number of files and
+   directories, and their bytes, indexed like purge_ages. */
+typedef vector<FileCount> PurgeTotals;
+
+/* LayoutTotals -- the Lustre striping of one owner's, group's or
+   targeted directory's regular files (see us_layout_found):
+     stripes -- files and bytes by stripe count, for files with OST
+         objects
+     pools -- files and bytes by OST pool, for files in a pool
+     osts -- OST objects and the bytes in them, by OST index
+     composite -- files and bytes with composite layouts, which are
+         also in stripes
+     no_objects -- files and bytes with no OST objects
+     unknown -- files and bytes whose layouts could not be read
+   Maps, not hashes, so the reports list them in order. */
+struct LayoutTotals {
+  map<uint32_t,FileCount> stripes, osts;
+  map<string,FileCount> pools;
+  FileCount composite, no_objects, unknown;
+  inline bool empty() const { return stripes.empty() && !no_objects.files && !unknown.files; }
+};
+
+/* NameCache -- process-wide cache of user or group names by uid or
+   gid.  getpwuid and getgrgid may each be a round trip to a
+   directory service (nss, sssd, LDAP), so each id is resolved at
+   most once, by the resolve function, and the result (a name, or
+   the number if there is none) is kept for the rest of the run.
+   The cache may be filled in advance from a passwd or group file;
+   see us_load_names.  Thread-safe; resolve is called with the lock
+   held, since getpwuid and getgrgid are not. */
+class NameCache {
+public:
+  NameCache(string (*resolve)(uint32_t id)): resolve(resolve) {
+    pthread_mutex_init(&lock,NULL);
+  }
+
+  /* get -- returns the name for id.  Names are never removed, so
+     the string stays valid for the rest of the run. */
+  const char *get(uint32_t id) {
+    const char *name;
+    pthread_mutex_lock(&lock);
+    hash_map<uint32_t,string>::const_iterator i=names.find(id);
+    if(i!=names.end())
+      name=i->second.c_str();
+    else
+      name=(names[id]=resolve(id)).c_str();
+    pthread_mutex_unlock(&lock);
+    return name;
+  }
+
+  /* load -- read names from a file in passwd(5) or group(5) format,
+     whose first field is the name and third is the id.  Returns the
+     number of names read, or -1 if the file cannot be opened. */
+  long load(const char *path) {
+    ifstream in(path);
+    string line;
+    long count=0;
+    if(!in.is_open())
+      return -1;
+    pthread_mutex_lock(&lock);
+    while(getline(in,line)) {
+      size_t c1=line.find(':'), c2, c3;
+      if(c1==0 || c1==string::npos
+         || (c2=line.find(':',c1+1))==string::npos)
+        continue;
+      c3=line.find(':',c2+1);
+      string num=line.substr(c2+1,c3==string::npos ? string::npos : c3-c2-1);
+      char *end;
+      unsigned long id=strtoul(num.c_str(),&end,10);
+      if(num.empty() || *end || (uint32_t)id!=id)
+        continue;
+      if(names.find((uint32_t)id)==names.end()) { // first entry wins, as in getpwuid
+        names[(uint32_t)id]=line.substr(0,c1);
+        count++;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+    return count;
+  }
+private:
+  pthread_mutex_t lock;
+  hash_map<uint32_t,string> names;
+  string (*resolve)(uint32_t id);
+};
+
+/* us_record -- an entry in the incremental index: what the files
+   directly within one directory contributed to the usage statistics
+   when it was scanned.  See disk_usage.h. */
+struct us_record {
+  us_record(): spoiled(false),ages_until(0),nfiles(0) {}
+  us_record(const struct stat *s):
+    key(s),mtime(s->st_mtim),ctime(s->st_ctim),spoiled(false),ages_until(NEVER),nfiles(0) {}
+  DirKey key;                // directory's device and inode
+  struct timespec mtime,ctime; // directory's times when it was scanned
+  bool spoiled;              // true if this must not go in the index
+  int64_t ages_until;        // first age_reference at which a file's age bucket differs
+  size_t nfiles;             // number of files (not subdirectories)
+  vector<string> subdirs;    // names of subdirectories
+  PairUsage usage;           // usage of the files, by owner_key
+  vector<FObjInfo> big;      // big files, with basenames for paths
+};
+typedef hash_map<DirKey,us_record*> RecordMap;
+
+/* us_frame -- per-directory usage context handed to the walker by
+   us_dir_enter.  Frames only exist for directories targeted for usage
+   information; other directories share their parent's frame.  Each
+   frame links to the frame of the nearest enclosing targeted
+   directory (up), so following the "up" links visits every targeted
+   directory containing a file.  This replaces a single global stack
+   of targeted directories, which could not work when several
+   directories are walked at once.
+
+   A file only updates the accumulator of its innermost frame, which
+   sums usage by owner_key.  When the frame is left, the sum goes in
+   its directory's table and is added to the enclosing frame's
+   accumulator, so each targeted directory's table is updated once,
+   not once per file.  Files outside every targeted directory, and the
+   sums of outermost frames, go to the outside accumulator, from which
+   the whole-walk table is made.  Live frames are kept in a list
+   (prev/next) so a checkpoint can find them. */
+struct us_frame {
+  us_frame(us_frame *up,const FObjInfo &dir,uint32_t id):
+    up(up),dir(dir),id(id),prev(NULL),next(NULL) {}
+  us_frame *up;   // enclosing targeted directory's frame, or NULL
+  FObjInfo dir;   // the targeted directory
+  uint32_t id;    // its index in targets
+  PairUsage acc;  // usage in this directory not yet in the tables
+  us_frame *prev,*next; // neighbors in live_frames
+};
 
 /**********************************************************************/
 /**********************************************************************/
@@ -273,31 +700,104 @@ typedef hash_map<FObjInfo,GroupUserUsage> DirGroupUserUsage;
 
 /* GLOBALS */
 
-FILE *file_lister=NULL;
+/* The all-files listing: */
+file_list *file_lister=NULL;
 int list_all_files=0;
-
-static hash_set<FObjInfo> target_dirs;
-static FObjList dir_stack;
-
-static DirUserUsage dir_user_usage;
-static UserDirUsage user_dir_usage;
-static DirUsage dir_usage;
-static UserUsage user_usage;
-static UsageInfo all_usage;
-
-static GroupUsage group_usage;
-static DirGroupUsage dir_group_usage;
-static UserGroupUsage user_group_usage;
-static GroupUserUsage group_user_usage;
-static DirGroupUserUsage dir_group_user_usage;
+int list_format=FL_TEXT;
+
+/* user_names, group_names -- names of every uid and gid seen; see
+   NameCache and UserInfo::find_name */
+static string resolve_user(uint32_t uid);
+static string resolve_group(uint32_t gid);
+static NameCache user_names(resolve_user), group_names(resolve_group);
+
+/* user_name, group_name -- fl_name_func for the all-files listing */
+static const char *user_name(uint32_t uid) { return user_names.get(uid); }
+static const char *group_name(uint32_t gid) { return group_names.get(gid); }
+
+/* Targeted directories.  target_ids maps each to its index in
+   targets, which holds the path it was first entered by. */
+static hash_map<FObjInfo,uint32_t> target_ids;
+static vector<FObjInfo> targets;
+
+/* The usage statistics.  Only the finest breakdown is kept: by owner
+   and group (using id_keys) over the whole walk, and the same for
+   each targeted directory, indexed like targets.  Every report is
+   made from these two tables; see make_report. */
+static IdTable<UserInfo> user_ids;
+static IdTable<GroupInfo> group_ids;
+static PairUsage walk_usage;
+static vector<PairUsage> target_usage;
+static PairUsage outside_acc; // see us_frame
+static us_frame *live_frames=NULL; // see us_frame
 
 /* Parameters settable by us_* routines */
 static size_t big_file_size=104857600;
+
+/* age_reference -- the time from which the ages in the age
+   histograms are measured: when the walk started */
+static time_t age_reference=0;
+
+/* age_bucket -- the age histogram bucket of a file with this mtime.
+   age_bucket_end -- the first age_reference at which that file would
+   be in a different bucket: once a file is 2^b days old it leaves
+   bucket b.  Files in the last bucket stay there. */
+static unsigned age_bucket(time_t mtime) {
+  int64_t age=((int64_t)age_reference-(int64_t)mtime)/86400;
+  return log2_bucket(age>0 ? age : 0,AGE_BUCKETS);
+}
+static int64_t age_bucket_end(time_t mtime) {
+  unsigned b=age_bucket(mtime);
+  if(b==AGE_BUCKETS-1)
+    return NEVER;
+  return (int64_t)mtime+(((int64_t)86400)<<b);
+}
 static FObjSet big_files;
 
+/* Top-N mode (us_set_top_files): the top_n largest big files for
+   each owner, group and targeted directory, indexed by the ids in
+   user_ids, group_ids and targets.  When top_n is 0, big files are
+   listed in the big-files reports instead. */
+static size_t top_n=0;
+static TopPaths top_paths;
+static vector<TopFiles> user_top, group_top, target_top;
+
+/* Purge simulation (us_set_purge_candidates): the age in seconds and
+   minimum depth of each candidate, and what each would delete for
+   each owner, group and targeted directory, indexed like the top-N
+   heaps. */
+static vector<int64_t> purge_ages;
+static vector<int> purge_depths;
+static vector<PurgeTotals> user_purge, group_purge, target_purge;
+
+/* Layout accounting (us_account_layouts): the striping of the files
+   of each owner, group and targeted directory, indexed like the
+   top-N heaps. */
+static int account_layouts=0;
+static vector<LayoutTotals> user_layout, group_layout, target_layout;
+
 /* Output streams for "big file" listings */
 static ofstream big_glob_report, big_print0_report, big_text_report, big_xml_report;
 
+/* report_threads -- how many reports to write at once (see
+   run_report_jobs).  sort_reports -- see plan_report_order. */
+static size_t report_threads=1;
+static int sort_reports=0;
+
+/* report_prefix -- the prefix given to us_start_reports or us_restore */
+static string report_prefix;
+
+/* Incremental index (see us_index_start):
+     index_path -- where the index lives, or empty if there is none
+     old_index -- records read from the last run's index
+     index_out -- the new index being written, or NULL
+     index_lock -- protects index_out */
+static string index_path;
+static RecordMap old_index;
+static FILE *index_out=NULL;
+static pthread_mutex_t index_lock=PTHREAD_MUTEX_INITIALIZER;
+static void start_index();
+
 /* How many "big file" FObjInfo objects can we cache before writing
    them out to the "big file" listing files: */
 static size_t max_big_files_in_mem=3000;
@@ -312,6 +812,25 @@ void us_set_big_file_size(size_t size) {
 size_t us_get_big_file_size() {
   return big_file_size;
 }
+void us_set_top_files(size_t n) {
+  top_n=n;
+}
+void us_report_threads(size_t n) {
+  report_threads=n ? n : 1;
+}
+void us_sort_reports(int shouldi) {
+  sort_reports=shouldi;
+}
+
+void us_set_purge_candidates(size_t n,const int64_t *ages,const int *min_depths) {
+  assert(n<=64);
+  purge_ages.assign(ages,ages+n);
+  purge_depths.assign(min_depths,min_depths+n);
+}
+
+void us_account_layouts(int shouldi) {
+  account_layouts=shouldi;
+}
 
 void us_list_all_files(int shouldi) {
   list_all_files=shouldi;
@@ -319,6 +838,15 @@ void us_list_all_files(int shouldi) {
 int us_get_list_all_files() {
   return list_all_files;
 }
+void us_list_format(int format) {
+  list_format=format;
+}
+
+/* lister_path -- where the all-files listing goes */
+static string lister_path(const string &pre) {
+  return pre+(list_format==FL_BINARY ? "all-files.bin" :
+              list_format==FL_COLUMNS ? "all-files.col" : "all-files.lst");
+}
 
 /**********************************************************************/
 
@@ -329,51 +857,284 @@ int us_get_list_all_files() {
      indent -- string to prepend to each line
 */
 
-void xml_report(ostream &o,const UsageInfo &u,const string &indent="") {
+void xml_report(XmlWriter &o,const UsageInfo &u,const string &indent="") {
   u.xml_report(o,indent);
 }
 
-template<class T>
-void xml_report(ostream &o,const hash_map<GroupInfo,T> &u,const string &indent="") {
-  string more_indent=indent+"  ";
-  typename hash_map<GroupInfo,T>::const_iterator i,e;
-  i=u.begin();
-  e=u.end();
-  for(;i!=e;i++) {
-    o<<indent<<"<group_usage id=\""<<i->first.get_gid()
-     <<"\" name=\""<<xmlify(i->first.get_name())<<"\">"<<endl;
-    xml_report(o,i->second,more_indent);
-    o<<indent<<"</group_usage>"<<endl;
+/* UsageReport -- one of the usage reports, made from the finest
+   tables by make_report.  Each entry is keyed by up to three ids,
+   each REPORT_ID_BITS long, giving the directory, owner or group at
+   each level of the report's nesting.  The map is ordered, so the
+   entries for each outer key are together, and the reports are
+   in the report order (see plan_report_order). */
+#define REPORT_ID_BITS 21
+#define REPORT_ID_MASK ((((uint64_t)1)<<REPORT_ID_BITS)-1)
+enum { LEVEL_DIR, LEVEL_USER, LEVEL_GROUP };
+struct UsageReport {
+  UsageReport(int l0=-1,int l1=-1,int l2=-1): nlevels(0) {
+    levels[0]=levels[1]=levels[2]=-1;
+    if(l0>=0) levels[nlevels++]=l0;
+    if(l1>=0) levels[nlevels++]=l1;
+    if(l2>=0) levels[nlevels++]=l2;
   }
+  int levels[3], nlevels;
+  map<uint64_t,UsageInfo> entries;
+};
+
+/* report_id -- the id at level i of a report key */
+static inline uint32_t report_id(const UsageReport &r,uint64_t key,int i) {
+  return (uint32_t)((key>>(REPORT_ID_BITS*(r.nlevels-1-i)))&REPORT_ID_MASK);
 }
 
-template<class T>
-void xml_report(ostream &o,const hash_map<UserInfo,T> &u,const string &indent="") {
-  string more_indent=indent+"  ";
-  typename hash_map<UserInfo,T>::const_iterator i,e;
-  i=u.begin();
-  e=u.end();
-  for(;i!=e;i++) {
-    o<<indent<<"<user_usage id=\""<<i->first.get_uid()
-     <<"\" name=\""<<xmlify(i->first.get_name())<<"\">"<<endl;
-    xml_report(o,i->second,more_indent);
-    o<<indent<<"</user_usage>"<<endl;
+/* Report order.  Report entries are in the order of their ids (the
+   order in which directories were targeted, and owners and groups
+   were first seen), or with us_sort_reports, by directory path, uid
+   and gid, which does not depend on the order of the walk.
+   report_pos[level][id] is an id's position in that order, and
+   report_at[level][pos] the id at a position.  Set by
+   plan_report_order. */
+static vector<uint32_t> report_pos[3], report_at[3];
+
+/* ReportOrder -- sort order of the ids at a report level */
+struct ReportOrder {
+  ReportOrder(int level): level(level) {}
+  bool operator()(uint32_t a,uint32_t b) const {
+    switch(level) {
+    case LEVEL_DIR:
+      if(targets[a].get_path()!=targets[b].get_path())
+        return targets[a].get_path()<targets[b].get_path();
+      break;
+    case LEVEL_USER:
+      if(user_ids[a].get_uid()!=user_ids[b].get_uid())
+        return user_ids[a].get_uid()<user_ids[b].get_uid();
+      break;
+    default:
+      if(group_ids[a].get_gid()!=group_ids[b].get_gid())
+        return group_ids[a].get_gid()<group_ids[b].get_gid();
+      break;
+    }
+    return a<b;
+  }
+  int level;
+};
+
+/* plan_report_order -- set report_pos and report_at, and look up
+   every owner and group name, so that the reports can then be
+   written by several threads at once without changing anything.
+   Caller must hold the UsageLock. */
+static void plan_report_order() {
+  size_t sizes[3];
+  sizes[LEVEL_DIR]=targets.size();
+  sizes[LEVEL_USER]=user_ids.size();
+  sizes[LEVEL_GROUP]=group_ids.size();
+  for(int level=0;level<3;level++) {
+    vector<uint32_t> &at=report_at[level], &pos=report_pos[level];
+    at.resize(sizes[level]);
+    pos.resize(sizes[level]);
+    for(uint32_t id=0;id<at.size();id++)
+      at[id]=id;
+    if(sort_reports)
+      sort(at.begin(),at.end(),ReportOrder(level));
+    for(uint32_t p=0;p<at.size();p++)
+      pos[at[p]]=p;
+  }
+  for(size_t id=0;id<user_ids.size();id++)
+    user_ids[id].get_name();
+  for(size_t id=0;id<group_ids.size();id++)
+    group_ids[id].get_name();
+}
+
+/* open_level/close_level -- start and end the XML element for id at
+   report level type */
+static void open_level(XmlWriter &o,int type,uint32_t id,const string &indent) {
+  switch(type) {
+  case LEVEL_DIR:
+    o<<indent<<"<dir_usage path=\""<<xml_text(targets[id].get_path())<<"\">"<<'\n';
+    break;
+  case LEVEL_USER:
+    o<<indent<<"<user_usage id=\""<<user_ids[id].get_uid()
+     <<"\" name=\""<<xml_text(user_ids[id].get_name())<<"\">"<<'\n';
+    break;
+  default:
+    o<<indent<<"<group_usage id=\""<<group_ids[id].get_gid()
+     <<"\" name=\""<<xml_text(group_ids[id].get_name())<<"\">"<<'\n';
+    break;
+  }
+}
+static void close_level(XmlWriter &o,int type,const string &indent) {
+  o<<indent<<(type==LEVEL_DIR ? "</dir_usage>" :
+              type==LEVEL_USER ? "</user_usage>" : "</group_usage>")<<'\n';
+}
+
+void xml_report(XmlWriter &o,const UsageReport &r,const string &indent="") {
+  map<uint64_t,UsageInfo>::const_iterator i,e;
+  string indents[4];
+  uint64_t prev=0;
+  int lev,same;
+  indents[0]=indent;
+  for(lev=1;lev<=r.nlevels;lev++)
+    indents[lev]=indents[lev-1]+"  ";
+  for(i=r.entries.begin(),e=r.entries.end();i!=e;i++) {
+    /* Find the first level whose id differs from the last entry's,
+       close the elements below it, and open new ones. */
+    for(same=0;i!=r.entries.begin() && same<r.nlevels-1
+          && report_id(r,i->first,same)==report_id(r,prev,same);same++);
+    if(i!=r.entries.begin())
+      for(lev=r.nlevels-1;lev>=same;lev--)
+        close_level(o,r.levels[lev],indents[lev]);
+    for(lev=same;lev<r.nlevels;lev++)
+      open_level(o,r.levels[lev],report_at[r.levels[lev]][report_id(r,i->first,lev)],
+                 indents[lev]);
+    i->second.xml_report(o,indents[r.nlevels]);
+    prev=i->first;
   }
+  if(!r.entries.empty())
+    for(lev=r.nlevels-1;lev>=0;lev--)
+      close_level(o,r.levels[lev],indents[lev]);
 }
 
+/* TopReport -- a top-N report: the heaps in tops, one per owner,
+   group or targeted directory (level) */
+struct TopReport {
+  TopReport(int level,const vector<TopFiles> &tops): level(level),tops(tops) {}
+  int level;
+  const vector<TopFiles> &tops;
+};
+
+/* top_sorted -- with us_sort_reports, files of the same size are
+   listed by path */
+inline bool top_sorted(const TopEntry &a,const TopEntry &b) {
+  if(a.size!=b.size)
+    return a.size>b.size;
+  return top_paths[a.path]<top_paths[b.path];
+}
+
+/* xml_levels -- write a report with one element for each owner,
+   group or targeted directory (level) that has a non-empty entry in
+   v, in report order.  entry writes what goes inside each element. */
 template<class T>
-void xml_report(ostream &o,const hash_map<FObjInfo,T> &d,const string &indent="") {
-  string more_indent=indent+"  ";
-  typename hash_map<FObjInfo,T>::const_iterator i,e;
-  i=d.begin();
-  e=d.end();
-  for(;i!=e;i++) {
-    o<<indent<<"<dir_usage path=\""<<xmlify(i->first.get_path())<<"\">"<<endl;
-    xml_report(o,i->second,more_indent);
-    o<<indent<<"</dir_usage>"<<endl;
+void xml_levels(XmlWriter &o,int level,const vector<T> &v,const string &indent,
+                void (*entry)(XmlWriter &,const T &,const string &)) {
+  const vector<uint32_t> &at=report_at[level];
+  for(size_t p=0;p<at.size();p++) {
+    uint32_t id=at[p];
+    if(id>=v.size() || v[id].empty())
+      continue;
+    open_level(o,level,id,indent);
+    entry(o,v[id],indent);
+    close_level(o,level,indent);
   }
 }
 
+static void xml_top_entry(XmlWriter &o,const TopFiles &t,const string &indent) {
+  vector<TopEntry> v=t.sorted();
+  if(sort_reports)
+    sort(v.begin(),v.end(),top_sorted);
+  for(size_t i=0;i<v.size();i++)
+    o<<indent<<"  <bigfile rank=\""<<i+1<<"\" size=\""<<v[i].size<<"\">"
+     <<xml_text(top_paths[v[i].path])<<"</bigfile>"<<'\n';
+}
+
+void xml_report(XmlWriter &o,const TopReport &r,const string &indent="") {
+  xml_levels(o,r.level,r.tops,indent,xml_top_entry);
+}
+
+/* PurgeReport -- a purge simulation report: the totals in purge,
+   one per owner, group or targeted directory (level) */
+struct PurgeReport {
+  PurgeReport(int level,const vector<PurgeTotals> &purge): level(level),purge(purge) {}
+  int level;
+  const vector<PurgeTotals> &purge;
+};
+
+static void xml_purge_entry(XmlWriter &o,const PurgeTotals &t,const string &indent) {
+  for(size_t c=0;c<t.size();c++)
+    o<<indent<<"  <purge age_days=\""<<purge_ages[c]/86400.0
+     <<"\" min_depth=\""<<purge_depths[c]
+     <<"\" files=\""<<t[c].files
+     <<"\" bytes=\""<<t[c].bytes<<"\"/>"<<'\n';
+}
+
+void xml_report(XmlWriter &o,const PurgeReport &r,const string &indent="") {
+  xml_levels(o,r.level,r.purge,indent,xml_purge_entry);
+}
+
+/* LayoutReport -- a layout report: the totals in layouts, one per
+   owner, group or targeted directory (level) */
+struct LayoutReport {
+  LayoutReport(int level,const vector<LayoutTotals> &layouts): level(level),layouts(layouts) {}
+  int level;
+  const vector<LayoutTotals> &layouts;
+};
+
+static void xml_layout_entry(XmlWriter &o,const LayoutTotals &t,const string &indent) {
+  if(t.composite.files)
+    o<<indent<<"  <composite files=\""<<t.composite.files
+     <<"\" bytes=\""<<t.composite.bytes<<"\"/>"<<'\n';
+  if(t.no_objects.files)
+    o<<indent<<"  <no_objects files=\""<<t.no_objects.files
+     <<"\" bytes=\""<<t.no_objects.bytes<<"\"/>"<<'\n';
+  if(t.unknown.files)
+    o<<indent<<"  <unknown_layout files=\""<<t.unknown.files
+     <<"\" bytes=\""<<t.unknown.bytes<<"\"/>"<<'\n';
+  for(map<uint32_t,FileCount>::const_iterator i=t.stripes.begin();i!=t.stripes.end();i++)
+    o<<indent<<"  <stripes count=\""<<i->first<<"\" files=\""<<i->second.files
+     <<"\" bytes=\""<<i->second.bytes<<"\"/>"<<'\n';
+  for(map<string,FileCount>::const_iterator i=t.pools.begin();i!=t.pools.end();i++)
+    o<<indent<<"  <pool name=\""<<xml_text(i->first)<<"\" files=\""<<i->second.files
+     <<"\" bytes=\""<<i->second.bytes<<"\"/>"<<'\n';
+  for(map<uint32_t,FileCount>::const_iterator i=t.osts.begin();i!=t.osts.end();i++)
+    o<<indent<<"  <ost index=\""<<i->first<<"\" objects=\""<<i->second.files
+     <<"\" bytes=\""<<i->second.bytes<<"\"/>"<<'\n';
+}
+
+void xml_report(XmlWriter &o,const LayoutReport &r,const string &indent="") {
+  o<<indent<<"<!-- stripes: files with OST objects, by the stripe count of the\n"
+   <<indent<<"     component holding the end of the file if composite.  pool and\n"
+   <<indent<<"     ost: the bytes each pool and OST holds, from every instantiated\n"
+   <<indent<<"     component.  composite: PFL and FLR files, also in stripes.\n"
+   <<indent<<"     no_objects: no layout, released by HSM, data on the MDT or no\n"
+   <<indent<<"     instantiated component.  unknown_layout: unreadable layouts.\n"
+   <<indent<<"     Files in no_objects and unknown_layout are not in stripes. -->\n";
+  xml_levels(o,r.level,r.layouts,indent,xml_layout_entry);
+}
+
+/* make_report -- fill in report r from the finest tables, summing
+   over whatever the report's levels leave out.  Reports with a
+   directory level are made from target_usage, and the others from
+   walk_usage.  The keys are positions in the report order (see
+   plan_report_order).  Caller must hold the UsageLock, or be one of
+   the report_jobs. */
+static void add_report_entries(UsageReport &r,const PairUsage &table,uint32_t dir) {
+  uint32_t ids[3];
+  ids[LEVEL_DIR]=dir;
+  for(PairUsage::const_iterator i=table.begin();i!=table.end();i++) {
+    uint64_t key=0;
+    ids[LEVEL_USER]=key_first(i->first);
+    ids[LEVEL_GROUP]=key_second(i->first);
+    for(int lev=0;lev<r.nlevels;lev++) {
+      if(ids[r.levels[lev]]>REPORT_ID_MASK)
+        fail("Too many distinct owners, groups or directories (%llu) for the usage reports.\n",
+             (unsigned long long)ids[r.levels[lev]]);
+      key=(key<<REPORT_ID_BITS)|report_pos[r.levels[lev]][ids[r.levels[lev]]];
+    }
+    r.entries[key].merge(i->second);
+  }
+}
+static void make_report(UsageReport &r) {
+  bool by_dir=false;
+  r.entries.clear();
+  for(int lev=0;lev<r.nlevels;lev++)
+    by_dir = by_dir || r.levels[lev]==LEVEL_DIR;
+  if(!r.nlevels)
+    r.entries[0]; // the all-usage report has one entry, even if empty
+  if(!by_dir)
+    add_report_entries(r,walk_usage,0);
+  else
+    for(size_t d=0;d<target_usage.size();d++)
+      add_report_entries(r,target_usage[d],(uint32_t)d);
+}
+
 /* update_bigfile_reports -- updates the list of "big" files.  Once
    the number of such big files listed in the in-memory cahce exceeds
    "max," the data is written out, and the cache is cleared */
@@ -383,11 +1144,11 @@ void update_bigfile_reports(FObjSet &b,size_t max=max_big_files_in_mem) {
     i=b.begin();
     e=b.end();
     for(;i!=e;i++) {
-      big_glob_report<<globify(i->get_path())<<endl;
+      big_glob_report<<globify(i->get_path())<<'\n';
       big_print0_report<<i->get_path()<<'\0';
-      big_text_report<<i->get_path()<<endl;
+      big_text_report<<i->get_path()<<'\n';
       big_xml_report<<"  <bigfile size=\""<<i->size_bytes()<<"\">"
-       <<xmlify(i->get_path())<<"</bigfile>"<<endl;
+       <<xmlify(i->get_path())<<"</bigfile>\n";
     }
     b.clear();
   }
@@ -467,9 +1228,11 @@ void start_xml_report(const string &pre,const string &type,
    start_time/end_time -- start and end times of the filesystem
         walker
    maxdepth -- maximum directory recursion depth
+
+   Returns false if the report could not be written in full.
 */
 template<class T>
-void gen_xml_report(const string &pre,const string &type,const T &t,
+bool gen_xml_report(const string &pre,const string &type,const T &t,
                     double start_time,double end_time,size_t maxdepth) {
   uid_t uid=getuid(),euid=geteuid();
   UserInfo user(uid),euser(euid);
@@ -486,77 +1249,342 @@ void gen_xml_report(const string &pre,const string &type,const T &t,
 
   debug("%s: generate XML report of type %s...\n",where.c_str(),type.c_str());
 
-  std::ofstream o(where.c_str());
-  o<<"<?xml version=\"1.0\"?>"<<endl<<endl;
+  XmlWriter o(where);
+  if(!o.is_open())
+    return false;
+  o<<"<?xml version=\"1.0\"?>\n\n";
   o<<"<"<<element_name
-   <<" start=\""<<setprecision(16)<<start_time<<"\""
-   <<" end=\""<<setprecision(16)<<end_time<<"\""
-   <<" uid=\""<<uid<<"\" user=\""<<xmlify(user.get_name())<<"\""
-   <<" euid=\""<<euid<<"\" euser=\""<<xmlify(euser.get_name())<<"\""
-   <<" host=\""<<xmlify(hostname)<<"\""
+   <<" start=\""<<start_time<<"\""
+   <<" end=\""<<end_time<<"\""
+   <<" uid=\""<<uid<<"\" user=\""<<xml_text(user.get_name())<<"\""
+   <<" euid=\""<<euid<<"\" euser=\""<<xml_text(euser.get_name())<<"\""
+   <<" host=\""<<xml_text(hostname)<<"\""
    <<" max_depth=\""<<maxdepth<<"\""
-   <<">"<<endl;
+   <<">\n";
   xml_report(o,t,indent);
-  o<<"</"<<element_name<<">"<<endl;
+  o<<"</"<<element_name<<">\n";
+  if(!o.close())
+    return false;
 
   debug("%s: done generating %s XML report.\n",where.c_str(),type.c_str());
+  return true;
+}
+
+/* Report jobs.  Once the walk is over, the tables do not change, and
+   each report only reads them, so us_generate_reports writes the
+   reports at once on report_threads threads.  Each ReportJob writes
+   one report (or, for BigFileJob, finishes the big-files reports),
+   and is run by run_report_job from a task_queue.  run returns false
+   if its report may be incomplete. */
+
+struct ReportJob {
+  ReportJob(const string &pre,const string &type,double start_time,double end_time,
+            size_t maxdepth):
+    pre(pre),type(type),start_time(start_time),end_time(end_time),maxdepth(maxdepth) {}
+  virtual ~ReportJob() {}
+  virtual bool run()=0;
+  string pre,type;
+  double start_time,end_time;
+  size_t maxdepth;
+  bool ok; /* set by run_report_job */
+};
+
+/* UsageJob -- make usage report r (see make_report), and generate its
+   XML report */
+struct UsageJob: public ReportJob {
+  UsageJob(const string &pre,const string &type,const UsageReport &r,
+           double start_time,double end_time,size_t maxdepth):
+    ReportJob(pre,type,start_time,end_time,maxdepth),r(r) {}
+  bool run() {
+    make_report(r);
+    bool ok=gen_xml_report(pre,type,r,start_time,end_time,maxdepth);
+    /* Free the entries now rather than when every job is done, so
+       that finished reports do not add to the peak memory use. */
+    r.entries.clear();
+    return ok;
+  }
+  UsageReport r;
+};
+
+/* XmlJob -- generate the XML report for t (a TopReport or PurgeReport) */
+template<class T> struct XmlJob: public ReportJob {
+  XmlJob(const string &pre,const string &type,const T &t,
+         double start_time,double end_time,size_t maxdepth):
+    ReportJob(pre,type,start_time,end_time,maxdepth),t(t) {}
+  bool run() { return gen_xml_report(pre,type,t,start_time,end_time,maxdepth); }
+  T t;
+};
+
+/* BigFileJob -- write out the big files and close the big-files reports */
+struct BigFileJob: public ReportJob {
+  BigFileJob(const string &pre): ReportJob(pre,"big-files",0,0,0) {}
+  bool run() {
+    update_bigfile_reports(big_files,0);
+    big_glob_report.close();
+    big_print0_report.close();
+    big_text_report.close();
+    big_xml_report<<"</big_file_list>"<<endl;
+    big_xml_report.close();
+    if(big_glob_report.fail() || big_print0_report.fail()
+       || big_text_report.fail() || big_xml_report.fail()) {
+      warn("%sbig-files: cannot write reports\n",pre.c_str());
+      return false;
+    }
+    return true;
+  }
+};
+
+/* run_report_job -- task_queue runner for a ReportJob */
+static void run_report_job(void *task) {
+  ReportJob *job=(ReportJob*)task;
+  job->ok=false;
+  try {
+    job->ok=job->run();
+  } catch(const exception &e) {
+    cerr<<job->pre<<job->type<<": cannot generate report: "<<e.what()<<endl;
+  } catch(...) {
+    cerr<<job->pre<<job->type<<": cannot generate report (reason unknown)"<<endl;
+  }
+}
+
+/* run_report_jobs -- run and delete the jobs, on up to report_threads
+   threads.  The task_queue's first worker takes the last job first,
+   and the others take the first jobs first, so the largest reports
+   should go at the end.  Caller must hold the UsageLock. */
+static bool run_report_jobs(vector<ReportJob*> &jobs) {
+  size_t n=min(report_threads,jobs.size()),i;
+  bool ok=true;
+  if(n<=1)
+    for(i=0;i<jobs.size();i++)
+      run_report_job(jobs[i]);
+  else {
+    task_queue *q=tq_create(n,run_report_job);
+    for(i=0;i<jobs.size();i++)
+      tq_push(q,jobs[i]);
+    tq_run(q);
+    tq_destroy(q);
+  }
+  for(i=0;i<jobs.size();i++) {
+    ok=ok && jobs[i]->ok;
+    delete jobs[i];
+  }
+  jobs.clear();
+  return ok;
 }
 
 /**********************************************************************/
 
+/* top_heap -- returns the heap for id in tops, adding heaps if needed */
+static TopFiles &top_heap(vector<TopFiles> &tops,uint32_t id) {
+  if(tops.size()<=id)
+    tops.resize(id+1);
+  return tops[id];
+}
+
+/* top_file -- offer a big file to the top-N heaps of its owner, its
+   group, and every targeted directory containing it.  The path is
+   only stored if some heap keeps the file.  Caller must hold the
+   UsageLock. */
+static void top_file(us_frame *frame,const char *path,const struct stat *s) {
+  TopEntry e;
+  us_frame *f;
+  TopFiles &user=top_heap(user_top,user_ids.intern(s->st_uid));
+  TopFiles &group=top_heap(group_top,group_ids.intern(s->st_gid));
+  bool wanted=user.wants(s->st_size,top_n) || group.wants(s->st_size,top_n);
+  for(f=frame;f && !wanted;f=f->up)
+    wanted=top_heap(target_top,f->id).wants(s->st_size,top_n);
+  if(!wanted)
+    return;
+  e.size=s->st_size;
+  e.path=top_paths.add(path);
+  if(user.wants(e.size,top_n))
+    user.insert(e,top_n,top_paths);
+  if(group.wants(e.size,top_n))
+    group.insert(e,top_n,top_paths);
+  for(f=frame;f;f=f->up) {
+    TopFiles &dir=top_heap(target_top,f->id);
+    if(dir.wants(e.size,top_n))
+      dir.insert(e,top_n,top_paths);
+  }
+}
+
+/* purge_totals -- returns the totals for id in purge, adding entries
+   (with a count for each candidate) if needed */
+static PurgeTotals &purge_totals(vector<PurgeTotals> &purge,uint32_t id) {
+  if(purge.size()<=id)
+    purge.resize(id+1);
+  if(purge[id].empty())
+    purge[id].resize(purge_ages.size());
+  return purge[id];
+}
+
+/* add_purge -- add files and bytes to the totals of each candidate
+   in mask */
+static void add_purge(PurgeTotals &t,uint64_t mask,uint64_t files,uint64_t bytes) {
+  for(;mask;mask&=mask-1) {
+    FileCount &c=t[__builtin_ctzll(mask)];
+    c.files+=files;
+    c.bytes+=bytes;
+  }
+}
+
+/* layout_totals -- returns the totals for id in layouts, adding
+   entries if needed */
+static LayoutTotals &layout_totals(vector<LayoutTotals> &layouts,uint32_t id) {
+  if(layouts.size()<=id)
+    layouts.resize(id+1);
+  return layouts[id];
+}
+
+/* FileLayout -- where one file's bytes are, worked out by
+   us_layout_found for add_layout:
+     kind -- LUSTRE_LAYOUT_* of the file; never NONE if it has
+         objects
+     bytes -- size of the file
+     stripes -- stripe count, for LayoutTotals::stripes
+     objects -- OST index and bytes of each object
+     pools -- pool name and bytes in it */
+struct FileLayout {
+  int kind;
+  uint64_t bytes;
+  uint32_t stripes;
+  vector<pair<uint32_t,uint64_t> > objects;
+  vector<pair<string,uint64_t> > pools;
+};
+
+/* object_bytes -- the bytes of the file in offsets [0,end) that
+   object i of a plain layout holds.  Files are striped RAID0 style
+   by file offset: stripe_size bytes to each object in turn, so object
+   i of n holds stripe_size bytes of each full round of n stripes, and
+   whatever of the last, partial round falls in its place. */
+static uint64_t object_bytes(const lustre_layout *l,unsigned i,uint64_t end) {
+  uint64_t ss=l->stripe_size, round=ss*l->stripe_count, start=i*ss, rem;
+  if(!round)
+    return end/l->stripe_count; /* no stripe size: assume an even split */
+  rem=end%round;
+  return (end/round)*ss + (rem>start ? min(rem-start,ss) : 0);
+}
+
+/* add_stripes -- add the objects and pool of plain layout l, which
+   holds the file's offsets from l->start to l->end, to fl */
+static void add_stripes(FileLayout &fl,const lustre_layout *l) {
+  uint64_t lo=min(l->start,fl.bytes), hi=min(l->end,fl.bytes);
+  for(unsigned i=0;i<l->stripe_count;i++)
+    fl.objects.push_back(make_pair((uint32_t)lustre_layout_ost(l,i),
+                                   object_bytes(l,i,hi)-object_bytes(l,i,lo)));
+  if(l->poollen) {
+    string pool(l->pool,l->poollen);
+    size_t p;
+    for(p=0;p<fl.pools.size() && fl.pools[p].first!=pool;p++);
+    if(p==fl.pools.size())
+      fl.pools.push_back(make_pair(pool,(uint64_t)0));
+    fl.pools[p].second+=hi-lo;
+  }
+}
+
+/* add_layout -- add one file, laid out as fl, to t */
+static void add_layout(LayoutTotals &t,const FileLayout &fl) {
+  FileCount *c;
+  if(fl.kind==LUSTRE_LAYOUT_NONE)
+    c=&t.no_objects;
+  else if(fl.kind==LUSTRE_LAYOUT_UNKNOWN)
+    c=&t.unknown;
+  else {
+    c=&t.stripes[fl.stripes];
+    if(fl.kind==LUSTRE_LAYOUT_COMPOSITE) {
+      t.composite.files++;
+      t.composite.bytes+=fl.bytes;
+    }
+  }
+  c->files++;
+  c->bytes+=fl.bytes;
+  for(size_t i=0;i<fl.pools.size();i++) {
+    FileCount &p=t.pools[fl.pools[i].first];
+    p.files++;
+    p.bytes+=fl.pools[i].second;
+  }
+  for(size_t i=0;i<fl.objects.size();i++) {
+    FileCount &o=t.osts[fl.objects[i].first];
+    o.files++;
+    o.bytes+=fl.objects[i].second;
+  }
+}
+
 /* add_usage -- add this file to the usage statistics, using a specific mode.
+   Caller must hold the UsageLock.
+   frame -- usage frame of the directory containing the file
    path -- path to the file
    s -- stat structure for the file
    type -- one of the USAGE_TYPE_* which indicate which us_* function was called.
 */
-void add_usage(const char *path,const struct stat *s,int type) {
-  typedef unsigned long long ull;
-  UserInfo u(s);
-  GroupInfo g(s);
-  all_usage.add(s,type);
-  user_usage[u].add(s,type);
-  group_usage[g].add(s,type);
-  user_group_usage[u][g].add(s,type);
-  group_user_usage[g][u].add(s,type);
-
-  for(dir_iterator i=dir_stack.begin(),e=dir_stack.end();i!=e;i++) {
-    dir_user_usage[*i][u].add(s,type);
-    user_dir_usage[u][*i].add(s,type);
-    dir_group_usage[*i][g].add(s,type);
-    dir_group_user_usage[*i][g][u].add(s,type);
-    dir_usage[*i].add(s,type);
-  }
+void add_usage(us_frame *frame,const char *path,const struct stat *s,int type) {
+  (frame ? frame->acc : outside_acc)[owner_key(s)].add(s,type);
 
   if(type==USAGE_TYPE_FSOBJ) {
-    if((int64_t)s->st_size>(int64_t)big_file_size)
-      big_files.insert(FObjInfo(path,s));
-    if(list_all_files && file_lister) {
-      char type='?';
-      if(S_ISDIR(s->st_mode))
-        type='d';
-      else if(S_ISREG(s->st_mode))
-        type='-';
-      else if(S_ISLNK(s->st_mode))
-        type='l';
-      fprintf(file_lister,"%c %04o %llu %llu %llu %llu %s %s %s\n",
-              type,(int)(s->st_mode & 07777),
-              (ull)s->st_ctime, (ull)s->st_mtime, (ull)s->st_atime,
-              (ull)s->st_size,
-              u.get_name().c_str(),g.get_name().c_str(),
-              path);
+    if((int64_t)s->st_size>(int64_t)big_file_size) {
+      if(top_n) {
+        if(S_ISREG(s->st_mode))
+          top_file(frame,path,s);
+      } else
+        big_files.insert(FObjInfo(path,s));
     }
+    if(list_all_files && file_lister)
+      fl_add(file_lister,path,s);
   }
 }
 
+/* merge_acc -- add the usage in accumulator from to accumulator to */
+static void merge_acc(PairUsage &to,const PairUsage &from) {
+  for(PairUsage::const_iterator i=from.begin();i!=from.end();i++)
+    to[i->first].merge(i->second);
+}
+
+/* fold_acc -- add the usage in accumulator acc, keyed by owner_key,
+   to table, keyed by id_key.  Caller must hold the UsageLock. */
+static void fold_acc(PairUsage &table,const PairUsage &acc) {
+  for(PairUsage::const_iterator i=acc.begin();i!=acc.end();i++)
+    table[id_key(user_ids.intern(key_first(i->first)),
+                 group_ids.intern(key_second(i->first)))].merge(i->second);
+}
+
+/* flush_frames -- put everything in the live frames' accumulators in
+   the tables, so that the tables are complete for a checkpoint.  A
+   frame's sum has not reached any enclosing frame yet, so it goes in
+   the tables of every frame up the chain, and in the outside
+   accumulator.  Caller must hold the UsageLock. */
+static void flush_frames() {
+  for(us_frame *f=live_frames;f;f=f->next) {
+    for(us_frame *up=f;up;up=up->up)
+      fold_acc(target_usage[up->id],f->acc);
+    merge_acc(outside_acc,f->acc);
+    f->acc.clear();
+  }
+  fold_acc(walk_usage,outside_acc);
+  outside_acc.clear();
+}
+
+/* merge_usage -- like add_usage, but adds the statistics collected
+   for a set of files with the given owner_key, rather than one file.
+   Caller must hold the UsageLock. */
+static void merge_usage(us_frame *frame,uint64_t owner,const UsageInfo &x) {
+  (frame ? frame->acc : outside_acc)[owner].merge(x);
+}
+
 /* us_dir_enter -- see disk_usage.h. */
-void us_dir_enter(const char *dirname,const struct stat *s) {
+us_frame *us_dir_enter(us_frame *parent,const char *dirname,const struct stat *s) {
   try {
     FObjInfo di(dirname,s);
     //  di.printsomething();
     if(di.is_targeted()) {
       debug("%s: is targeted for disk usage\n",dirname);
       di.printsomething();
-      dir_stack.push_back(FObjInfo(dirname,s));
+      UsageLock lock;
+      us_frame *f=new us_frame(parent,di,target_ids[di]);
+      targets[f->id]=di; // report the path it was walked by
+      if((f->next=live_frames))
+        live_frames->prev=f;
+      live_frames=f;
+      return f;
     } else {
       di.printsomething();
       debugn(VERB_DEBUG_HIGH,"%s: not targeted for disk usage\n",dirname);
@@ -566,14 +1594,27 @@ void us_dir_enter(const char *dirname,const struct stat *s) {
   } catch(...) {
     cerr<<dirname<<": unknown error updating usage when entering directory"<<endl;
   }
+  return parent;
 }
 
 /* us_dir_leave -- see disk_usage.h. */
-void us_dir_leave(const char *dirname,const struct stat *s) {
+void us_dir_leave(us_frame *f,const char *dirname,const struct stat *s) {
   try {
-    if(!dir_stack.empty() && FObjInfo(dirname,s)==dir_stack.back()) {
+    if(f && f->dir==s) {
       debug("%s: leaving this directory\n",dirname);
-      dir_stack.pop_back();
+      UsageLock lock;
+      fold_acc(target_usage[f->id],f->acc);
+      if(f->up)
+        merge_acc(f->up->acc,f->acc);
+      else
+        fold_acc(walk_usage,f->acc);
+      if(f->prev)
+        f->prev->next=f->next;
+      else
+        live_frames=f->next;
+      if(f->next)
+        f->next->prev=f->prev;
+      delete f;
     }
   } catch(const exception &e) {
     cerr<<dirname<<": error updating usage while leaving directory: "<<e.what()<<endl;
@@ -583,9 +1624,10 @@ void us_dir_leave(const char *dirname,const struct stat *s) {
 }
 
 /* us_file_found -- see disk_usage.h */
-void us_file_found(const char *filename,const struct stat *s) {
+void us_file_found(us_frame *f,const char *filename,const struct stat *s) {
   try {
-    add_usage(filename,s,USAGE_TYPE_FSOBJ);
+    UsageLock lock;
+    add_usage(f,filename,s,USAGE_TYPE_FSOBJ);
     update_bigfile_reports(big_files);
   } catch(const exception &e) {
     cerr<<filename<<": error updating usage stats: "<<e.what()<<endl;
@@ -595,9 +1637,10 @@ void us_file_found(const char *filename,const struct stat *s) {
 }
 
 /* us_file_deleted -- see disk_usage.h */
-void us_file_deleted(const char *filename,const struct stat *s) {
+void us_file_deleted(us_frame *f,const char *filename,const struct stat *s) {
   try {
-    add_usage(filename,s,USAGE_TYPE_DELETED_FSOBJ);
+    UsageLock lock;
+    add_usage(f,filename,s,USAGE_TYPE_DELETED_FSOBJ);
   } catch(const exception &e) {
     cerr<<filename<<": error updating usage stats: "<<e.what()<<endl;
   } catch(...) {
@@ -605,10 +1648,75 @@ void us_file_deleted(const char *filename,const struct stat *s) {
   }
 }
 
+/* us_layout_found -- see disk_usage.h.  Like purge candidates,
+   layouts are counted for the owner, the group, and every targeted
+   directory containing the file.  Each instantiated component of a
+   composite layout holds the part of the file in its extent, striped
+   like a plain layout, and mirrors (FLR) each hold a copy.  A
+   composite file's stripe count is that of the component holding
+   its last byte, or of the widest instantiated component if none
+   does. */
+void us_layout_found(us_frame *f,const struct stat *s,const lustre_layout *l) {
+  try {
+    FileLayout fl;
+    lustre_layout comp;
+    uint64_t last;
+    bool found=false;
+    fl.kind=l->kind;
+    fl.bytes=s->st_size>0 ? s->st_size : 0;
+    fl.stripes=0;
+    if(l->kind==LUSTRE_LAYOUT_PLAIN) {
+      fl.stripes=l->stripe_count;
+      add_stripes(fl,l);
+    } else if(l->kind==LUSTRE_LAYOUT_COMPOSITE) {
+      last=fl.bytes ? fl.bytes-1 : 0;
+      for(unsigned i=0;i<l->ncomps;i++)
+        if(lustre_layout_comp(l,i,&comp)) {
+          if(!found && comp.start<=last && last<comp.end) {
+            fl.stripes=comp.stripe_count;
+            found=true;
+          } else if(!found && comp.stripe_count>fl.stripes)
+            fl.stripes=comp.stripe_count;
+          add_stripes(fl,&comp);
+        }
+      if(fl.objects.empty())
+        fl.kind=LUSTRE_LAYOUT_NONE; /* nothing instantiated on the OSTs yet */
+    }
+    UsageLock lock;
+    add_layout(layout_totals(user_layout,user_ids.intern(s->st_uid)),fl);
+    add_layout(layout_totals(group_layout,group_ids.intern(s->st_gid)),fl);
+    for(;f;f=f->up)
+      add_layout(layout_totals(target_layout,f->id),fl);
+  } catch(const exception &e) {
+    cerr<<"error updating layout statistics: "<<e.what()<<endl;
+  } catch(...) {
+    cerr<<"unknown error updating layout statistics"<<endl;
+  }
+}
+
+/* us_purge_found -- see disk_usage.h.  Candidates are counted for
+   the owner, the group, and every targeted directory containing the
+   object, like the top-N heaps. */
+void us_purge_found(us_frame *f,const struct stat *s,uint64_t candidates) {
+  try {
+    UsageLock lock;
+    uint64_t bytes=s->st_size>0 ? s->st_size : 0;
+    add_purge(purge_totals(user_purge,user_ids.intern(s->st_uid)),candidates,1,bytes);
+    add_purge(purge_totals(group_purge,group_ids.intern(s->st_gid)),candidates,1,bytes);
+    for(;f;f=f->up)
+      add_purge(purge_totals(target_purge,f->id),candidates,1,bytes);
+  } catch(const exception &e) {
+    cerr<<"error updating purge simulation: "<<e.what()<<endl;
+  } catch(...) {
+    cerr<<"unknown error updating purge simulation"<<endl;
+  }
+}
+
 /* us_dir_unopenable -- see disk_usage.h */
-void us_dir_unopenable(const char *filename,const struct stat *s) {
+void us_dir_unopenable(us_frame *f,const char *filename,const struct stat *s) {
   try {
-    add_usage(filename,s,USAGE_TYPE_DIR_UNOPENABLE);
+    UsageLock lock;
+    add_usage(f,filename,s,USAGE_TYPE_DIR_UNOPENABLE);
   } catch(const exception &e) {
     cerr<<filename<<": error updating usage stats for unopenable directory: "<<e.what()<<endl;
   } catch(...) {
@@ -618,9 +1726,10 @@ void us_dir_unopenable(const char *filename,const struct stat *s) {
 }
 
 /* us_dir_too_deep -- see disk_usage.h */
-void us_dir_too_deep(const char *filename,const struct stat *s) {
+void us_dir_too_deep(us_frame *f,const char *filename,const struct stat *s) {
   try {
-    add_usage(filename,s,USAGE_TYPE_DIR_TOO_DEEP);
+    UsageLock lock;
+    add_usage(f,filename,s,USAGE_TYPE_DIR_TOO_DEEP);
   } catch(const exception &e) {
     cerr<<filename<<": error updating usage stats for overly deep directory: "<<e.what()<<endl;
   } catch(...) {
@@ -629,9 +1738,10 @@ void us_dir_too_deep(const char *filename,const struct stat *s) {
 }
 
 /* us_duplicate_object -- see disk_usage.h */
-void us_duplicate_object(const char *filename,const struct stat *s) {
+void us_duplicate_object(us_frame *f,const char *filename,const struct stat *s) {
   try {
-    add_usage(filename,s,USAGE_TYPE_DUPLICATE_OBJECT);
+    UsageLock lock;
+    add_usage(f,filename,s,USAGE_TYPE_DUPLICATE_OBJECT);
   } catch(const exception &e) {
     cerr<<filename<<": error updating usage stats for overly deep directory: "<<e.what()<<endl;
   } catch(...) {
@@ -640,10 +1750,11 @@ void us_duplicate_object(const char *filename,const struct stat *s) {
 }
 
 /* us_filename_too_long -- see disk_usage.h */
-void us_filename_too_long(const char *dirname,const char *filepart,
+void us_filename_too_long(us_frame *f,const char *dirname,const char *filepart,
                           const struct stat *s) {
   try {
-    add_usage("**unspecified**",s,USAGE_TYPE_FILENAME_TOO_LONG);
+    UsageLock lock;
+    add_usage(f,"**unspecified**",s,USAGE_TYPE_FILENAME_TOO_LONG);
   } catch(const exception &e) {
     cerr<<dirname<<"/(long filename): error updating usage stats for overly-long filename: "<<e.what()<<endl;
   } catch(...) {
@@ -653,9 +1764,10 @@ void us_filename_too_long(const char *dirname,const char *filepart,
 }
 
 /* us_path_too_long -- see disk_usage.h */
-void us_path_too_long(const char *dirname,const char *filepart,const struct stat *s) {
+void us_path_too_long(us_frame *f,const char *dirname,const char *filepart,const struct stat *s) {
   try {
-    add_usage("**unspecified**",s,USAGE_TYPE_PATH_TOO_LONG);
+    UsageLock lock;
+    add_usage(f,"**unspecified**",s,USAGE_TYPE_PATH_TOO_LONG);
   } catch(const exception &e) {
     cerr<<dirname<<"/(long filename): error updating usage stats for overly-long path: "<<e.what()<<endl;
   } catch(...) {
@@ -667,7 +1779,11 @@ void us_path_too_long(const char *dirname,const char *filepart,const struct stat
 void us_add_dir(const char *dirname) {
   try {
     FObjInfo di(dirname);
-    target_dirs.insert(di);
+    if(target_ids.find(di)==target_ids.end()) {
+      target_ids[di]=(uint32_t)targets.size();
+      targets.push_back(di);
+      target_usage.push_back(PairUsage());
+    }
     assert(di.is_targeted());
     FObjInfo di2=di.debug_thing();
     assert(di2.is_targeted());
@@ -681,22 +1797,38 @@ void us_add_dir(const char *dirname) {
   }
 }
 
+/* us_load_names -- see disk_usage.h */
+void us_load_names(const char *passwd_file,const char *group_file) {
+  long n;
+  if(passwd_file) {
+    if((n=user_names.load(passwd_file))<0)
+      warn("%s: cannot read user names: %s\n",passwd_file,strerror(errno));
+    else
+      debug("%s: read %ld user names\n",passwd_file,n);
+  }
+  if(group_file) {
+    if((n=group_names.load(group_file))<0)
+      warn("%s: cannot read group names: %s\n",group_file,strerror(errno));
+    else
+      debug("%s: read %ld group names\n",group_file,n);
+  }
+}
+
 /* us_start_reports -- see disk_usage.h */
 void us_start_reports(const char *prefix,double start_time,size_t max_depth) {
   try {
     string pre=prefix;
-    start_glob_report(pre,"big-files");
-    start_print0_report(pre,"big-files");
-    start_xml_report(pre,"big-files",start_time,max_depth);
-    start_text_report(pre,"big-files");
-    if(list_all_files) {
-      string where=pre+"all-files.lst";
-      if(!(file_lister=fopen(where.c_str(),"wt"))) {
-        warn("%s: cannot open for text writing: %s\n",
-             where.c_str(),strerror(errno));
-      } else
-        fprintf(file_lister,"type mode ctime mtime atime size user group path\n");
+    report_prefix=pre;
+    age_reference=time(NULL);
+    if(!top_n) {
+      start_glob_report(pre,"big-files");
+      start_print0_report(pre,"big-files");
+      start_xml_report(pre,"big-files",start_time,max_depth);
+      start_text_report(pre,"big-files");
     }
+    start_index();
+    if(list_all_files)
+      file_lister=fl_create(lister_path(pre).c_str(),list_format,user_name,group_name);
   } catch(const exception &e) {
     cerr<<prefix<<": cannot start reporting (2): "<<e.what()<<endl;
   } catch(...) {
@@ -705,53 +1837,680 @@ void us_start_reports(const char *prefix,double start_time,size_t max_depth) {
 }
 
 /* us_generate_reports -- see disk_usage.h */
-void us_generate_reports(const char *prefix,double start_time,double end_time,size_t max_depth) {
+int us_generate_reports(const char *prefix,double start_time,double end_time,size_t max_depth) {
+  bool ok;
   try {
+    UsageLock lock;
     string pre(prefix);
-    gen_xml_report(pre,"all-usage",all_usage,start_time,end_time,max_depth);
+    vector<ReportJob*> jobs;
+    flush_frames();
+    plan_report_order();
+
+    /* Smallest first; see run_report_jobs */
+    if(top_n) {
+      jobs.push_back(new XmlJob<TopReport>(pre,"by-user-top-files",TopReport(LEVEL_USER,user_top),
+                                           start_time,end_time,max_depth));
+      jobs.push_back(new XmlJob<TopReport>(pre,"by-group-top-files",TopReport(LEVEL_GROUP,group_top),
+                                           start_time,end_time,max_depth));
+      jobs.push_back(new XmlJob<TopReport>(pre,"by-dir-top-files",TopReport(LEVEL_DIR,target_top),
+                                           start_time,end_time,max_depth));
+    } else
+      jobs.push_back(new BigFileJob(pre));
+    if(!purge_ages.empty()) {
+      jobs.push_back(new XmlJob<PurgeReport>(pre,"by-user-purge",PurgeReport(LEVEL_USER,user_purge),
+                                             start_time,end_time,max_depth));
+      jobs.push_back(new XmlJob<PurgeReport>(pre,"by-group-purge",PurgeReport(LEVEL_GROUP,group_purge),
+                                             start_time,end_time,max_depth));
+      jobs.push_back(new XmlJob<PurgeReport>(pre,"by-dir-purge",PurgeReport(LEVEL_DIR,target_purge),
+                                             start_time,end_time,max_depth));
+    }
+    if(account_layouts) {
+      jobs.push_back(new XmlJob<LayoutReport>(pre,"by-user-layout",LayoutReport(LEVEL_USER,user_layout),
+                                              start_time,end_time,max_depth));
+      jobs.push_back(new XmlJob<LayoutReport>(pre,"by-group-layout",LayoutReport(LEVEL_GROUP,group_layout),
+                                              start_time,end_time,max_depth));
+      jobs.push_back(new XmlJob<LayoutReport>(pre,"by-dir-layout",LayoutReport(LEVEL_DIR,target_layout),
+                                              start_time,end_time,max_depth));
+    }
+    jobs.push_back(new UsageJob(pre,"all-usage",UsageReport(),start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"per-dir-usage",UsageReport(LEVEL_DIR),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"per-user-usage",UsageReport(LEVEL_USER),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"per-group-usage",UsageReport(LEVEL_GROUP),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"by-user-group-usage",UsageReport(LEVEL_USER,LEVEL_GROUP),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"by-group-user-usage",UsageReport(LEVEL_GROUP,LEVEL_USER),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"by-dir-user-usage",UsageReport(LEVEL_DIR,LEVEL_USER),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"by-user-dir-usage",UsageReport(LEVEL_USER,LEVEL_DIR),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"by-dir-group-usage",UsageReport(LEVEL_DIR,LEVEL_GROUP),
+                                start_time,end_time,max_depth));
+    jobs.push_back(new UsageJob(pre,"by-dir-group-user-usage",
+                                UsageReport(LEVEL_DIR,LEVEL_GROUP,LEVEL_USER),
+                                start_time,end_time,max_depth));
+    ok=run_report_jobs(jobs);
 
-    gen_xml_report(pre,"per-dir-usage",dir_usage,start_time,end_time,max_depth);
-    gen_xml_report(pre,"per-user-usage",user_usage,start_time,end_time,max_depth);
-    gen_xml_report(pre,"by-dir-user-usage",dir_user_usage,start_time,end_time,max_depth);
-    gen_xml_report(pre,"by-user-dir-usage",user_dir_usage,start_time,end_time,max_depth);
+    if(list_all_files && file_lister) {
+      if(fl_close(file_lister))
+        ok=false;
+      file_lister=NULL;
+    }
+  } catch(const exception &e) {
+    cerr<<prefix<<": cannot generate reports: "<<e.what()<<endl;
+    return -1;
+  } catch(...) {
+    cerr<<prefix<<": cannot generate reports (reason unknown)"<<endl;
+    return -1;
+  }
+  return ok ? 0 : -1;
+}
 
-    gen_xml_report(pre,"per-group-usage",group_usage,start_time,end_time,max_depth);
-    gen_xml_report(pre,"by-dir-group-usage",dir_group_usage,start_time,end_time,max_depth);
-    gen_xml_report(pre,"by-user-group-usage",user_group_usage,start_time,end_time,max_depth);
-    gen_xml_report(pre,"by-group-user-usage",group_user_usage,start_time,end_time,max_depth);
-    gen_xml_report(pre,"by-dir-group-user-usage",dir_group_user_usage,start_time,end_time,max_depth);
+/**********************************************************************/
 
-    update_bigfile_reports(big_files,0);
+/* Checkpoint support.  save_key/load_key write and read a
+   directory, and save_usage/load_usage a usage table.  Tables are
+   always written with owner_keys: ids are only meaningful within one
+   run, so the tables keyed by id_key are translated by owner_of on
+   the way out, and re-interned by fold_acc on the way in. */
 
-    big_glob_report.close();
-    big_print0_report.close();
-    big_text_report.close();
-    big_xml_report<<"</big_file_list>"<<endl;
-    big_xml_report.close();
+static void save_key(FILE *f,const FObjInfo &d) {
+  ckpt_put_str(f,d.get_path().data(),d.get_path().size());
+  ckpt_put(f,&d.get_stat(),sizeof(struct stat));
+}
+static FObjInfo load_key(FILE *f) {
+  struct stat s;
+  char *path=ckpt_get_str(f,NULL);
+  ckpt_get(f,&s,sizeof(struct stat));
+  FObjInfo d(path,&s);
+  free(path);
+  return d;
+}
+
+/* owner_of -- the owner_key for an id_key */
+static uint64_t owner_of(uint64_t key) {
+  return (((uint64_t)user_ids[key_first(key)].get_uid())<<32)
+    | (uint32_t)group_ids[key_second(key)].get_gid();
+}
+
+static void save_usage(FILE *f,const PairUsage &m,bool interned) {
+  ckpt_put_u64(f,m.size());
+  for(PairUsage::const_iterator i=m.begin();i!=m.end();i++) {
+    ckpt_put_u64(f,interned ? owner_of(i->first) : i->first);
+    i->second.save(f);
+  }
+}
+static void load_usage(FILE *f,PairUsage &m) {
+  uint64_t n=ckpt_get_u64(f);
+  m.clear();
+  for(;n;n--) {
+    uint64_t key=ckpt_get_u64(f);
+    m[key].load(f);
+  }
+}
+
+/* save_level_id/load_level_id -- write and read the id of an owner,
+   group or targeted directory (level): the uid or gid, or the key of
+   the directory.  what names the table being read, for the error
+   when the directory is no longer targeted. */
+static void save_level_id(FILE *f,int level,uint32_t id) {
+  if(level==LEVEL_DIR)
+    save_key(f,targets[id]);
+  else
+    ckpt_put_u64(f,level==LEVEL_USER ? user_ids[id].get_uid() : group_ids[id].get_gid());
+}
+static uint32_t load_level_id(FILE *f,int level,const char *what) {
+  if(level==LEVEL_DIR) {
+    FObjInfo d=load_key(f);
+    hash_map<FObjInfo,uint32_t>::const_iterator i=target_ids.find(d);
+    if(i==target_ids.end())
+      fail("%s: checkpoint has %s for a directory that is not targeted.\n",
+           d.get_path().c_str(),what);
+    return i->second;
+  } else if(level==LEVEL_USER)
+    return user_ids.intern((uint32_t)ckpt_get_u64(f));
+  else
+    return group_ids.intern((uint32_t)ckpt_get_u64(f));
+}
+
+/* save_tops/load_tops -- write and read the top-N heaps in tops,
+   which are for owners, groups or targeted directories (level).
+   Paths are written in full for each heap, so a file kept by
+   several heaps has several copies after a restore. */
+static void save_tops(FILE *f,const vector<TopFiles> &tops,int level) {
+  size_t n=0;
+  for(size_t id=0;id<tops.size();id++)
+    n+=!tops[id].empty();
+  ckpt_put_u64(f,n);
+  for(uint32_t id=0;id<tops.size();id++) {
+    if(tops[id].empty())
+      continue;
+    save_level_id(f,level,id);
+    vector<TopEntry> v=tops[id].sorted();
+    ckpt_put_u64(f,v.size());
+    for(size_t i=0;i<v.size();i++) {
+      const string &path=top_paths[v[i].path];
+      ckpt_put_u64(f,v[i].size);
+      ckpt_put_str(f,path.data(),path.size());
+    }
+  }
+}
+static void load_tops(FILE *f,vector<TopFiles> &tops,int level) {
+  uint64_t n,m;
+  uint32_t id;
+  for(n=ckpt_get_u64(f);n;n--) {
+    id=load_level_id(f,level,"big files");
+    TopFiles &heap=top_heap(tops,id);
+    for(m=ckpt_get_u64(f);m;m--) {
+      TopEntry e;
+      size_t len;
+      e.size=ckpt_get_u64(f);
+      char *path=ckpt_get_str(f,&len);
+      if(heap.wants(e.size,top_n)) {
+        e.path=top_paths.add(string(path,len));
+        heap.insert(e,top_n,top_paths);
+      }
+      free(path);
+    }
+  }
+}
+
+/* save_purge/load_purge -- write and read the purge simulation totals
+   in purge, which are for owners, groups or targeted directories
+   (level) */
+static void save_purge(FILE *f,const vector<PurgeTotals> &purge,int level) {
+  size_t n=0;
+  for(size_t id=0;id<purge.size();id++)
+    n+=!purge[id].empty();
+  ckpt_put_u64(f,n);
+  for(uint32_t id=0;id<purge.size();id++) {
+    if(purge[id].empty())
+      continue;
+    save_level_id(f,level,id);
+    for(size_t c=0;c<purge[id].size();c++) {
+      ckpt_put_u64(f,purge[id][c].files);
+      ckpt_put_u64(f,purge[id][c].bytes);
+    }
+  }
+}
+static void load_purge(FILE *f,vector<PurgeTotals> &purge,int level) {
+  uint64_t n;
+  uint32_t id;
+  for(n=ckpt_get_u64(f);n;n--) {
+    id=load_level_id(f,level,"a purge simulation");
+    PurgeTotals &t=purge_totals(purge,id);
+    for(size_t c=0;c<t.size();c++) {
+      t[c].files+=ckpt_get_u64(f);
+      t[c].bytes+=ckpt_get_u64(f);
+    }
+  }
+}
+
+/* save_counts/load_counts -- write and read a map of FileCounts,
+   keyed by numbers or strings, and save_count/load_count one
+   FileCount.  The loads add to what is there. */
+static void save_count_key(FILE *f,uint32_t k) { ckpt_put_u64(f,k); }
+static void save_count_key(FILE *f,const string &k) { ckpt_put_str(f,k.data(),k.size()); }
+static void load_count_key(FILE *f,uint32_t &k) { k=(uint32_t)ckpt_get_u64(f); }
+static void load_count_key(FILE *f,string &k) {
+  size_t len;
+  char *s=ckpt_get_str(f,&len);
+  k.assign(s,len);
+  free(s);
+}
+static void save_count(FILE *f,const FileCount &c) {
+  ckpt_put_u64(f,c.files);
+  ckpt_put_u64(f,c.bytes);
+}
+static void load_count(FILE *f,FileCount &c) {
+  c.files+=ckpt_get_u64(f);
+  c.bytes+=ckpt_get_u64(f);
+}
+template<class K> static void save_counts(FILE *f,const map<K,FileCount> &counts) {
+  ckpt_put_u64(f,counts.size());
+  for(typename map<K,FileCount>::const_iterator i=counts.begin();i!=counts.end();i++) {
+    save_count_key(f,i->first);
+    save_count(f,i->second);
+  }
+}
+template<class K> static void load_counts(FILE *f,map<K,FileCount> &counts) {
+  K k;
+  for(uint64_t n=ckpt_get_u64(f);n;n--) {
+    load_count_key(f,k);
+    load_count(f,counts[k]);
+  }
+}
+
+/* save_layouts/load_layouts -- write and read the layout totals in
+   layouts, which are for owners, groups or targeted directories
+   (level) */
+static void save_layouts(FILE *f,const vector<LayoutTotals> &layouts,int level) {
+  size_t n=0;
+  for(size_t id=0;id<layouts.size();id++)
+    n+=!layouts[id].empty();
+  ckpt_put_u64(f,n);
+  for(uint32_t id=0;id<layouts.size();id++) {
+    if(layouts[id].empty())
+      continue;
+    save_level_id(f,level,id);
+    save_counts(f,layouts[id].stripes);
+    save_counts(f,layouts[id].pools);
+    save_counts(f,layouts[id].osts);
+    save_count(f,layouts[id].composite);
+    save_count(f,layouts[id].no_objects);
+    save_count(f,layouts[id].unknown);
+  }
+}
+static void load_layouts(FILE *f,vector<LayoutTotals> &layouts,int level) {
+  uint64_t n;
+  uint32_t id;
+  for(n=ckpt_get_u64(f);n;n--) {
+    id=load_level_id(f,level,"layouts");
+    LayoutTotals &t=layout_totals(layouts,id);
+    load_counts(f,t.stripes);
+    load_counts(f,t.pools);
+    load_counts(f,t.osts);
+    load_count(f,t.composite);
+    load_count(f,t.no_objects);
+    load_count(f,t.unknown);
+  }
+}
+
+/* report_offset/restore_report -- the position of a report stream,
+   for the checkpoint, and a way to reopen a report at such a
+   position on resume.  Anything written after the checkpoint is
+   discarded so it is not written twice. */
+static int64_t report_offset(ofstream &o,const string &where) {
+  if(!o.is_open())
+    return -1;
+  o.flush();
+  if(ckpt_sync_path(where.c_str()))
+    warn("%s: cannot sync to disk: %s\n",where.c_str(),strerror(errno));
+  return (int64_t)o.tellp();
+}
+static void restore_report(ofstream &o,const string &where,int64_t offset) {
+  if(offset<0)
+    return;
+  if(truncate(where.c_str(),(off_t)offset))
+    warn("%s: cannot truncate to checkpoint position: %s\n",where.c_str(),strerror(errno));
+  o.open(where.c_str(),ios::out|ios::app);
+  if(!o.is_open())
+    warn("%s: cannot reopen report: %s\n",where.c_str(),strerror(errno));
+}
+
+/* index_offset/restore_index -- the same, for the new index.  If
+   the checkpoint has no index, the new one starts over; that only
+   means it has fewer directories. */
+static int64_t index_offset() {
+  int64_t offset=-1;
+  pthread_mutex_lock(&index_lock);
+  if(index_out) {
+    if(fflush(index_out) || fsync(fileno(index_out)))
+      warn("%s: cannot sync new index to disk: %s\n",index_path.c_str(),strerror(errno));
+    offset=ftello(index_out);
+  }
+  pthread_mutex_unlock(&index_lock);
+  return offset;
+}
+static void restore_index(int64_t offset) {
+  if(index_path.empty())
+    return;
+  if(offset<0)
+    start_index();
+  else
+    index_out=ckpt_reopen(index_path.c_str(),offset);
+}
+
+/* us_checkpoint -- see disk_usage.h */
+void us_checkpoint(FILE *f) {
+  try {
+    UsageLock lock;
+    string pre(report_prefix);
+    int64_t lister_offset=-1;
+
+    flush_frames();
+    ckpt_put_tag(f,"USAG");
+    ckpt_put_u64(f,age_reference);
+    save_usage(f,walk_usage,true);
+    size_t ndirs=0;
+    for(size_t d=0;d<target_usage.size();d++)
+      ndirs+=!target_usage[d].empty();
+    ckpt_put_u64(f,ndirs);
+    for(size_t d=0;d<target_usage.size();d++)
+      if(!target_usage[d].empty()) {
+        save_key(f,targets[d]);
+        save_usage(f,target_usage[d],true);
+      }
+    ckpt_put_tag(f,"TOPS");
+    save_tops(f,user_top,LEVEL_USER);
+    save_tops(f,group_top,LEVEL_GROUP);
+    save_tops(f,target_top,LEVEL_DIR);
+    ckpt_put_tag(f,"PURG");
+    ckpt_put_u64(f,purge_ages.size());
+    save_purge(f,user_purge,LEVEL_USER);
+    save_purge(f,group_purge,LEVEL_GROUP);
+    save_purge(f,target_purge,LEVEL_DIR);
+    ckpt_put_tag(f,"LAYO");
+    ckpt_put_u64(f,account_layouts);
+    save_layouts(f,user_layout,LEVEL_USER);
+    save_layouts(f,group_layout,LEVEL_GROUP);
+    save_layouts(f,target_layout,LEVEL_DIR);
+
+    /* Write out the big files we have so far, and record where each
+       report file ends. */
+    update_bigfile_reports(big_files,0);
+    ckpt_put_u64(f,report_offset(big_glob_report,pre+"big-files.glob"));
+    ckpt_put_u64(f,report_offset(big_print0_report,pre+"big-files.print0"));
+    ckpt_put_u64(f,report_offset(big_text_report,pre+"big-files.txt"));
+    ckpt_put_u64(f,report_offset(big_xml_report,pre+"big-files.xml"));
     if(list_all_files && file_lister)
-      if(fclose(file_lister))
-        warn("%sall-files.lst: error closing; file may be incomplete: %s\n",prefix,strerror(errno));
+      lister_offset=fl_sync(file_lister);
+    ckpt_put_u64(f,lister_offset);
+    ckpt_put_u64(f,index_offset());
   } catch(const exception &e) {
-    cerr<<prefix<<": cannot generate reports: "<<e.what()<<endl;
+    cerr<<"Cannot checkpoint usage stats: "<<e.what()<<endl;
   } catch(...) {
-    cerr<<prefix<<": cannot generate reports (reason unknown)"<<endl;
+    cerr<<"Unknown exception when checkpointing usage stats."<<endl;
   }
 }
 
+/* us_restore -- see disk_usage.h */
+void us_restore(FILE *f,const char *prefix) {
+  try {
+    UsageLock lock;
+    string pre(prefix);
+    int64_t lister_offset;
+    PairUsage acc;
+    uint64_t n;
+    report_prefix=pre;
+
+    ckpt_get_tag(f,"USAG");
+    age_reference=(time_t)ckpt_get_u64(f);
+    load_usage(f,acc);
+    fold_acc(walk_usage,acc);
+    for(n=ckpt_get_u64(f);n;n--) {
+      FObjInfo d=load_key(f);
+      hash_map<FObjInfo,uint32_t>::const_iterator i=target_ids.find(d);
+      if(i==target_ids.end())
+        fail("%s: checkpoint has usage for a directory that is not targeted.\n",
+             d.get_path().c_str());
+      targets[i->second]=d;
+      load_usage(f,acc);
+      fold_acc(target_usage[i->second],acc);
+    }
+    ckpt_get_tag(f,"TOPS");
+    load_tops(f,user_top,LEVEL_USER);
+    load_tops(f,group_top,LEVEL_GROUP);
+    load_tops(f,target_top,LEVEL_DIR);
+    ckpt_get_tag(f,"PURG");
+    if((n=ckpt_get_u64(f))!=purge_ages.size())
+      fail("Checkpoint simulated %llu purge candidates, not %llu.\n",
+           (unsigned long long)n,(unsigned long long)purge_ages.size());
+    load_purge(f,user_purge,LEVEL_USER);
+    load_purge(f,group_purge,LEVEL_GROUP);
+    load_purge(f,target_purge,LEVEL_DIR);
+    ckpt_get_tag(f,"LAYO");
+    if((int)ckpt_get_u64(f)!=account_layouts)
+      fail("Checkpoint was written with%s --layouts.\n",account_layouts ? "out" : "");
+    load_layouts(f,user_layout,LEVEL_USER);
+    load_layouts(f,group_layout,LEVEL_GROUP);
+    load_layouts(f,target_layout,LEVEL_DIR);
+
+    restore_report(big_glob_report,pre+"big-files.glob",(int64_t)ckpt_get_u64(f));
+    restore_report(big_print0_report,pre+"big-files.print0",(int64_t)ckpt_get_u64(f));
+    restore_report(big_text_report,pre+"big-files.txt",(int64_t)ckpt_get_u64(f));
+    restore_report(big_xml_report,pre+"big-files.xml",(int64_t)ckpt_get_u64(f));
+    lister_offset=(int64_t)ckpt_get_u64(f);
+    if(list_all_files && lister_offset>=0)
+      file_lister=fl_reopen(lister_path(pre).c_str(),list_format,lister_offset,
+                            user_name,group_name);
+    restore_index((int64_t)ckpt_get_u64(f));
+  } catch(const exception &e) {
+    fail("Cannot restore usage stats: %s\n",e.what());
+  } catch(...) {
+    fail("Unknown exception when restoring usage stats.\n");
+  }
+}
+
+/**********************************************************************/
+
+/* Incremental index.  The index file uses the checkpoint format (see
+   checkpoint.h): an INDX section with the big file size the records
+   were made with, then the records, each preceded by a 1, and a 0
+   after the last one.  Records are appended as each directory is
+   scanned, so the index never has to be held in memory while it is
+   written. */
+
+static void save_record(FILE *f,const us_record &r) {
+  ckpt_put_u64(f,r.key.dev);
+  ckpt_put_u64(f,r.key.ino);
+  ckpt_put_u64(f,r.mtime.tv_sec);
+  ckpt_put_u64(f,r.mtime.tv_nsec);
+  ckpt_put_u64(f,r.ctime.tv_sec);
+  ckpt_put_u64(f,r.ctime.tv_nsec);
+  ckpt_put_u64(f,r.ages_until);
+  ckpt_put_u64(f,r.nfiles);
+  ckpt_put_u64(f,r.subdirs.size());
+  for(vector<string>::const_iterator i=r.subdirs.begin();i!=r.subdirs.end();i++)
+    ckpt_put_str(f,i->data(),i->size());
+  save_usage(f,r.usage,false);
+  ckpt_put_u64(f,r.big.size());
+  for(vector<FObjInfo>::const_iterator i=r.big.begin();i!=r.big.end();i++)
+    save_key(f,*i);
+}
+
+static void load_record(FILE *f,us_record &r) {
+  uint64_t n;
+  size_t len;
+  char *name;
+  r.key.dev=ckpt_get_u64(f);
+  r.key.ino=ckpt_get_u64(f);
+  r.mtime.tv_sec=ckpt_get_u64(f);
+  r.mtime.tv_nsec=ckpt_get_u64(f);
+  r.ctime.tv_sec=ckpt_get_u64(f);
+  r.ctime.tv_nsec=ckpt_get_u64(f);
+  r.ages_until=(int64_t)ckpt_get_u64(f);
+  r.nfiles=ckpt_get_u64(f);
+  for(n=ckpt_get_u64(f);n;n--) {
+    name=ckpt_get_str(f,&len);
+    r.subdirs.push_back(string(name,len));
+    free(name);
+  }
+  load_usage(f,r.usage);
+  for(n=ckpt_get_u64(f);n;n--)
+    r.big.push_back(load_key(f));
+}
+
+/* start_index -- start writing a new index, if there is one */
+static void start_index() {
+  if(index_path.empty())
+    return;
+  if((index_out=ckpt_create(index_path.c_str()))) {
+    ckpt_put_tag(index_out,"INDX");
+    ckpt_put_u64(index_out,big_file_size);
+  }
+}
+
+/* load_index -- read the last run's index into old_index */
+static void load_index() {
+  const char *path=index_path.c_str();
+  FILE *f;
+  if(access(path,F_OK)) {
+    warn("%s: no index from a previous run (%s).  Scanning everything.\n",
+         path,strerror(errno));
+    return;
+  }
+  if(!(f=ckpt_try_open(path))) {
+    warn("%s: cannot use the index.  Scanning everything.\n",path);
+    return;
+  }
+  ckpt_get_tag(f,"INDX");
+  if(ckpt_get_u64(f)!=big_file_size) {
+    warn("%s: index was made with a different -b big file size.  Scanning everything.\n",path);
+    fclose(f);
+    return;
+  }
+  while(ckpt_get_u64(f)) {
+    us_record *r=new us_record;
+    load_record(f,*r);
+    us_record *&slot=old_index[r->key];
+    delete slot;
+    slot=r;
+  }
+  ckpt_get_tag(f,"END.");
+  fclose(f);
+  debug("%s: read %llu directories from the index\n",path,
+        (unsigned long long)old_index.size());
+}
+
+/* us_index_start -- see disk_usage.h */
+void us_index_start(const char *path,int reuse) {
+  try {
+    index_path=path;
+    if(reuse)
+      load_index();
+  } catch(const exception &e) {
+    fail("%s: cannot read index: %s\n",path,e.what());
+  } catch(...) {
+    fail("%s: cannot read index (reason unknown)\n",path);
+  }
+}
+
+/* us_index_finish -- see disk_usage.h */
+int us_index_finish(void) {
+  int ret=-1;
+  pthread_mutex_lock(&index_lock);
+  if(index_out) {
+    ckpt_put_u64(index_out,0); /* no more records */
+    if(!(ret=ckpt_commit(index_out,index_path.c_str())))
+      debug("%s: wrote new index\n",index_path.c_str());
+    index_out=NULL;
+  }
+  pthread_mutex_unlock(&index_lock);
+  for(RecordMap::iterator i=old_index.begin();i!=old_index.end();i++)
+    delete i->second;
+  old_index.clear();
+  return ret;
+}
+
+/* us_index_lookup -- see disk_usage.h */
+const us_record *us_index_lookup(const struct stat *s) {
+  RecordMap::const_iterator i=old_index.find(DirKey(s));
+  if(i==old_index.end())
+    return NULL;
+  const us_record *r=i->second;
+  if(r->mtime.tv_sec!=s->st_mtim.tv_sec || r->mtime.tv_nsec!=s->st_mtim.tv_nsec
+     || r->ctime.tv_sec!=s->st_ctim.tv_sec || r->ctime.tv_nsec!=s->st_ctim.tv_nsec)
+    return NULL;
+  if((int64_t)age_reference>=r->ages_until)
+    return NULL; /* a file has aged into another age histogram bucket */
+  return r;
+}
+
+/* us_record_replay -- see disk_usage.h */
+size_t us_record_replay(us_frame *f,const char *dirpath,const us_record *r) {
+  try {
+    UsageLock lock;
+    string dir(dirpath);
+    for(PairUsage::const_iterator i=r->usage.begin();i!=r->usage.end();i++)
+      merge_usage(f,i->first,i->second);
+    for(vector<FObjInfo>::const_iterator b=r->big.begin();b!=r->big.end();b++)
+      if(!top_n)
+        big_files.insert(FObjInfo((dir+b->get_path()).c_str(),&b->get_stat()));
+      else if(S_ISREG(b->get_stat().st_mode))
+        top_file(f,(dir+b->get_path()).c_str(),&b->get_stat());
+    update_bigfile_reports(big_files);
+  } catch(const exception &e) {
+    cerr<<dirpath<<": error updating usage stats from index: "<<e.what()<<endl;
+  } catch(...) {
+    cerr<<dirpath<<": unknown error updating usage stats from index"<<endl;
+  }
+  return r->nfiles;
+}
+
+/* us_record_nsubdirs, us_record_subdir -- see disk_usage.h */
+size_t us_record_nsubdirs(const us_record *r) {
+  return r->subdirs.size();
+}
+const char *us_record_subdir(const us_record *r,size_t i,size_t *len) {
+  assert(i<r->subdirs.size());
+  *len=r->subdirs[i].size();
+  return r->subdirs[i].c_str();
+}
+
+/* us_record_* -- building new records; see disk_usage.h */
+us_record *us_record_new(const struct stat *dirstat) {
+  return new us_record(dirstat);
+}
+void us_record_file(us_record *r,const char *name,const struct stat *s) {
+  if(r->spoiled)
+    return;
+  try {
+    r->nfiles++;
+    r->usage[owner_key(s)].add(s,USAGE_TYPE_FSOBJ);
+    if(S_ISREG(s->st_mode)) {
+      int64_t end=age_bucket_end(s->st_mtime);
+      if(end<r->ages_until)
+        r->ages_until=end;
+    }
+    if((int64_t)s->st_size>(int64_t)big_file_size)
+      r->big.push_back(FObjInfo(name,s));
+  } catch(...) {
+    r->spoiled=true;
+  }
+}
+void us_record_subdir_found(us_record *r,const char *name,size_t len) {
+  if(r->spoiled)
+    return;
+  try {
+    r->subdirs.push_back(string(name,len));
+  } catch(...) {
+    r->spoiled=true;
+  }
+}
+void us_record_spoil(us_record *r) {
+  r->spoiled=true;
+}
+void us_record_save(const us_record *r) {
+  if(r->spoiled)
+    return;
+  pthread_mutex_lock(&index_lock);
+  if(index_out) {
+    ckpt_put_u64(index_out,1); /* another record follows */
+    save_record(index_out,*r);
+  }
+  pthread_mutex_unlock(&index_lock);
+}
+void us_record_free(us_record *r) {
+  delete r;
+}
+
 /* us_reset -- see disk_usage.h */
 void us_reset() {
   try {
-    dir_user_usage.clear();
-    user_dir_usage.clear();
-    dir_usage.clear();
-    user_usage.clear();
-    all_usage.clear();
-
-    group_usage.clear();
-    dir_group_usage.clear();
-    user_group_usage.clear();
-    group_user_usage.clear();
-    dir_group_user_usage.clear();
+    UsageLock lock;
+    walk_usage.clear();
+    for(size_t d=0;d<target_usage.size();d++)
+      target_usage[d].clear();
+    user_ids.clear();
+    group_ids.clear();
+    user_top.clear();
+    group_top.clear();
+    target_top.clear();
+    top_paths.clear();
+    user_purge.clear();
+    group_purge.clear();
+    target_purge.clear();
+    user_layout.clear();
+    group_layout.clear();
+    target_layout.clear();
+
+    outside_acc.clear();
+    for(us_frame *f=live_frames;f;f=f->next)
+      f->acc.clear();
   } catch(const exception &e) {
     cerr<<"Cannot reset usage stats: "<<e.what()<<endl;
   } catch(...) {
@@ -778,7 +2537,7 @@ FObjInfo::FObjInfo(const string &name):
 }
 FObjInfo::~FObjInfo() {}
 bool FObjInfo::decide_targeted() const {
-  return target_dirs.find(*this)!=target_dirs.end();
+  return target_ids.find(*this)!=target_ids.end();
 }
 
 /**********************************************************************/
@@ -789,12 +2548,15 @@ UserInfo::UserInfo(const struct stat *s): uid(s->st_uid) {}
 UserInfo::UserInfo(uid_t u): uid(u) {}
 UserInfo::~UserInfo() {}
 const string &UserInfo::find_name() const {
+  return name=user_names.get(uid);
+}
+static string resolve_user(uint32_t uid) {
   struct passwd *pwd=getpwuid(uid);
   if(pwd && pwd->pw_name)
-    return name=pwd->pw_name;
+    return pwd->pw_name;
   ostringstream oss;
   oss<<uid;
-  return name=oss.str();
+  return oss.str();
 }
 
 /**********************************************************************/
@@ -805,12 +2567,15 @@ GroupInfo::GroupInfo(const struct stat *s): gid(s->st_gid) {}
 GroupInfo::GroupInfo(uid_t g): gid(g) {}
 GroupInfo::~GroupInfo() {}
 const string &GroupInfo::find_name() const {
+  return name=group_names.get(gid);
+}
+static string resolve_group(uint32_t gid) {
   struct group *g=getgrgid(gid);
   if(g && g->gr_name)
-    return name=g->gr_name;
+    return g->gr_name;
   ostringstream oss;
   oss<<gid;
-  return name=oss.str();
+  return oss.str();
 }
 
 /**********************************************************************/
@@ -836,6 +2601,40 @@ void UsageInfo::clear() {
   big_files=0;
   dir_unopenable=0; dir_too_deep=0; filename_too_long=0;
   path_too_long=0; duplicate_objects=0; deleted_fsobj=0;
+  sizes.clear(); ages.clear();
+}
+void UsageInfo::save(FILE *f) const {
+  // NOTE: MAKE SURE THESE MATCH load()
+  ckpt_put_u64(f,regulars); ckpt_put_u64(f,dirs); ckpt_put_u64(f,links);
+  ckpt_put_u64(f,others); ckpt_put_u64(f,bytes);
+  ckpt_put_u64(f,latest_a); ckpt_put_u64(f,latest_m); ckpt_put_u64(f,latest_c);
+  ckpt_put_u64(f,world_writable); ckpt_put_u64(f,setuid_file); ckpt_put_u64(f,setgid_file);
+  ckpt_put_u64(f,big_files);
+  ckpt_put_u64(f,dir_unopenable); ckpt_put_u64(f,dir_too_deep); ckpt_put_u64(f,filename_too_long);
+  ckpt_put_u64(f,path_too_long); ckpt_put_u64(f,duplicate_objects); ckpt_put_u64(f,deleted_fsobj);
+  sizes.save(f); ages.save(f);
+}
+void UsageInfo::load(FILE *f) {
+  regulars=ckpt_get_u64(f); dirs=ckpt_get_u64(f); links=ckpt_get_u64(f);
+  others=ckpt_get_u64(f); bytes=ckpt_get_u64(f);
+  latest_a=ckpt_get_u64(f); latest_m=ckpt_get_u64(f); latest_c=ckpt_get_u64(f);
+  world_writable=ckpt_get_u64(f); setuid_file=ckpt_get_u64(f); setgid_file=ckpt_get_u64(f);
+  big_files=ckpt_get_u64(f);
+  dir_unopenable=ckpt_get_u64(f); dir_too_deep=ckpt_get_u64(f); filename_too_long=ckpt_get_u64(f);
+  path_too_long=ckpt_get_u64(f); duplicate_objects=ckpt_get_u64(f); deleted_fsobj=ckpt_get_u64(f);
+  sizes.load(f); ages.load(f);
+}
+void UsageInfo::merge(const UsageInfo &u) {
+  regulars+=u.regulars; dirs+=u.dirs; links+=u.links; others+=u.others; bytes+=u.bytes;
+  if(u.latest_a>latest_a) latest_a=u.latest_a;
+  if(u.latest_m>latest_m) latest_m=u.latest_m;
+  if(u.latest_c>latest_c) latest_c=u.latest_c;
+  world_writable+=u.world_writable; setuid_file+=u.setuid_file; setgid_file+=u.setgid_file;
+  big_files+=u.big_files;
+  dir_unopenable+=u.dir_unopenable; dir_too_deep+=u.dir_too_deep;
+  filename_too_long+=u.filename_too_long; path_too_long+=u.path_too_long;
+  duplicate_objects+=u.duplicate_objects; deleted_fsobj+=u.deleted_fsobj;
+  sizes.merge(u.sizes); ages.merge(u.ages);
 }
 void UsageInfo::add(const struct stat *s,int type) {
   // First, handle the various weird USAGE_TYPEs:
@@ -889,8 +2688,13 @@ void UsageInfo::add(const struct stat *s,int type) {
       setgid_file++;
   }
 
-  // For regular files, update the latest mtime, atime and ctime seen:
+  // For regular files, update the histograms, and the latest mtime,
+  // atime and ctime seen:
   if(S_ISREG(s->st_mode)) {
+    uint64_t size=s->st_size>0 ? s->st_size : 0;
+    sizes.add(log2_bucket(size,SIZE_BUCKETS),size);
+    ages.add(age_bucket(s->st_mtime),size);
+
     if(s->st_mtime>latest_m)
       latest_m=s->st_mtime;
     if(s->st_atime>latest_a)
@@ -900,21 +2704,21 @@ void UsageInfo::add(const struct stat *s,int type) {
   }
 }
 
-void UsageInfo::xml_report(ostream &o,const string &indent) const {
+void UsageInfo::xml_report(XmlWriter &o,const string &indent) const {
   /* Generate an XML usage report inside a <usage> element */
-  o<<indent<<"<usage>"<<endl;
+  o<<indent<<"<usage>"<<'\n';
 
   /* Filesystem object type counts */
   o<<indent<<"  <fsobject total=\""<<(regulars+dirs+links+others)
    <<"\" regulars=\""<<regulars<<"\" dirs=\""<<dirs<<"\" links=\""<<links
-   <<"\" others=\""<<others<<"\"/>"<<endl;
+   <<"\" others=\""<<others<<"\"/>"<<'\n';
 
   /* Total size in bytes */
-  o<<indent<<"  <space bytes=\""<<bytes<<"\"/>"<<endl;
+  o<<indent<<"  <space bytes=\""<<bytes<<"\"/>"<<'\n';
 
   /* Most recent m/c/a times */
   o<<indent<<"  <latest mtime=\""<<latest_m<<"\" ctime=\""<<latest_c
-   <<"\" atime=\""<<latest_a<<"\"/>"<<endl;
+   <<"\" atime=\""<<latest_a<<"\"/>"<<'\n';
 
   /* Naughty file stats */
   if(world_writable||setuid_file||setgid_file) {
@@ -922,16 +2726,38 @@ void UsageInfo::xml_report(ostream &o,const string &indent) const {
     if(world_writable) o<<" world_writable=\""<<world_writable<<"\"";
     if(setuid_file) o<<" setuid_file=\""<<setuid_file<<"\"";
     if(setgid_file) o<<" setgid_file=\""<<setgid_file<<"\"";
-    o<<"/>"<<endl;
+    o<<"/>"<<'\n';
+  }
+
+  /* Size and age histograms of regular files */
+  if(regulars) {
+    o<<indent<<"  <size_histogram>"<<'\n';
+    for(unsigned b=0;b<SIZE_BUCKETS;b++)
+      if(sizes.count[b]) {
+        o<<indent<<"    <bucket min=\""<<(b ? ((uint64_t)1)<<(b-1) : 0)<<"\"";
+        if(b<SIZE_BUCKETS-1)
+          o<<" max=\""<<(((uint64_t)1)<<b)-1<<"\"";
+        o<<" count=\""<<sizes.count[b]<<"\" bytes=\""<<sizes.bytes[b]<<"\"/>"<<'\n';
+      }
+    o<<indent<<"  </size_histogram>"<<'\n';
+    o<<indent<<"  <age_histogram reference=\""<<age_reference<<"\">"<<'\n';
+    for(unsigned b=0;b<AGE_BUCKETS;b++)
+      if(ages.count[b]) {
+        o<<indent<<"    <bucket min_days=\""<<(b ? ((uint64_t)1)<<(b-1) : 0)<<"\"";
+        if(b<AGE_BUCKETS-1)
+          o<<" max_days=\""<<(((uint64_t)1)<<b)-1<<"\"";
+        o<<" count=\""<<ages.count[b]<<"\" bytes=\""<<ages.bytes[b]<<"\"/>"<<'\n';
+      }
+    o<<indent<<"  </age_histogram>"<<'\n';
   }
 
   /* Big file stats */
   if(big_files)
-    o<<indent<<"  <bigfile threshold=\""<<big_file_size<<"\" count=\""<<big_files<<"\"/>"<<endl;
+    o<<indent<<"  <bigfile threshold=\""<<big_file_size<<"\" count=\""<<big_files<<"\"/>"<<'\n';
 
   /* deleted files */
   if(deleted_fsobj)
-    o<<indent<<"  <deletions count=\""<<deleted_fsobj<<"\"/>"<<endl;
+    o<<indent<<"  <deletions count=\""<<deleted_fsobj<<"\"/>"<<'\n';
 
   /* Access restriction stats */
   if(dir_unopenable||dir_too_deep||filename_too_long||path_too_long||duplicate_objects) {
@@ -941,11 +2767,11 @@ void UsageInfo::xml_report(ostream &o,const string &indent) const {
     if(filename_too_long) o<<" filename_too_long=\""<<filename_too_long<<"\"";
     if(path_too_long) o<<" path_too_long=\""<<path_too_long<<"\"";
     if(duplicate_objects) o<<" duplicate_objects=\""<<duplicate_objects<<"\"";
-    o<<"/>"<<endl;
+    o<<"/>"<<'\n';
   }
 
   /* End the element */
-  o<<indent<<"</usage>"<<endl;
+  o<<indent<<"</usage>"<<'\n';
 }
 
 /**********************************************************************/
@@ -963,25 +2789,119 @@ ostream &exceptall(ostream &o) {
 }
 
 string xmlify(const string &str) { // turn string into an XML-okay version
-  string::const_iterator from=str.begin(),end=str.end();
-  ostringstream out;
-  for(;from!=end;from++) {
-    if(*from<33 || *from>126) {
-      out<<"&#"<<setw(4)<<setfill('0')<<right<<hex<<int(*from)<<resetall<<';';
+  if(!xml_escape_needed(str.data(),str.size()))
+    return str;
+  string out;
+  xml_escape(out,str.data(),str.size());
+  return out;
+}
+
+bool xml_escape_needed(const char *str,size_t n) {
+  for(size_t i=0;i<n;i++) {
+    char c=str[i];
+    if(c<33 || c>126 || c=='"' || c=='\'' || c=='&' || c=='<' || c=='>')
+      return true;
+  }
+  return false;
+}
+
+void xml_escape(string &out,const char *str,size_t n) {
+  char num[16];
+  out.reserve(out.size()+n+16);
+  for(size_t i=0;i<n;i++) {
+    char c=str[i];
+    if(c<33 || c>126) {
+      snprintf(num,sizeof(num),"&#%04x;",(unsigned)int(c));
+      out+=num;
     } else {
-      switch(*from) {
-      case '"':  out<<"&quot;"; break;
-      case '\'': out<<"&apos;"; break;
-      case '&':  out<<"&amp;";  break;
-      case '<':  out<<"&lt;" ;  break;
-      case '>':  out<<"&gt;" ;  break;
+      switch(c) {
+      case '"':  out+="&quot;"; break;
+      case '\'': out+="&apos;"; break;
+      case '&':  out+="&amp;";  break;
+      case '<':  out+="&lt;" ;  break;
+      case '>':  out+="&gt;" ;  break;
       default:
-        out<<*from;
+        out+=c;
         break;
       }
     }
   }
-  return out.str();
+}
+
+/**********************************************************************/
+
+/* Implementation of XmlWriter; see the class definition */
+
+XmlWriter::XmlWriter(const string &where): where(where),fd(-1),buffer(NULL),used(0),ok(false) {
+  if(!(buffer=(char*)malloc(XML_BUFFER_SIZE)))
+    warn("%s: cannot allocate %llu bytes: %s\n",where.c_str(),
+         (unsigned long long)XML_BUFFER_SIZE,strerror(errno));
+  else if((fd=open(where.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0666))<0)
+    warn("%s: cannot create report: %s\n",where.c_str(),strerror(errno));
+  else
+    ok=true;
+}
+bool XmlWriter::close() {
+  if(fd>=0) {
+    flush();
+    if(fd>=0 && ::close(fd)) {
+      warn("%s: write error: %s\n",where.c_str(),strerror(errno));
+      ok=false;
+    }
+    fd=-1;
+  }
+  free(buffer);
+  buffer=NULL;
+  used=0;
+  return ok;
+}
+void XmlWriter::flush() {
+  write_direct(buffer,used);
+  used=0;
+}
+XmlWriter &XmlWriter::write_direct(const char *s,size_t n) {
+  ssize_t w;
+  while(fd>=0 && n) {
+    if((w=::write(fd,s,n))<0) {
+      if(errno==EINTR)
+        continue;
+      warn("%s: write error: %s\n",where.c_str(),strerror(errno));
+      ::close(fd);
+      fd=-1;
+      ok=false;
+    } else {
+      s+=w;
+      n-=w;
+    }
+  }
+  return *this;
+}
+XmlWriter &XmlWriter::operator<<(const XmlText &t) {
+  if(!xml_escape_needed(t.s.data(),t.s.size()))
+    return *this<<t.s;
+  string out;
+  xml_escape(out,t.s.data(),t.s.size());
+  return *this<<out;
+}
+XmlWriter &XmlWriter::operator<<(unsigned long long n) {
+  char digits[24],*p=digits+sizeof(digits);
+  do {
+    *--p='0'+n%10;
+    n/=10;
+  } while(n);
+  return write(p,digits+sizeof(digits)-p);
+}
+XmlWriter &XmlWriter::operator<<(long long n) {
+  if(n<0) {
+    *this<<'-';
+    return *this<<(unsigned long long)0-(unsigned long long)n;
+  }
+  return *this<<(unsigned long long)n;
+}
+XmlWriter &XmlWriter::operator<<(double d) {
+  char num[32];
+  int n=snprintf(num,sizeof(num),"%.16g",d);
+  return write(num,n);
 }
 
 string globify(const string &str) { // turn string into a glob-okay version
@@ -8,10 +8,14 @@
 #define _ATFILE_SOURCE
 #endif
 
+#include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "basic_utils.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,10 +24,24 @@ extern "C" {
   void us_list_all_files(int shouldi);
   int us_get_list_all_files(); /* accessor */
 
+  /* us_list_format: the format of the list of all files: FL_TEXT
+     (all-files.lst, the default), FL_BINARY (all-files.bin) or
+     FL_COLUMNS (all-files.col).  See file_list.h. */
+  void us_list_format(int format);
+
   /* us_add_dir: call this to add a directory to the list of those for
      which you want usage statistics */
   void us_add_dir(const char *dirname);
 
+  /* us_load_names: read user and group names from files in
+     passwd(5) and group(5) format (either may be NULL), such as
+     snapshots of /etc/passwd and /etc/group or the output of "getent
+     passwd" and "getent group".  Each uid or gid is otherwise looked
+     up once, with getpwuid or getgrgid, the first time it is seen;
+     this saves those lookups when they are slow, as through LDAP.
+     Ids not in the files are still looked up. */
+  void us_load_names(const char *passwd_file,const char *group_file);
+
   /* us_start_reports: use this to prepare to generate usage
      statistics reports.  You must call this after all us_add_dir
      calls, but before calling any other functions. */
@@ -31,8 +49,10 @@ extern "C" {
 
   /* us_generate_reports: call this to generate usage statistics
      reports.  The report filenames will have the specified prefix
-     prepended to them with no interveneing "/".  */
-  void us_generate_reports(const char *prefix,
+     prepended to them with no interveneing "/".  Returns 0 if every
+     report was written and closed, or -1 after a warning if any may
+     be incomplete. */
+  int us_generate_reports(const char *prefix,
                            double start_time,
                            double end_time,
                            size_t max_depth);
@@ -41,39 +61,113 @@ extern "C" {
   void us_set_big_file_size(size_t size);
   size_t us_get_big_file_size();
 
+  /* us_set_top_files: if n is non-zero, rank big files instead of
+     listing them all: keep the n largest for each owner, group and
+     targeted directory, and write them, sorted, to the
+     by-user-top-files, by-group-top-files and by-dir-top-files
+     reports instead of the big-files reports.  Memory use then
+     depends on n, not on the number of big files. */
+  void us_set_top_files(size_t n);
+
+  /* us_report_threads: write up to n reports at once, each on its own
+     thread, in us_generate_reports.  Each report being made holds a
+     copy of its entries, so this also multiplies the memory used
+     while the reports are written.  Default: 1 */
+  void us_report_threads(size_t n);
+
+  /* us_sort_reports: if shouldi, list directories by path, owners by
+     uid and groups by gid in the reports (and big files of the same
+     size by path), so that the same tree always gives the same
+     reports.  Otherwise, directories are in the order they were
+     added, and owners and groups in the order they were first seen,
+     which changes from run to run when walking with several threads.
+     The big-files listings are never sorted. */
+  void us_sort_reports(int shouldi);
+
+  /* us_set_purge_candidates: the n deletion policies being simulated
+     (see us_purge_found): candidate c deletes objects at least
+     ages[c] seconds old, at depth min_depths[c] or deeper.  At most
+     64.  The files and bytes each would free are written to the
+     by-user-purge, by-group-purge and by-dir-purge reports. */
+  void us_set_purge_candidates(size_t n,const int64_t *ages,const int *min_depths);
+
+  /* us_account_layouts: if shouldi, count the Lustre striping of
+     regular files, as passed to us_layout_found, for each owner,
+     group and targeted directory: files and bytes by stripe count
+     and by OST pool, objects and bytes by OST, and files with
+     composite layouts, no OST objects or unreadable layouts.  These
+     go in the by-user-layout, by-group-layout and by-dir-layout
+     reports, which explain their elements in a comment. */
+  void us_account_layouts(int shouldi);
+
+  /* us_checkpoint: write all usage statistics to a checkpoint (see
+     checkpoint.h), along with the current end of each report file.
+     The walker must be paused. */
+  void us_checkpoint(FILE *f);
+
+  /* us_restore: read the usage statistics written by us_checkpoint,
+     and reopen the report files, discarding anything written after
+     the checkpoint.  Call this instead of us_start_reports when
+     resuming a walk. */
+  void us_restore(FILE *f,const char *prefix);
+
   /* us_reset: reset all usage statistics.  Use this to generate
      statistics for separate filesets */
   void us_reset();
- 
+
   /********************************************************************/
   /* The remainder of these functions are callback functions, intended
      only to be called by the main directory walker routines (walk and
-     walk_impl).  Do not call these yourself. */
+     walk_impl).  Do not call these yourself.
 
-  /* walker is entering directory dirname: */
-  void us_dir_enter(const char *dirname,const struct stat *s);
+     The walker may process several directories at once in different
+     threads.  Each directory has a us_frame, obtained from
+     us_dir_enter, which must be passed to the callbacks for objects
+     within that directory.  A frame must not be left (us_dir_leave)
+     until all of its subdirectories have been left.  All callbacks
+     are thread-safe. */
 
-  /* walker is leaving directory dirname: */
-  void us_dir_leave(const char *dirname,const struct stat *s);
+  /* us_frame -- opaque per-directory usage accounting context.  NULL
+     is a valid frame: it means "not within any targeted directory." */
+  typedef struct us_frame us_frame;
+
+  /* walker is entering directory dirname, within the parent frame
+     (NULL for a top-level directory).  Returns the frame to use for
+     the contents of dirname: */
+  us_frame *us_dir_enter(us_frame *parent,const char *dirname,const struct stat *s);
+
+  /* walker is leaving directory dirname, whose frame is f: */
+  void us_dir_leave(us_frame *f,const char *dirname,const struct stat *s);
 
   /* walker wants disk usage statistics updated for this file/dir: */
-  void us_file_found(const char *filename,const struct stat *s);
+  void us_file_found(us_frame *f,const char *filename,const struct stat *s);
 
   /* walker just deleted this file/dir (us_file_found will NOT be called): */
-  void us_file_deleted(const char *filename,const struct stat *s);
+  void us_file_deleted(us_frame *f,const char *filename,const struct stat *s);
+
+  /* walker would delete this file/dir under each simulated purge
+     candidate whose bit is set in candidates (bit c for candidate c
+     of us_set_purge_candidates), but is only simulating.
+     us_file_found is still called. */
+  void us_purge_found(us_frame *f,const struct stat *s,uint64_t candidates);
+
+  /* walker found this regular file, whose layout is l (see
+     lustre_stat), and us_account_layouts is on.  us_file_found is
+     still called. */
+  void us_layout_found(us_frame *f,const struct stat *s,const lustre_layout *l);
 
   /* walker cannot call opendir on this dirname: */
-  void us_dir_unopenable(const char *dirname,const struct stat *s);
+  void us_dir_unopenable(us_frame *f,const char *dirname,const struct stat *s);
 
   /* walker will not recurse because this dirname is too deeply nested: */
-  void us_dir_too_deep(const char *filename,const struct stat *s);
+  void us_dir_too_deep(us_frame *f,const char *filename,const struct stat *s);
 
   /* walker will not process a filename because it is too long
        dirname -- parent directory, whose path length is okay
        filepart -- file basename whose name is too long
        s -- stat structure for the DIRECTORY, not the file
   */
-  void us_filename_too_long(const char *dirname,const char *filepart,const struct stat *s);
+  void us_filename_too_long(us_frame *f,const char *dirname,const char *filepart,const struct stat *s);
 
   /* walker will not process a filename because it would be too long
      when appended to the directory path
@@ -81,13 +175,72 @@ extern "C" {
        filepart -- file basename, whose length is okay, BUT
            the dirname+"/"+filepart would be too long
        s -- stat structure for the DIRECTORY not the file */
-  void us_path_too_long(const char *dirname,const char *filepart,const struct stat *s);
+  void us_path_too_long(us_frame *f,const char *dirname,const char *filepart,const struct stat *s);
 
   /* us_duplicate: called when a duplicate file is found.  Could be a
      hard link, or a mv executed during execution of this program.
      Note that this is not called for the first time the file is
      found, just the second and thereafter. */
-  void us_dupicate(const char *filename,const struct stat *s);
+  void us_dupicate(us_frame *f,const char *filename,const struct stat *s);
+
+  /* Incremental index.  A directory's entry list only changes when
+     its mtime or ctime does, so what the files directly within an
+     unchanged directory contributed to the statistics last time can
+     be reused instead of reading and statting them again.  The index
+     records that contribution for each directory scanned, keyed by
+     device, inode, mtime and ctime.  Subdirectories are not included:
+     a change deep in the tree does not change its ancestors' times,
+     so every subdirectory must still be statted and looked up.
+
+     A reused directory gets the sizes, times, owners and permissions
+     its files had when it was last scanned.  Changes that do not
+     touch the directory itself (writing to a file in place, chmod or
+     chown) are not seen until the directory is next scanned.  Only
+     use the index when that is acceptable.  Ages are kept exact: a
+     record also holds the first time at which one of its files moves
+     to another age histogram bucket, and the directory is scanned
+     again once the walk starts after that. */
+
+  /* us_index_start: read the index written by the last run at path,
+     if reuse is non-zero, and write a new one there as the walk
+     proceeds.  Call this before us_start_reports or us_restore. */
+  void us_index_start(const char *path,int reuse);
+
+  /* us_index_finish: replace the old index with the new one.  Call
+     this once the walk is complete.  Returns 0 on success, or -1
+     after a warning if the new index could not be written. */
+  int us_index_finish(void);
+
+  /* us_record -- the contribution of one directory's files (not
+     subdirectories) to the usage statistics */
+  typedef struct us_record us_record;
+
+  /* us_index_lookup: returns the old index's record for the directory
+     with stat structure s, or NULL if there is none, the directory
+     has changed since then, or its files' age buckets have. */
+  const us_record *us_index_lookup(const struct stat *s);
+
+  /* us_record_replay: add the files in r, which are in directory
+     dirpath (with a trailing /), to the usage statistics in frame f.
+     Returns the number of files. */
+  size_t us_record_replay(us_frame *f,const char *dirpath,const us_record *r);
+
+  /* us_record_nsubdirs/us_record_subdir: the names of the
+     subdirectories in r */
+  size_t us_record_nsubdirs(const us_record *r);
+  const char *us_record_subdir(const us_record *r,size_t i,size_t *len);
+
+  /* Building new records, while scanning a directory.  A record is
+     only used by the thread scanning its directory, so these need no
+     locking.  Spoil the record if something was seen that cannot be
+     replayed, such as a hard link or an entry that could not be
+     statted; us_record_save will then leave it out of the index. */
+  us_record *us_record_new(const struct stat *dirstat);
+  void us_record_file(us_record *r,const char *name,const struct stat *s);
+  void us_record_subdir_found(us_record *r,const char *name,size_t len);
+  void us_record_spoil(us_record *r);
+  void us_record_save(const us_record *r);
+  void us_record_free(us_record *r);
 
 #ifdef __cplusplus
 }
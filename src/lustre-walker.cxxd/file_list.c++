@@ -0,0 +1,580 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <ext/hash_map>
+#include <algorithm>
+
+#include "file_list.h"
+#include "basic_utils.h"
+#include "paranoia.h"
+
+using namespace std;
+using namespace __gnu_cxx;
+
+/* FL_MAGIC, FL_COLUMNS_MAGIC -- first bytes of a binary or columnar
+   listing.  Change the version number whenever the format changes. */
+#define FL_MAGIC "LWLIST01"
+#define FL_COLUMNS_MAGIC "LWCOLS01"
+#define FL_MAGIC_LEN 8
+
+/* FL_CHUNK_ROWS -- maximum number of files in a columnar chunk */
+#define FL_CHUNK_ROWS 65536
+
+/* FL_BUFFER_SIZE -- size of the stdio buffer for a listing, so that
+   millions of small records become a few large writes */
+#define FL_BUFFER_SIZE (4*1048576)
+
+/* FL_NSTATS, FL_NSTREAMS -- number of columns with statistics, and
+   of streams, in a columnar chunk */
+#define FL_NSTATS 7
+#define FL_NSTREAMS 10
+
+/* FL_FIXED_LEN -- length of a binary F record up to the lengths */
+#define FL_FIXED_LEN (1+1+2+4*8+2*4)
+
+/* put_le/get_le -- store or load the n-byte little-endian number at p */
+static inline unsigned char *put_le(unsigned char *p,uint64_t value,int n) {
+  for(int i=0;i<n;i++,value>>=8)
+    *p++=(unsigned char)value;
+  return p;
+}
+static inline uint64_t get_le(const unsigned char *p,int n) {
+  uint64_t value=0;
+  for(int i=n-1;i>=0;i--)
+    value=(value<<8)|p[i];
+  return value;
+}
+
+/* put_varint -- store value at p as an unsigned LEB128 varint (at
+   most 10 bytes), and return the end */
+static inline unsigned char *put_varint(unsigned char *p,uint64_t value) {
+  while(value>=0x80) {
+    *p++=(unsigned char)(value|0x80);
+    value>>=7;
+  }
+  *p++=(unsigned char)value;
+  return p;
+}
+
+/* file_type -- the type letter in the listing for mode */
+static char file_type(mode_t mode) {
+  if(S_ISDIR(mode))
+    return 'd';
+  else if(S_ISREG(mode))
+    return '-';
+  else if(S_ISLNK(mode))
+    return 'l';
+  return '?';
+}
+
+/**********************************************************************/
+
+/* Column -- one numeric column of a columnar chunk, with its
+   minimum and maximum.  T is signed for the times, so that their
+   statistics compare correctly. */
+template<class T> struct Column {
+  vector<T> values;
+  T min,max;
+  void add(T value) {
+    if(values.empty() || value<min)
+      min=value;
+    if(values.empty() || value>max)
+      max=value;
+    values.push_back(value);
+  }
+  /* put -- append the values to stream as width-byte numbers */
+  void put(string &stream,int width) const {
+    unsigned char buf[8];
+    stream.reserve(values.size()*width);
+    for(size_t i=0;i<values.size();i++) {
+      put_le(buf,(uint64_t)values[i],width);
+      stream.append((const char*)buf,width);
+    }
+  }
+};
+
+// hash function wrapper for paths in __gnu_cxx::hash_map:
+struct StringHash {
+  size_t operator() (const string &value) const {
+    return __stl_hash_string(value.c_str());
+  }
+};
+
+/* Chunk -- the files collected for the next chunk of a columnar
+   listing.  Each path is split after its last "/" into a directory,
+   numbered in the chunk's dictionary (dir_ids, dirs), and a name. */
+struct Chunk {
+  Column<uint32_t> mode,uid,gid;
+  Column<uint64_t> size;
+  Column<int64_t> mtime,atime,ctime;
+  vector<uint32_t> dir;
+  string names;
+  hash_map<string,uint32_t,StringHash> dir_ids;
+  vector<string> dirs;
+  inline size_t rows() const { return dir.size(); }
+};
+
+/* file_list -- a listing being written.  For binary listings, users
+   and groups map each uid and gid to the index of its U or G record,
+   and prev is the last path written, for front coding.  chunk holds
+   the unwritten files of a columnar listing. */
+struct file_list {
+  FILE *f;
+  char *buffer;
+  int format;
+  string path;
+  fl_name_func user_name,group_name;
+  hash_map<uint32_t,uint32_t> users,groups;
+  string prev;
+  Chunk *chunk;
+};
+
+/* open_list -- shared part of fl_create and fl_reopen */
+static file_list *open_list(const char *path,const char *mode,int format,
+                            fl_name_func user_name,fl_name_func group_name) {
+  file_list *l=new file_list;
+  l->format=format;
+  l->path=path;
+  l->user_name=user_name;
+  l->group_name=group_name;
+  l->chunk=(format==FL_COLUMNS ? new Chunk : NULL);
+  if(!(l->f=fopen(path,mode))) {
+    warn("%s: cannot open for writing: %s\n",path,strerror(errno));
+    delete l->chunk;
+    delete l;
+    return NULL;
+  }
+  if((l->buffer=(char*)malloc(FL_BUFFER_SIZE)))
+    setvbuf(l->f,l->buffer,_IOFBF,FL_BUFFER_SIZE);
+  return l;
+}
+
+/* fl_create -- see file_list.h */
+file_list *fl_create(const char *path,int format,
+                     fl_name_func user_name,fl_name_func group_name) {
+  file_list *l=open_list(path,"wb",format,user_name,group_name);
+  if(!l)
+    return NULL;
+  if(format==FL_BINARY)
+    fwrite(FL_MAGIC,1,FL_MAGIC_LEN,l->f);
+  else if(format==FL_COLUMNS)
+    fwrite(FL_COLUMNS_MAGIC,1,FL_MAGIC_LEN,l->f);
+  else
+    fl_print_header(l->f);
+  return l;
+}
+
+/* fl_reopen -- see file_list.h.  The new writer has not defined any
+   names yet, so it defines them again, and its first path is not
+   front-coded. */
+file_list *fl_reopen(const char *path,int format,int64_t offset,
+                     fl_name_func user_name,fl_name_func group_name) {
+  if(truncate(path,(off_t)offset)) {
+    warn("%s: cannot truncate to checkpoint position: %s\n",path,strerror(errno));
+    return NULL;
+  }
+  return open_list(path,"ab",format,user_name,group_name);
+}
+
+/* intern -- returns the index of id's name, writing a U or G record
+   (tag) to define it if this is the first time it is seen */
+static uint32_t intern(file_list *l,hash_map<uint32_t,uint32_t> &ids,
+                       char tag,uint32_t id,fl_name_func name_of) {
+  hash_map<uint32_t,uint32_t>::const_iterator i=ids.find(id);
+  if(i!=ids.end())
+    return i->second;
+  uint32_t index=(uint32_t)ids.size();
+  const char *name=name_of(id);
+  size_t len=strlen(name);
+  unsigned char head[1+4+4+10],*p=head;
+  *p++=(unsigned char)tag;
+  p=put_le(p,index,4);
+  p=put_le(p,id,4);
+  p=put_varint(p,len);
+  fwrite(head,1,p-head,l->f);
+  fwrite(name,1,len,l->f);
+  ids[id]=index;
+  return index;
+}
+
+/* write_chunk -- write out and empty the chunk of a columnar listing */
+static void write_chunk(file_list *l) {
+  Chunk &c=*l->chunk;
+  string streams[FL_NSTREAMS];
+  unsigned char head[1+4+4+(FL_NSTATS*2+FL_NSTREAMS)*8],*p=head;
+  size_t i;
+  if(!c.rows())
+    return;
+
+  for(i=0;i<c.dirs.size();i++) {
+    unsigned char len[10];
+    streams[0].append((const char*)len,put_varint(len,c.dirs[i].size())-len);
+    streams[0].append(c.dirs[i]);
+  }
+  c.mode.put(streams[1],4);
+  c.uid.put(streams[2],4);
+  c.gid.put(streams[3],4);
+  c.size.put(streams[4],8);
+  c.mtime.put(streams[5],8);
+  c.atime.put(streams[6],8);
+  c.ctime.put(streams[7],8);
+  for(i=0;i<c.dir.size();i++) {
+    unsigned char buf[4];
+    put_le(buf,c.dir[i],4);
+    streams[8].append((const char*)buf,4);
+  }
+  streams[9].swap(c.names);
+
+  *p++='C';
+  p=put_le(p,c.rows(),4);
+  p=put_le(p,c.dirs.size(),4);
+  p=put_le(p,c.mode.min,8);  p=put_le(p,c.mode.max,8);
+  p=put_le(p,c.uid.min,8);   p=put_le(p,c.uid.max,8);
+  p=put_le(p,c.gid.min,8);   p=put_le(p,c.gid.max,8);
+  p=put_le(p,c.size.min,8);  p=put_le(p,c.size.max,8);
+  p=put_le(p,(uint64_t)c.mtime.min,8); p=put_le(p,(uint64_t)c.mtime.max,8);
+  p=put_le(p,(uint64_t)c.atime.min,8); p=put_le(p,(uint64_t)c.atime.max,8);
+  p=put_le(p,(uint64_t)c.ctime.min,8); p=put_le(p,(uint64_t)c.ctime.max,8);
+  for(i=0;i<FL_NSTREAMS;i++)
+    p=put_le(p,streams[i].size(),8);
+  fwrite(head,1,p-head,l->f);
+  for(i=0;i<FL_NSTREAMS;i++)
+    fwrite(streams[i].data(),1,streams[i].size(),l->f);
+
+  delete l->chunk;
+  l->chunk=new Chunk;
+}
+
+/* add_row -- add a file to the chunk of a columnar listing */
+static void add_row(file_list *l,const char *path,const struct stat *s) {
+  Chunk &c=*l->chunk;
+  const char *slash=strrchr(path,'/');
+  size_t dirlen=slash ? slash+1-path : 0;
+  string dir(path,dirlen);
+  hash_map<string,uint32_t,StringHash>::const_iterator i=c.dir_ids.find(dir);
+  uint32_t id;
+  unsigned char len[10];
+
+  if(i!=c.dir_ids.end())
+    id=i->second;
+  else {
+    id=c.dir_ids[dir]=(uint32_t)c.dirs.size();
+    c.dirs.push_back(dir);
+  }
+  c.mode.add(s->st_mode);
+  c.uid.add(s->st_uid);
+  c.gid.add(s->st_gid);
+  c.size.add(s->st_size);
+  c.mtime.add(s->st_mtime);
+  c.atime.add(s->st_atime);
+  c.ctime.add(s->st_ctime);
+  c.dir.push_back(id);
+  c.names.append((const char*)len,put_varint(len,strlen(path+dirlen))-len);
+  c.names.append(path+dirlen);
+  if(c.rows()>=FL_CHUNK_ROWS)
+    write_chunk(l);
+}
+
+/* fl_add -- see file_list.h */
+void fl_add(file_list *l,const char *path,const struct stat *s) {
+  if(l->format==FL_COLUMNS) {
+    intern(l,l->users,'U',s->st_uid,l->user_name);
+    intern(l,l->groups,'G',s->st_gid,l->group_name);
+    add_row(l,path,s);
+    return;
+  } else if(l->format!=FL_BINARY) {
+    fl_record r;
+    r.type=file_type(s->st_mode);
+    r.mode=s->st_mode & 07777;
+    r.ctime=s->st_ctime;
+    r.mtime=s->st_mtime;
+    r.atime=s->st_atime;
+    r.size=s->st_size;
+    r.user=l->user_name(s->st_uid);
+    r.group=l->group_name(s->st_gid);
+    r.path=path;
+    fl_print_text(l->f,&r);
+    return;
+  }
+
+  uint32_t user=intern(l,l->users,'U',s->st_uid,l->user_name);
+  uint32_t group=intern(l,l->groups,'G',s->st_gid,l->group_name);
+  size_t len=strlen(path),shared=0,max=min(len,l->prev.size());
+  unsigned char head[FL_FIXED_LEN+2*10],*p=head;
+  while(shared<max && path[shared]==l->prev[shared])
+    shared++;
+
+  *p++='F';
+  *p++=(unsigned char)file_type(s->st_mode);
+  p=put_le(p,s->st_mode & 07777,2);
+  p=put_le(p,(uint64_t)s->st_ctime,8);
+  p=put_le(p,(uint64_t)s->st_mtime,8);
+  p=put_le(p,(uint64_t)s->st_atime,8);
+  p=put_le(p,(uint64_t)s->st_size,8);
+  p=put_le(p,user,4);
+  p=put_le(p,group,4);
+  p=put_varint(p,shared);
+  p=put_varint(p,len-shared);
+  fwrite(head,1,p-head,l->f);
+  fwrite(path+shared,1,len-shared,l->f);
+  l->prev.replace(shared,string::npos,path+shared,len-shared);
+}
+
+/* fl_sync -- see file_list.h */
+int64_t fl_sync(file_list *l) {
+  if(l->chunk)
+    write_chunk(l);
+  if(fflush(l->f) || fsync(fileno(l->f))) {
+    warn("%s: cannot sync to disk: %s\n",l->path.c_str(),strerror(errno));
+    return -1;
+  }
+  return (int64_t)ftello(l->f);
+}
+
+/* fl_close -- see file_list.h */
+int fl_close(file_list *l) {
+  if(l->chunk)
+    write_chunk(l);
+  int ret=0, err=ferror(l->f);
+  if(fclose(l->f) || err) {
+    warn("%s: error closing; file may be incomplete: %s\n",l->path.c_str(),strerror(errno));
+    ret=-1;
+  }
+  free(l->buffer);
+  delete l->chunk;
+  delete l;
+  return ret;
+}
+
+/**********************************************************************/
+
+/* fl_reader -- a binary or columnar listing being read.  users and
+   groups are the names defined so far, by index for binary listings
+   and by id for columnar ones.  path is the last path read.  For a
+   columnar listing, streams and dirs are the current chunk, and row
+   and name_pos the position in it. */
+struct fl_reader {
+  FILE *f;
+  char *buffer;
+  string name;
+  int columns;
+  vector<string> users,groups;
+  hash_map<uint32_t,string> user_ids,group_ids;
+  string path;
+  string streams[FL_NSTREAMS];
+  vector<string> dirs;
+  size_t nrows,row,name_pos;
+};
+
+/* fl_open_reader -- see file_list.h */
+fl_reader *fl_open_reader(const char *path) {
+  char magic[FL_MAGIC_LEN];
+  FILE *f=fopen(path,"rb");
+  if(!f) {
+    warn("%s: cannot open: %s\n",path,strerror(errno));
+    return NULL;
+  }
+  fl_reader *rd=new fl_reader;
+  rd->f=f;
+  rd->name=path;
+  rd->nrows=rd->row=rd->name_pos=0;
+  if((rd->buffer=(char*)malloc(FL_BUFFER_SIZE)))
+    setvbuf(f,rd->buffer,_IOFBF,FL_BUFFER_SIZE);
+  if(fread(magic,1,FL_MAGIC_LEN,f)!=FL_MAGIC_LEN
+     || (memcmp(magic,FL_MAGIC,FL_MAGIC_LEN) && memcmp(magic,FL_COLUMNS_MAGIC,FL_MAGIC_LEN))) {
+    warn("%s: not a binary or columnar file listing, or from an incompatible version\n",path);
+    fl_close_reader(rd);
+    return NULL;
+  }
+  rd->columns=!memcmp(magic,FL_COLUMNS_MAGIC,FL_MAGIC_LEN);
+  return rd;
+}
+
+/* read_exactly/read_varint -- read from the listing, calling fail()
+   if it ends early or the value is impossible */
+static void read_exactly(fl_reader *rd,void *data,size_t len) {
+  if(fread(data,1,len,rd->f)!=len)
+    fail("%s: listing is truncated or corrupt\n",rd->name.c_str());
+}
+static uint64_t read_varint(fl_reader *rd) {
+  uint64_t value=0;
+  int shift=0,c;
+  do {
+    if((c=getc_unlocked(rd->f))==EOF || shift>=64)
+      fail("%s: listing is truncated or corrupt\n",rd->name.c_str());
+    value|=(uint64_t)(c&0x7f)<<shift;
+    shift+=7;
+  } while(c&0x80);
+  return value;
+}
+static void read_string(fl_reader *rd,string &s,size_t keep) {
+  uint64_t len=read_varint(rd);
+  if(len>MAX_PATH_LEN_CHAR)
+    fail("%s: listing is corrupt: string of length %llu\n",
+         rd->name.c_str(),(unsigned long long)len);
+  s.resize(keep+len);
+  if(len)
+    read_exactly(rd,&s[keep],len);
+}
+
+/* string_varint -- read a varint from s at *pos, calling fail() if
+   it runs past the end */
+static uint64_t string_varint(fl_reader *rd,const string &s,size_t *pos) {
+  uint64_t value=0;
+  int shift=0;
+  unsigned char c;
+  do {
+    if(*pos>=s.size() || shift>=64)
+      fail("%s: listing is corrupt\n",rd->name.c_str());
+    c=(unsigned char)s[(*pos)++];
+    value|=(uint64_t)(c&0x7f)<<shift;
+    shift+=7;
+  } while(c&0x80);
+  return value;
+}
+
+/* read_chunk -- read the rest of a columnar chunk, after its tag */
+static void read_chunk(fl_reader *rd) {
+  static const size_t widths[FL_NSTREAMS]={0,4,4,4,8,8,8,8,4,0};
+  unsigned char head[4+4+(FL_NSTATS*2+FL_NSTREAMS)*8];
+  size_t i,pos=0,ndirs;
+  read_exactly(rd,head,sizeof(head));
+  rd->nrows=(size_t)get_le(head,4);
+  ndirs=(size_t)get_le(head+4,4);
+  for(i=0;i<FL_NSTREAMS;i++) {
+    uint64_t len=get_le(head+8+FL_NSTATS*2*8+i*8,8);
+    if((widths[i] && len!=widths[i]*rd->nrows) || rd->nrows>FL_CHUNK_ROWS
+       || len>(uint64_t)FL_CHUNK_ROWS*(MAX_PATH_LEN_CHAR+10))
+      fail("%s: listing is corrupt: bad chunk\n",rd->name.c_str());
+    rd->streams[i].resize(len);
+    if(len)
+      read_exactly(rd,&rd->streams[i][0],len);
+  }
+  rd->dirs.resize(ndirs);
+  for(i=0;i<ndirs;i++) {
+    uint64_t len=string_varint(rd,rd->streams[0],&pos);
+    if(len>rd->streams[0].size()-pos)
+      fail("%s: listing is corrupt: bad chunk\n",rd->name.c_str());
+    rd->dirs[i].assign(rd->streams[0],pos,len);
+    pos+=len;
+  }
+  rd->row=rd->name_pos=0;
+}
+
+/* column_name -- the name for id in a columnar listing */
+static const char *column_name(hash_map<uint32_t,string> &names,uint32_t id) {
+  hash_map<uint32_t,string>::iterator i=names.find(id);
+  if(i==names.end()) {
+    char num[12];
+    snprintf(num,sizeof(num),"%lu",(unsigned long)id);
+    i=names.insert(make_pair(id,string(num))).first;
+  }
+  return i->second.c_str();
+}
+
+/* read_row -- decode the next row of the current columnar chunk */
+static void read_row(fl_reader *rd,fl_record *r) {
+  const unsigned char *st[FL_NSTREAMS];
+  size_t i=rd->row++;
+  for(int j=0;j<FL_NSTREAMS;j++)
+    st[j]=(const unsigned char*)rd->streams[j].data();
+  uint32_t mode=(uint32_t)get_le(st[1]+4*i,4), dir=(uint32_t)get_le(st[8]+4*i,4);
+  uint64_t len=string_varint(rd,rd->streams[9],&rd->name_pos);
+  if(dir>=rd->dirs.size() || len>rd->streams[9].size()-rd->name_pos)
+    fail("%s: listing is corrupt\n",rd->name.c_str());
+  rd->path=rd->dirs[dir];
+  rd->path.append(rd->streams[9],rd->name_pos,len);
+  rd->name_pos+=len;
+  r->type=file_type(mode);
+  r->mode=mode & 07777;
+  r->user=column_name(rd->user_ids,(uint32_t)get_le(st[2]+4*i,4));
+  r->group=column_name(rd->group_ids,(uint32_t)get_le(st[3]+4*i,4));
+  r->size=get_le(st[4]+8*i,8);
+  r->mtime=get_le(st[5]+8*i,8);
+  r->atime=get_le(st[6]+8*i,8);
+  r->ctime=get_le(st[7]+8*i,8);
+  r->path=rd->path.c_str();
+}
+
+/* fl_read -- see file_list.h */
+int fl_read(fl_reader *rd,fl_record *r) {
+  unsigned char buf[FL_FIXED_LEN];
+  int tag;
+  if(rd->row<rd->nrows) {
+    read_row(rd,r);
+    return 1;
+  }
+  while((tag=getc_unlocked(rd->f))!=EOF) {
+    if((tag=='U' || tag=='G') && rd->columns) {
+      read_exactly(rd,buf,8);
+      read_string(rd,(tag=='U' ? rd->user_ids : rd->group_ids)[(uint32_t)get_le(buf+4,4)],0);
+    } else if(tag=='C' && rd->columns) {
+      read_chunk(rd);
+      if(rd->nrows) {
+        read_row(rd,r);
+        return 1;
+      }
+    } else if(tag=='U' || tag=='G') {
+      vector<string> &names=(tag=='U' ? rd->users : rd->groups);
+      read_exactly(rd,buf,8);
+      uint32_t index=(uint32_t)get_le(buf,4);
+      if(index>names.size())
+        fail("%s: listing is corrupt: name %lu defined out of order\n",
+             rd->name.c_str(),(unsigned long)index);
+      if(index==names.size())
+        names.push_back(string());
+      read_string(rd,names[index],0);
+    } else if(tag=='F' && !rd->columns) {
+      read_exactly(rd,buf+1,FL_FIXED_LEN-1);
+      uint32_t user=(uint32_t)get_le(buf+36,4),group=(uint32_t)get_le(buf+40,4);
+      uint64_t shared=read_varint(rd);
+      if(user>=rd->users.size() || group>=rd->groups.size() || shared>rd->path.size())
+        fail("%s: listing is corrupt\n",rd->name.c_str());
+      read_string(rd,rd->path,shared);
+      r->type=(char)buf[1];
+      r->mode=(unsigned)get_le(buf+2,2);
+      r->ctime=get_le(buf+4,8);
+      r->mtime=get_le(buf+12,8);
+      r->atime=get_le(buf+20,8);
+      r->size=get_le(buf+28,8);
+      r->user=rd->users[user].c_str();
+      r->group=rd->groups[group].c_str();
+      r->path=rd->path.c_str();
+      return 1;
+    } else
+      fail("%s: listing is corrupt: unknown record type %d\n",rd->name.c_str(),tag);
+  }
+  if(ferror(rd->f))
+    fail("%s: cannot read: %s\n",rd->name.c_str(),strerror(errno));
+  return 0;
+}
+
+/* fl_close_reader -- see file_list.h */
+void fl_close_reader(fl_reader *rd) {
+  fclose(rd->f);
+  free(rd->buffer);
+  delete rd;
+}
+
+/* fl_print_header, fl_print_text -- see file_list.h */
+void fl_print_header(FILE *f) {
+  fprintf(f,"type mode ctime mtime atime size user group path\n");
+}
+void fl_print_text(FILE *f,const fl_record *r) {
+  typedef unsigned long long ull;
+  fprintf(f,"%c %04o %llu %llu %llu %llu %s %s %s\n",
+          r->type,r->mode,(ull)r->ctime,(ull)r->mtime,(ull)r->atime,(ull)r->size,
+          r->user,r->group,r->path);
+}
@@ -0,0 +1,133 @@
+#ifndef INC_FILE_LIST
+#define INC_FILE_LIST
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* The all-files listing (-F), in one of three formats:
+
+     FL_TEXT -- one line per file: type, mode, ctime, mtime, atime,
+       size, user, group and path, separated by spaces, after a header
+       line naming the columns.
+
+     FL_BINARY -- an 8-byte magic number ("LWLIST01") followed by
+       records, each starting with a one-byte tag.  All numbers are
+       little-endian.  Lengths are unsigned LEB128 varints.
+         'U' index(4) uid(4) length name -- user name number index
+         'G' index(4) gid(4) length name -- group name number index
+         'F' type(1) mode(2) ctime(8) mtime(8) atime(8) size(8)
+             user(4) group(4) shared unshared suffix
+       A file's user and group are indexes of earlier U and G records.
+       Its path is the first "shared" bytes of the previous file's
+       path followed by the "unshared" bytes of suffix.  A name may
+       be defined again, as it is after a resumed walk; the latest
+       definition applies to later records.
+
+     FL_COLUMNS -- for analysis: an 8-byte magic number ("LWCOLS01")
+       followed by U and G records as above (but files refer to them
+       by uid and gid, not index) and chunks of up to 65536 files:
+         'C' rows(4) ndirs(4) statistics lengths streams
+       The statistics are the minimum and maximum (8 bytes each) of
+       mode, uid, gid, size, mtime, atime and ctime in the chunk, so a
+       query can skip chunks without reading them.  The times are
+       signed.  lengths gives the byte length (8 bytes each) of the
+       ten streams that follow, so a query can also skip the columns
+       it does not need:
+         0 directory dictionary: ndirs strings, each length then bytes
+         1-3 mode (st_mode, with the type bits), uid, gid (4 bytes each)
+         4-7 size, mtime, atime, ctime (8 bytes each)
+         8 directory (4 bytes): index in this chunk's dictionary
+         9 names: rows strings, each length then bytes
+       A file's path is its directory (which ends in "/") followed by
+       its name.  Chunks are self-contained apart from the names of
+       users and groups.
+
+     All are written through a large buffer.  The binary formats are
+     much smaller, and cheaper to write and to read.
+     lustre-walker-list converts them to the text format. */
+
+#define FL_TEXT 0
+#define FL_BINARY 1
+#define FL_COLUMNS 2
+
+  /* fl_name_func -- returns the name of a user or group id.  The
+     string must remain valid until the listing is closed. */
+  typedef const char *(*fl_name_func)(uint32_t id);
+
+  /********************************************************************/
+  /* Writing */
+
+  typedef struct file_list file_list;
+
+  /* fl_create -- start a new listing at path, using the given
+     functions to find user and group names.  Returns NULL, after a
+     warning, on failure. */
+  file_list *fl_create(const char *path,int format,
+                       fl_name_func user_name,fl_name_func group_name);
+
+  /* fl_reopen -- continue a listing at path, written by fl_create
+     with the same format, discarding anything after offset (a value
+     returned by fl_sync).  Returns NULL, after a warning, on
+     failure. */
+  file_list *fl_reopen(const char *path,int format,int64_t offset,
+                       fl_name_func user_name,fl_name_func group_name);
+
+  /* fl_add -- add the file at path, with stat structure s.  Not
+     thread-safe: the caller must serialize calls on one listing. */
+  void fl_add(file_list *l,const char *path,const struct stat *s);
+
+  /* fl_sync -- flush the listing to disk.  Returns its length, for
+     fl_reopen, or -1 after a warning on failure. */
+  int64_t fl_sync(file_list *l);
+
+  /* fl_close -- finish the listing.  Returns 0 on success, or -1
+     after a warning if it may be incomplete. */
+  int fl_close(file_list *l);
+
+  /********************************************************************/
+  /* Reading binary and columnar listings */
+
+  /* fl_record -- one file read from a listing.  The strings belong to
+     the reader, and are valid until the next fl_read. */
+  typedef struct fl_record {
+    char type;          /* 'd', '-', 'l' or '?', as in the text format */
+    unsigned mode;      /* permission bits (07777) */
+    uint64_t ctime,mtime,atime,size;
+    const char *user,*group,*path;
+  } fl_record;
+
+  typedef struct fl_reader fl_reader;
+
+  /* fl_open_reader -- open a binary or columnar listing.  Returns
+     NULL, after a warning, if it cannot be opened or is neither. */
+  fl_reader *fl_open_reader(const char *path);
+
+  /* fl_read -- read the next file into r.  Returns 1 on success, or 0
+     at the end of the listing.  Calls fail() if it is corrupt. */
+  int fl_read(fl_reader *rd,fl_record *r);
+
+  void fl_close_reader(fl_reader *rd);
+
+  /* fl_print_header/fl_print_text -- write the text format's header
+     line, or the line for one file */
+  void fl_print_header(FILE *f);
+  void fl_print_text(FILE *f,const fl_record *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_FILE_LIST */
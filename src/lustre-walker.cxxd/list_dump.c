@@ -0,0 +1,68 @@
+#define _GNU_SOURCE
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "basic_utils.h"
+#include "file_list.h"
+
+/* lustre-walker-list -- converts the binary and columnar all-files
+   listings written by "lustre-walker -F --list-format binary" or
+   "--list-format columns" to the text format, on stdout.  Several
+   listings may be given; their files are printed in order, after a
+   single header line. */
+
+/* OUT_BUFFER_SIZE -- size of the stdout buffer */
+#define OUT_BUFFER_SIZE (4*1048576)
+
+static void usage(const char *exename,const char *message) {
+  fprintf(stderr,
+          "Format: %s [-H] [-v] all-files.bin|all-files.col [...]\n"
+          "  Writes the listings in the all-files.lst text format to stdout.\n"
+          "  -H -- do not write the header line.\n"
+          "  -v -- be more verbose.\n",
+          exename);
+  if(message)
+    fprintf(stderr,"%s",message);
+  exit(message ? 1 : 0);
+}
+
+int main(int argc,char **argv) {
+  int opt,header=1,ret=0;
+  fl_record r;
+  fl_reader *rd;
+  char *buffer;
+
+  while((opt=getopt(argc,argv,"Hvh"))!=-1) {
+    switch(opt) {
+    case 'H': header=0; break;
+    case 'v': increment_verbosity(); break;
+    case 'h': usage(argv[0],NULL); break;
+    default:  usage(argv[0],"Invalid argument given.\n");
+    }
+  }
+  if(optind>=argc)
+    usage(argv[0],"\nERROR: Specify at least one listing.\n");
+
+  if((buffer=(char*)malloc(OUT_BUFFER_SIZE)))
+    setvbuf(stdout,buffer,_IOFBF,OUT_BUFFER_SIZE);
+  if(header)
+    fl_print_header(stdout);
+  for(;optind<argc;optind++) {
+    if(!(rd=fl_open_reader(argv[optind]))) {
+      ret=1;
+      continue;
+    }
+    while(fl_read(rd,&r))
+      fl_print_text(stdout,&r);
+    fl_close_reader(rd);
+  }
+  if(fflush(stdout) || ferror(stdout)) {
+    warn("stdout: write error: %s\n",strerror(errno));
+    ret=1;
+  }
+  return ret;
+}
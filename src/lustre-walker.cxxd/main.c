@@ -40,9 +40,17 @@
 #include <stdio.h>
 #include <grp.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/resource.h>
 
 #ifdef ENABLE_DISK_USAGE
 #include "disk_usage.h"
+#include "file_list.h"
+#else
+typedef struct us_frame us_frame; /* never allocated without disk usage */
+typedef struct us_record us_record; /* likewise */
 #endif
 
 #ifdef ENABLE_CHECK_DUP
@@ -51,6 +59,12 @@
 
 #include "paranoia.h"
 #include "basic_utils.h"
+#include "task_queue.h"
+#include "dir_reader.h"
+#include "stat_ring.h"
+#include "checkpoint.h"
+#include "throttle.h"
+#include "metrics.h"
 
 /* RECORD_STEP -- for features that do something every X files, such
    as throttling or speed statistics, this is the X */
@@ -62,9 +76,15 @@
 
 /* GLOBALS */
 static acl_t acls[01000]; /* ACLs used for tag_rstprod commands */
-/* pathbuf -- static path buffer used in walk_impl.  This is stored
-   statically to avoid memory allocation overhead */
-static char pathbuf[MAX_PATH_LEN_CHAR+517];
+/* pathbuf -- per-thread path buffer.  The walker opens and stats
+   files relative to their directory's file descriptor, so full paths
+   are only built when something needs one: a message, a usage report
+   or an ACL call.  See dir_path and entry_path.  This is allocated
+   once per walker thread to avoid memory allocation overhead.
+   pathbuf_serial is the serial number of the walk_dir whose path is
+   in pathbuf, and pathbuf_dirlen is the length of that path. */
+static __thread char *pathbuf=NULL;
+static __thread size_t pathbuf_serial=0, pathbuf_dirlen=0;
 static gid_t required_gid=INVALID_GID; /* gid used for chgrp, when -g is given */
 static gid_t rstprod_gid=INVALID_GID; /* gid of the rstprod group, when -r is given */
 static size_t file_count=0; /* number of files seen */
@@ -77,20 +97,101 @@ static size_t file_count=0; /* number of files seen */
       del_count -- number of unlinks done
 */
 static size_t setgid_count=0, chgrp_count=0, acl_count=0, dir_count=0, del_count=0;
+static size_t stat_skip_count=0; /* number of stats avoided using d_type */
+static size_t index_dir_count=0, index_file_count=0; /* dirs and files reused from the index */
+static size_t untracked_count=0; /* files left out of duplicate detection */
+
+/* COUNT -- increment one of the counters above.  Several walker
+   threads may do so at once, so this must be atomic. */
+#define COUNT(counter) __sync_fetch_and_add(&(counter),1)
 
 static double start_time;    /* start time in seconds since the epoch */
-static size_t sleep_time=0;  /* number of seconds of sleeping done */
+
+static size_t nthreads=1;    /* number of walker threads (-j) */
+#define MAX_THREADS 1024
+static task_queue *walk_queue=NULL; /* directories waiting to be walked */
+
+/* walk_args -- the nwalk_args directories given on the command line.
+   walk_arg is the index of the one being walked. */
+static char **walk_args=NULL;
+static size_t nwalk_args=0, walk_arg=0;
+
+/* Checkpointing (--checkpoint, --checkpoint-interval, --resume):
+     checkpoint_file -- where to write checkpoints, or NULL for none
+     checkpoint_interval -- seconds between checkpoints
+     next_checkpoint -- time of the next checkpoint
+     checkpoint_request -- set by a signal handler to ask for a
+       checkpoint now (SIGUSR1), or a checkpoint followed by exiting
+       (SIGTERM)
+     ckpt_gen, ckpt_count -- used while writing the directories in a
+       checkpoint; see save_dir */
+#define CKPT_REQUEST_NOW 1
+#define CKPT_REQUEST_EXIT 2
+static const char *checkpoint_file=NULL;
+static double checkpoint_interval=3600;
+static double next_checkpoint=0;
+static volatile sig_atomic_t checkpoint_request=0;
+static size_t ckpt_gen=0, ckpt_count=0;
+
+/* dir_buffer_size -- size of each thread's directory reading buffer
+   (-B).  reader is this thread's dir_reader, allocated the first time
+   the thread walks a directory. */
+static size_t dir_buffer_size=DR_DEFAULT_BUFFER;
+static __thread dir_reader *reader=NULL;
+#define MAX_DIR_BUFFER (1024*1024*1024)
+
+/* ring_depth -- if non-zero, each thread stats up to this many
+   entries at once with io_uring (-A).  ring is this thread's
+   stat_ring, or NULL if ring_tried is set and io_uring is
+   unavailable.  stat_list is a per-thread list of the entries in a
+   batch that the ring must stat. */
+static unsigned ring_depth=0;
+static __thread stat_ring *ring=NULL;
+#define MAX_RING_DEPTH 32768 /* the most entries io_uring allows */
+static __thread int ring_tried=0;
+static __thread const dir_entry **stat_list=NULL;
+static __thread size_t stat_list_size=0;
 
 #ifdef ENABLE_DELETION
 static int64_t delete_age=0; /* how old must a file be to be deleted */
 static int delete_files=0;  /* should we delete files? */
 static int delete_min_depth; /* minimum depth of files to delete */
+
+/* Purge simulation (--simulate-purge, --simulate-depths): instead of
+   deleting anything, evaluate nsim candidate policies in one walk.
+   Candidate c deletes what -d sim_age[c]/86400 -D sim_min_depth[c]
+   would, and is bit c of the candidate masks passed to finish_entry.
+   sim_days and sim_depths are the option values, whose combinations
+   are the candidates. */
+#define MAX_SIM_CANDIDATES 64
+static size_t nsim=0;
+static int64_t sim_age[MAX_SIM_CANDIDATES];
+static int sim_min_depth[MAX_SIM_CANDIDATES];
+static const char *sim_days=NULL, *sim_depths=NULL;
+#define SIM_ALL (~(uint64_t)0) /* every candidate may delete the object */
+#else
+#define SIM_ALL 0
 #endif
 
 #ifdef ENABLE_CHECK_DUP
 static int check_dup=1; /* should we avoid processing a file twice?  (uses device/inode number) */
+static double rename_window=-1; /* see hit_file_policy (--rename-window); -1 tracks every file */
 #endif
 
+/* STAT_* -- parts of the stat structure needed by the enabled
+   features.  stat_fields is the union of them, computed by plan_stat
+   once the options are known.  When only STAT_TYPE is needed, the
+   d_type from the directory read is enough, and we skip the stat. */
+#define STAT_TYPE   0001 /* file type (always needed, to find subdirectories) */
+#define STAT_MODE   0002 /* permission bits */
+#define STAT_IDS    0004 /* owner and group */
+#define STAT_TIMES  0010 /* access, modify and change times */
+#define STAT_SIZE   0020 /* size and block count */
+#define STAT_DEVINO 0040 /* device and inode numbers */
+#define STAT_CTIME  0100 /* change time only, which the metadata server knows */
+#define STAT_ALL    0177
+static unsigned stat_fields=STAT_ALL;
+
 #ifdef ENABLE_SPEED_STATS
 static int print_stats=0; /* do we calculate and print speed statistics */
 #endif
@@ -98,152 +199,184 @@ static int print_stats=0; /* do we calculate and print speed statistics */
 #ifdef ENABLE_DISK_USAGE
 static int disk_usage=0; /* do we calculate disk usage statistics */
 static int disk_usage_all=0; /* turns on -u for all search paths */
+
+/* index_file -- the incremental index (--index), or NULL.  Unless
+   index_exact is set (--index-exact), unchanged directories are not
+   scanned; their files' usage is taken from the index instead. */
+static const char *index_file=NULL;
+static int index_exact=0;
+
+/* passwd_file, group_file -- where to read user and group names
+   from before the walk (--passwd-file, --group-file), or NULL */
+static const char *passwd_file=NULL, *group_file=NULL;
+
+/* layouts -- account for the Lustre striping of files (--layouts).
+   The layout comes from the reply to a Lustre stat, which is only
+   valid until the thread's next Lustre stat, so each thread keeps the
+   layout it last read (entry_layout).  With -l, it comes with the
+   entry's stat (entry_layout_stat).  With layout_requests
+   (--layout-requests), find_layout asks for it separately. */
+static int layouts=0, layout_requests=0;
+static __thread lustre_layout entry_layout;
+static __thread const struct stat *entry_layout_stat=NULL;
 #endif
 
-/* if >MIN_THROTTLE, we throttle processing speed.  See throttle() for
-   more info.  Must be <=100000 due to system time precision
-   limits and limits of 64-bit doubles. */
+/* if >=MIN_THROTTLE, we throttle processing speed.  See throttle.h
+   for how.  Must be <=MAX_THROTTLE due to system time precision
+   limits. */
 static size_t throttle_rate=0; 
+static double target_latency=0.02; /* --target-latency, in seconds */
 
 #define MIN_THROTTLE 10 /* throttle_rate<MIN_THROTTLE = do not throttle */
+#define MAX_THROTTLE 100000
+
+/* throttling -- true if -t was given */
+static int throttling=0;
+
+/* timing -- true if metadata operations are timed: for the throttle
+   (-t), the metrics snapshots (--metrics) or the -s summary.
+   metrics_file, metrics_interval -- --metrics and --metrics-interval */
+static int timing=0;
+static const char *metrics_file=NULL;
+static double metrics_interval=10;
+
+/* op_start, op_done -- time one metadata operation, if timing:
+     double start=op_start();
+     ... the operation ...
+     op_done(MT_UNLINK,start);
+   op_took records an operation timed elsewhere, taking t seconds.
+   The latencies of stats and directory reads also go to the
+   throttle. */
+static inline double op_start(void) {
+  return timing ? mt_now() : 0;
+}
+static inline void op_took(mt_op op,double t) {
+  if(!timing)
+    return;
+  mt_record(op,t);
+  if(throttling && (op==MT_READDIR || op==MT_STAT || op==MT_STATX || op==MT_LUSTRE_STAT))
+    th_latency(t);
+}
+static inline void op_done(mt_op op,double start) {
+  if(timing)
+    op_took(op,mt_now()-start);
+}
 
-/* throttle -- throttle file processing rate if
-   throttle_rate>MIN_THROTTLE.  This makes sure we do not process more
-   than throttle_rate files per second.  It overthrottles typically,
-   due to how it is written.
+/* throttle -- called before each file is processed.  Waits until the
+   adaptive throttle lets the file start. */
+static void throttle(void) {
+  if(throttling)
+    th_wait();
+}
 
-   The way it works is that it makes sure a file is not processed
-   within 1.0/throttle_rate seconds after the previous file.  Some
-   files will take longer than that to process, hence fewer files will
-   be processed per second than throttle_rate, especially if
-   filesystem modifications are done.
-*/
-void throttle() {
-  static double lasttime=0,minspan=0;
-  static int inited=0;
-  if(throttle_rate<MIN_THROTTLE)
-    /* Assume less than 10 files per second means "don't throttle" */
-    return;
-  if(!inited) {
-    /* We get here only once, the first time we hit a file.
-       Initialize the throttling variables. */
-    inited=1;
-    lasttime=fulltime();
-    if(throttle_rate>100000) {
-      warn("Changing to maximum allowed throttle of 100000 files per second.\n");
-      throttle_rate=100000;
-    }
-    /* Calculate the throttling timespan: the minimum amount of time
-       between files */
-    minspan=1/((double)throttle_rate);
-  } else {
-    double now,span;
-    int tries;
-    for(tries=0;tries<10;tries++) {
-      now=fulltime();
-      span=now-lasttime; /* span = how long it took to process the last file */
-      if(span<0)
-        /* Error: the last file processed was processed in the future.
-           Do not throttle. */
-        break;
-      if(span>minspan)
-        /* The file took longer to process than the throttling
-           timespan, so we have no throttling to do. */
-        break;
-      else {
-        /* The file took less time to process than the throttling
-           timespan so we need to throttle. */
-        unsigned int sleeptime=(minspan-span)*1e6;
-        sleeptime = (sleeptime>1000000) ? 1000000 : sleeptime;
-        sleeptime = (sleeptime<1) ? 1 : sleeptime;
-        usleep(sleeptime);
-      }
-    }
-    /* Record the current time so we can check the time it takes to
-       process the next file. */
-    lasttime=fulltime();
+/* busy_time: seconds the walk has spent working as of now: the time
+   since it started, less the time all walker threads spent asleep in
+   the throttle.  Sleeping is counted in thread-seconds, so it is
+   shared out over the threads. */
+static double busy_time(double now) {
+  double busy=now-start_time;
+  if(throttling)
+    busy-=th_sleep_time()/nthreads;
+  return busy>0 ? busy : now-start_time;
+}
+
+/* walk_metrics: mt_start callback that adds the walk's progress to
+   each metrics snapshot */
+static void walk_metrics(FILE *f) {
+  mt_gauge(f,"lustre_walker_elapsed_seconds","gauge","Time since the walk started.",
+           fulltime()-start_time);
+  mt_gauge(f,"lustre_walker_files_total","counter","Files processed.",file_count);
+  mt_gauge(f,"lustre_walker_dirs_total","counter","Directories entered.",dir_count);
+  mt_gauge(f,"lustre_walker_deleted_total","counter","Files and directories deleted.",del_count);
+  mt_gauge(f,"lustre_walker_changed_total","counter","Setgid bits, groups and ACLs changed.",
+           setgid_count+chgrp_count+acl_count);
+  if(throttling) {
+    mt_gauge(f,"lustre_walker_throttle_rate","gauge","Current throttle rate, in files per second.",
+             th_rate());
+    mt_gauge(f,"lustre_walker_throttle_p95_seconds","gauge","Moving p95 latency seen by the throttle.",
+             th_p95());
+    mt_gauge(f,"lustre_walker_throttle_sleep_seconds_total","counter",
+             "Thread-seconds slept by the throttle.",th_sleep_time());
   }
 }
 
 /* dir_enter: called every time a directory is entered.  Intended to
-   be used for disk space accounting. */
-static void dir_enter(const char *dirname,const struct stat *dirstat) {
+   be used for disk space accounting.  Returns the usage frame for the
+   directory's contents; parent is the frame of the directory
+   containing this one. */
+static us_frame *dir_enter(us_frame *parent,const char *dirname,const struct stat *dirstat) {
 #ifdef ENABLE_DISK_USAGE
-  us_dir_enter(dirname,dirstat);
+  if(disk_usage)
+    return us_dir_enter(parent,dirname,dirstat);
+  return NULL;
+#else
+  return NULL;
 #endif /* ENABLE_DISK_USAGE */
 }
 /* file_found: called for each filesystem object seen.  Intended to be
    used for disk space accounting.  This is where we trigger any
-   features that must be done per file for non-deleted files. */
-static void file_found(const char *filename,const struct stat *filestat) {
+   features that must be done per file for non-deleted files.  May be
+   called from several threads at once.  The filename is only needed
+   (and may be NULL otherwise) when disk usage is enabled.  The layout
+   is that of a regular file with --layouts (see find_layout), or
+   NULL. */
+static void file_found(us_frame *frame,const char *filename,const struct stat *filestat,
+                       const lustre_layout *layout) {
   static double last_time=0;
   static size_t last_count=0;
   static int inited=0;
-
-  file_count++;
+  static pthread_mutex_t stats_lock=PTHREAD_MUTEX_INITIALIZER;
+  size_t count=__sync_add_and_fetch(&file_count,1);
 
   /* If we're enabling disk usage statistics, call the disk usage
      information storage function */
 #ifdef ENABLE_DISK_USAGE
-  us_file_found(filename,filestat);
+  if(disk_usage) {
+    us_file_found(frame,filename,filestat);
+    if(layout)
+      us_layout_found(frame,filestat,layout);
+  }
 #endif /* ENABLE_DISK_USAGE */
 
-  if(file_count && file_count%RECORD_STEP == 0) {
+  /* Only one thread gets each multiple of RECORD_STEP, but the lock
+     keeps it from racing the thread that got the last one. */
+  if(count && count%RECORD_STEP == 0) {
     double now=fulltime();
+    pthread_mutex_lock(&stats_lock);
     /* Handle speed statistics, if we're doing that */
 #ifdef ENABLE_SPEED_STATS
     if(print_stats) {
       if(inited)
         printf("Scanned %llu files (%llu changes) in %.3f sec (%.2f/sec avg, %.2f/sec recently)...\n",
-               (unsigned long long)file_count,
+               (unsigned long long)count,
                (unsigned long long)(setgid_count+chgrp_count+acl_count+del_count),
-               now-start_time,file_count/(now-start_time-sleep_time),
-               (file_count-last_count)/(now-last_time));
+               now-start_time,count/busy_time(now),
+               (count-last_count)/(now-last_time));
       else
         printf("Scanned %llu files (%llu changes) in %.3f sec (%.2f/sec avg)...\n",
-               (unsigned long long)file_count,
+               (unsigned long long)count,
                (unsigned long long)(setgid_count+chgrp_count+acl_count+del_count),
-               now-start_time,file_count/(now-start_time-sleep_time));
+               now-start_time,count/busy_time(now));
+      if(throttling)
+        printf("Throttle at %.0f files/sec (p95 latency %.3f ms, %.1f thread-seconds asleep)\n",
+               th_rate(),th_p95()*1e3,th_sleep_time());
     }
 #endif /* ENABLE_SPEED_STATS */
 
-    /* Next, if we're throttling, include code to sleep if the speed
-       is very, very slow.  This is done under the assumption that the
-       metadata server is running into serious issues when the file
-       speed is getting unreasonably slow. */
-    if(inited) {
-      double recent_rate=(file_count-last_count)/(now-last_time);
-      if(recent_rate<100.0 && throttle_rate>300) {
-        printf("WARNING: rate dropped below 100/second.  Sleeping 120 seconds.\n");
-        sleep(120);
-        sleep_time+=120;
-      } else if(recent_rate<250.0 && throttle_rate>700) {
-        printf("WARNING: rate dropped below 250/second.  Sleeping 60 seconds.\n");
-        sleep(60);
-        sleep_time+=60;
-      } else if(recent_rate<500.0 && throttle_rate>1000) {
-        printf("WARNING: rate dropped below 500/second.  Sleeping 30 seconds.\n");
-        sleep(30);
-        sleep_time+=30;
-      } else if(recent_rate<1000.0 && throttle_rate>2000) {
-        printf("WARNING: rate dropped below 1000/second.  Sleeping 15 seconds.\n");
-        sleep(15);
-        sleep_time+=15;
-      }
-    }
-
     /* Now record the current time so we will know how long it has
        been since the last call */
     last_time=now;
-    last_count=file_count;
+    last_count=count;
     inited=1;
+    pthread_mutex_unlock(&stats_lock);
   }
 }
 /* dir_leave: called every time a directory is left.  Intended to be
    used for disk space accounting. */
-static void dir_leave(const char *dirname,const struct stat *dirstat) {
+static void dir_leave(us_frame *frame,const char *dirname,const struct stat *dirstat) {
 #ifdef ENABLE_DISK_USAGE
-  us_dir_leave(dirname,dirstat);
+  if(disk_usage)
+    us_dir_leave(frame,dirname,dirstat);
 #endif /* ENABLE_DISK_USAGE */
 }
 
@@ -285,18 +418,26 @@ void init_acls(const char *rstprod) {
 int tag_rstprod(const char *filename,mode_t mode) {
   size_t index=mode&0770;
   int ret1=0,ret2;
+  double start;
   assert(index<01000); // bounds check
   path_length(filename,1);
 
 
-  if(S_ISDIR(mode))
+  if(S_ISDIR(mode)) {
     /* We need two callls to acl_set_file for directories: one for the
        ACL, and one for the default ACL.  We set the Default ACL here: */
-    if((ret1=acl_set_file(filename,ACL_TYPE_DEFAULT,acls[index])))
+    start=op_start();
+    ret1=acl_set_file(filename,ACL_TYPE_DEFAULT,acls[index]);
+    op_done(MT_ACL,start);
+    if(ret1)
       warn("%s: cannot set default ACL: %s\n",filename,strerror(errno));
+  }
 
   /* Set the regular, non-default ACL here: */
-  if((ret2=acl_set_file(filename,ACL_TYPE_ACCESS,acls[index])))
+  start=op_start();
+  ret2=acl_set_file(filename,ACL_TYPE_ACCESS,acls[index]);
+  op_done(MT_ACL,start);
+  if(ret2)
     warn("%s: cannot set ACL: %s\n",filename,strerror(errno));
 
   return ret1 || ret2;
@@ -312,261 +453,756 @@ gid_t gid_for(const char *groupname) {
   return g->gr_gid;
 }
 
-/* walk_impl: this routine does the actual walking of the directory tree
-   pathlen -- length of the pathbuf (file/dir path) upon entry to this function
-   d -- directory object from opendir(pathbuf)
-   depth -- recursion depth, starting at 1 for the top-level directory
-   dirstat -- struct stat for this directory
-   emptied -- *emptied is set to 1 if everything in the directory is deleted,
-       set to 0 otherwise */
-void walk_impl(size_t pathlen,DIR *d,size_t depth,
-               const struct stat *dirstat,int *emptied) {
-  struct dirent *dent;
-  DIR *subdir_opened;
-  size_t basenamelen,newpathlen,oldpathlen;
-  struct stat statbuf;
-  int rstokay,statted,deleted;
-  int use_lustre_stat=get_use_lustre_stat(),duplicate=0;
-
+/* plan_stat: decides which parts of the stat structure the enabled
+   features need, and sets stat_fields accordingly. */
+static void plan_stat(void) {
+  unsigned fields=STAT_TYPE;
+  if(required_gid!=INVALID_GID)
+    fields|=STAT_MODE|STAT_IDS;  /* setgid bit and chgrp */
+  if(rstprod_gid!=INVALID_GID)
+    fields|=STAT_MODE|STAT_IDS;  /* group check and ACL permissions */
 #ifdef ENABLE_DELETION
-  int can_delete;
-  size_t files_seen=0, deletions=0;
-  int subdir_emptied;
+  if(delete_files || nsim)
+    fields|=STAT_TIMES;          /* file age */
+#endif
+#ifdef ENABLE_DISK_USAGE
+  if(disk_usage)
+    fields|=STAT_ALL;            /* usage reports use nearly everything */
 #endif
+#ifdef ENABLE_CHECK_DUP
+  if(check_dup)
+    fields|=STAT_DEVINO;         /* duplicate detection */
+  if(check_dup && rename_window>=0)
+    fields|=STAT_CTIME;          /* recently changed files are tracked */
+#endif
+  stat_fields=fields;
+  debug("Stat fields needed: 0%o%s\n",fields,
+        (fields==STAT_TYPE) ? " (will use d_type instead of stat when possible)" : "");
+}
 
-  /* Check assumptions: */
-  assert(depth<=MAX_PATH_DEPTH);
-  assert(d);
-  assert(pathlen>0);
-  assert(pathlen<MAX_PATH_LEN_CHAR);
-
-  /* Store the length of the path string for this directory: */
-  oldpathlen=pathlen;
-
-  /* Indicate that we're entering this directory */
-  dir_enter(pathbuf,dirstat);
-
-  debugn(VERB_DEBUG_HIGH,"%s: entering directory\n",pathbuf);
-  dir_count++;
-
-  /* Loop over all files in this directory */
-  while( (dent=readdir(d)) ) {
-    /* Make sure the file basename is within the allowed limits */
-    basenamelen=basename_length(dent->d_name,0);
-    if(basenamelen==BAD_LEN) {
-      warn("%s%*s...: skipping: file basename is too long",pathbuf,basename,MAX_BASENAME_LEN);
-      us_filename_too_long(pathbuf,dent->d_name,dirstat);
-      continue;
+/* plan_statx: when statx is in use (-X), tells it to request only
+   the fields in stat_fields.  Mode, owner and group are always up to
+   date on the metadata server, so unless sizes or times are needed,
+   the filesystem may answer from its cache (AT_STATX_DONT_SYNC) rather
+   than asking the object servers. */
+static void plan_statx(void) {
+#ifdef STATX_BASIC_STATS
+  unsigned mask=0;
+  if(stat_fields&STAT_TYPE)   mask|=STATX_TYPE;
+  if(stat_fields&STAT_MODE)   mask|=STATX_MODE;
+  if(stat_fields&STAT_IDS)    mask|=STATX_UID|STATX_GID;
+  if(stat_fields&STAT_TIMES)  mask|=STATX_ATIME|STATX_MTIME|STATX_CTIME;
+  if(stat_fields&STAT_SIZE)   mask|=STATX_SIZE|STATX_BLOCKS;
+  if(stat_fields&STAT_DEVINO) mask|=STATX_INO|STATX_NLINK;
+  if(stat_fields&STAT_CTIME)  mask|=STATX_CTIME;
+  set_statx_mask(mask,!(stat_fields&(STAT_TIMES|STAT_SIZE)));
+  debug("Statx mask: 0x%x%s\n",mask,
+        (stat_fields&(STAT_TIMES|STAT_SIZE)) ? "" : " (cached attributes are okay)");
+#else
+  fail("-X: this program was built without statx support.\n");
+#endif
+}
+
+/* type_stat: fills in a stat structure using only what the directory
+   read told us about a file, for use when plan_stat decided no stat
+   is needed.  Everything but the type, inode and device is zero. */
+static void type_stat(struct stat *sb,const dir_entry *ent,const struct stat *dirstat) {
+  memset(sb,0,sizeof(struct stat));
+  sb->st_mode=DTTOIF(ent->type);
+  sb->st_ino=ent->ino;
+  sb->st_dev=dirstat->st_dev;
+  sb->st_nlink=1;
+}
+
+/* walk_dir -- a directory being walked.  Each directory is a task in
+   walk_queue, so several directories can be walked at once by
+   different threads.  A walk_dir lives until it and everything below
+   it have been processed, because an entry in a directory is only
+   finished (deleted, chgrped, counted) after the entry's own
+   contents are finished.  That also keeps the parent's directory
+   open, so subdirectories are opened relative to it with openat,
+   and the kernel never has to look up a full path.
+
+   pending counts the references keeping the walk_dir alive: one for
+   the scan of its own entries, plus one for each subdirectory that
+   has not yet been finished.  Whichever thread drops it to zero
+   finishes the directory (see dir_release).  */
+typedef struct walk_dir {
+  struct walk_dir *parent; /* containing directory, or NULL for a top-level dir */
+  char *name;              /* basename in parent, or full path of a top-level dir */
+  size_t namelen;          /* length of name */
+  size_t pathlen;          /* length of the full path, with a trailing / */
+  size_t serial;           /* unique number for this walk_dir; see dir_path */
+  size_t depth;            /* recursion depth, starting at 1 for the top-level directory */
+  struct stat dirstat;     /* stat structure for this directory */
+  int fd;                  /* open directory, or -1 if it could not be opened */
+  us_frame *usage;         /* usage frame for this directory's contents */
+  size_t pending;          /* references to this walk_dir (atomic) */
+  size_t files_seen;       /* number of entries, not counting . and .. */
+  size_t deletions;        /* number of entries deleted (atomic) */
+  size_t *sim_deletions;   /* with a purge simulation, the number of entries each
+                              candidate would delete (atomic), or NULL */
+  size_t ckpt_gen;         /* ckpt_gen of the last checkpoint that included this */
+  size_t ckpt_index;       /* index of this directory in that checkpoint */
+  us_record *record;       /* this scan's incremental index record, or NULL */
+} walk_dir;
+
+/* thread_pathbuf: returns this thread's path buffer, allocating it
+   the first time. */
+static char *thread_pathbuf(void) {
+  if(!pathbuf && !(pathbuf=(char*)malloc(MAX_PATH_LEN_CHAR+517)))
+    fail("Cannot allocate %llu bytes: %s\n",
+         (unsigned long long)(MAX_PATH_LEN_CHAR+517),strerror(errno));
+  return pathbuf;
+}
+
+/* dir_path: returns the full path of dir, with a trailing /, in this
+   thread's path buffer.  The path is assembled from the names of dir
+   and its ancestors, and is reused until the thread asks for another
+   directory's path. */
+static char *dir_path(const walk_dir *dir) {
+  char *buf=thread_pathbuf();
+  const walk_dir *up;
+  size_t end;
+  if(pathbuf_serial!=dir->serial) {
+    /* Fill in the path from the end, one directory at a time */
+    end=dir->pathlen;
+    for(up=dir;up;up=up->parent) {
+      buf[--end]='/';
+      end-=up->namelen;
+      memcpy(buf+end,up->name,up->namelen);
     }
+    assert(end==0);
+    pathbuf_serial=dir->serial;
+    pathbuf_dirlen=dir->pathlen;
+  }
+  buf[pathbuf_dirlen]='\0';
+  return buf;
+}
 
-    /* Skip . and .. */
-    if(!strcmp(dent->d_name,".") || !strcmp(dent->d_name,".."))
-      continue; /* Skip . and .. */
+/* entry_path: returns the full path of entry name (of length
+   namelen) in directory dir, in this thread's path buffer.  The
+   caller must ensure the path is not too long. */
+static char *entry_path(const walk_dir *dir,const char *name,size_t namelen) {
+  char *buf=dir_path(dir);
+  memcpy(buf+pathbuf_dirlen,name,namelen);
+  buf[pathbuf_dirlen+namelen]='\0';
+  return buf;
+}
 
-    /* Initialize deletion variables if we're allowing file deletion
-       at compilation time: */
+/* ENTRY_PATH -- path of the entry being processed in finish_entry */
+#define ENTRY_PATH entry_path(dir,name,namelen)
+
+/* new_walk_dir: allocates a walk_dir for a directory with the given
+   name (of length len) within parent.  For a top-level directory,
+   parent is NULL and name is the path.  The directory is not
+   opened. */
+static walk_dir *new_walk_dir(walk_dir *parent,const char *name,size_t len,
+                              size_t depth,const struct stat *dirstat) {
+  static size_t serials=0;
+  walk_dir *dir;
+  if(!(dir=(walk_dir*)calloc(1,sizeof(walk_dir))) || !(dir->name=(char*)malloc(len+1)))
+    fail("%s: cannot allocate memory for directory: %s\n",name,strerror(errno));
+  memcpy(dir->name,name,len);
+  dir->name[len]='\0';
+  dir->namelen=len;
+  dir->pathlen=(parent ? parent->pathlen : 0)+len+1;
+  dir->serial=__sync_add_and_fetch(&serials,1);
+  dir->parent=parent;
+  dir->depth=depth;
+  dir->pending=1;
+  dir->fd=-1;
+  memcpy(&dir->dirstat,dirstat,sizeof(struct stat));
 #ifdef ENABLE_DELETION
-    can_delete=1;
-    files_seen++;
+  if(nsim && !(dir->sim_deletions=(size_t*)calloc(nsim,sizeof(size_t))))
+    fail("%s: cannot allocate memory for directory: %s\n",name,strerror(errno));
 #endif
+  return dir;
+}
 
-    /* Make sure the path, after appending the file basename, is
-       within allowed limits: */
-    if(basenamelen+pathlen>MAX_PATH_LEN_CHAR) {
-      warn("%s%*s...: skipping: path length is too long",pathbuf,basename,basenamelen);
-      us_path_too_long(pathbuf,dent->d_name,dirstat);
-      continue;
+#ifdef ENABLE_DELETION
+/* simulate_purge: the purge simulation's version of the deletion in
+   finish_entry.  Works out which candidates would delete the object,
+   by the same depth and age rules, and counts it for them.
+     candidates -- mask of candidates that may delete the object.  For
+       a directory, those that would delete its entire contents. */
+static void simulate_purge(walk_dir *dir,const struct stat *statbuf,uint64_t candidates) {
+  int64_t age=((int64_t)time(NULL))-((int64_t)statbuf->st_mtime);
+  uint64_t deleted=0;
+  size_t c;
+  for(c=0;c<nsim;c++)
+    if( (candidates&(((uint64_t)1)<<c)) && (int64_t)dir->depth>=(int64_t)sim_min_depth[c]
+        && age>=sim_age[c]) {
+      deleted|=((uint64_t)1)<<c;
+      __sync_fetch_and_add(&dir->sim_deletions[c],1);
     }
+#ifdef ENABLE_DISK_USAGE
+  if(deleted && disk_usage)
+    us_purge_found(dir->usage,statbuf,deleted);
+#endif
+}
+#endif
 
-    /* Stat the file: */
-    statted=0;
-    if(use_lustre_stat) {
-      if((lustre_lstatfd(d,dent->d_name,basenamelen,&statbuf)))
-        warn("%s%s: cannot stat using lustre stat: %s\n",pathbuf,dent->d_name,strerror(errno));
-      else
-        statted=1;
-    } else if((fstatat(dirfd(d),dent->d_name,&statbuf,AT_SYMLINK_NOFOLLOW)))
-        warn("%s%s: cannot stat: %s\n",pathbuf,dent->d_name,strerror(errno));
+/* find_layout: returns the layout of name in dir, whose stat is
+   statbuf, if it is a regular file and --layouts is on, or NULL.
+   With -l, the layout came with the stat.  With --layout-requests,
+   the stat is exact, and the layout costs one more request to the
+   metadata server: a Lustre stat whose attributes are ignored, since
+   its sizes are usually zero.  The result is only valid until this
+   thread's next Lustre stat. */
+static const lustre_layout *find_layout(walk_dir *dir,const char *name,size_t namelen,
+                                        const struct stat *statbuf) {
+#ifdef ENABLE_DISK_USAGE
+  const struct stat *reply;
+  double start;
+  if(!layouts || !S_ISREG(statbuf->st_mode))
+    return NULL;
+  if(statbuf==entry_layout_stat)
+    return &entry_layout;
+  if(!layout_requests || get_use_lustre_stat())
+    return NULL; /* another stat would overwrite statbuf */
+  start=op_start();
+  reply=lustre_stat(dir->fd,name,namelen,&entry_layout);
+  op_done(MT_LUSTRE_STAT,start);
+  if(reply)
+    return &entry_layout;
+  warn("%s: cannot read layout using lustre stat: %s\n",ENTRY_PATH,strerror(errno));
+#endif /* ENABLE_DISK_USAGE */
+  return NULL;
+}
+
+/* finish_entry: the last step in processing a filesystem object:
+   deletion, permission corrections, and the per-file routines.  For
+   a directory, this is called only after its contents are finished,
+   possibly from a different thread than the one that found it.
+     dir -- the directory that contains the object
+     name -- basename of the object within dir
+     namelen -- length of name
+     statbuf -- stat structure for the object
+     can_delete -- 0 if the object must not be deleted.  For a
+       directory, this is 1 only if its entire contents were deleted.
+     sim_can_delete -- the same for each purge simulation candidate,
+       as a mask
+     duplicate -- 1 if the object was already processed */
+static void finish_entry(walk_dir *dir,const char *name,size_t namelen,
+                         const struct stat *statbuf,int can_delete,
+                         uint64_t sim_can_delete,int duplicate) {
+  int rstokay,deleted=0,ret;
+  double start;
+  size_t depth=dir->depth;
+  int fd=dir->fd;
+
+#ifdef ENABLE_DELETION
+  /* Can we delete this file? */
+  if(delete_files && can_delete && (int64_t)depth>=(int64_t)delete_min_depth) {
+    /* Yes, so far.  The only check left is the age. */
+    time_t now=time(NULL);
+    int64_t m_age=((int64_t)now)-((int64_t)statbuf->st_mtime);
+    //int64_t c_age=((int64_t)now)-((int64_t)statbuf->st_ctime);
+    int64_t age;
+
+    /* Age check: 
+       links: age is the lesser of access age and modify age
+       others: age is the modification age
+    */
+
+    if(S_ISDIR(statbuf->st_mode))
+      age=m_age; //(m_age<c_age) ? m_age : c_age;
     else
-      statted=1;
+      age=m_age;
+    if(age>=delete_age) {
+      /* The file can be deleted.  The unlink is relative to the
+         directory we opened, so a renamed or replaced ancestor
+         cannot redirect it. */
+      debug("%s: age %llds >= %llds; delete file\n",ENTRY_PATH,(long long)age,(long long)delete_age);
+      COUNT(del_count);
+      start=op_start();
+      ret=unlinkat(fd,name,(S_ISDIR(statbuf->st_mode)) ? AT_REMOVEDIR : 0);
+      op_done(MT_UNLINK,start);
+      if(ret)
+        warn("%s: unlinkat failed: %s\n",ENTRY_PATH,strerror(errno));
+      else {
+        /* Unlink succeeded.  This file has been deleted. */
+        __sync_fetch_and_add(&dir->deletions,1);
+        deleted=1;
+      }
+    } else {
+      debugn(VERB_DEBUG_HIGH,"%s: age %llds < %llds; not deleting file\n",ENTRY_PATH,
+             (long long)age,(long long)delete_age);
+    }
+  } else if(delete_files) {
+    /* We are not allowed to delete this file.  If debug level is
+       very high (-v -v) then print out a reason why */
+    if((int64_t)depth<(int64_t)delete_min_depth)
+      debugn(VERB_DEBUG_HIGH,"%s: cannot delete: not past min depth (%llu<%d)\n",
+             ENTRY_PATH,(unsigned long long)depth,delete_min_depth);
+    else if(S_ISDIR(statbuf->st_mode) && duplicate)
+      debugn(VERB_DEBUG_HIGH,"%s: cannot delete: did not recurse into duplicate directory\n",ENTRY_PATH);
+    else if(S_ISDIR(statbuf->st_mode))
+      debugn(VERB_DEBUG_HIGH,"%s: cannot delete: subdirectory is not empty\n",ENTRY_PATH);
+    else
+      debugn(VERB_DEBUG_HIGH,"%s: cannot delete or deletion is disabled\n",ENTRY_PATH);
+  }
+  if(sim_can_delete)
+    simulate_purge(dir,statbuf,sim_can_delete);
+#endif
 
-    if(!statted)
-        continue; /* stat failed on this file */
+  if(!duplicate && !deleted) {
+    /* We did not delete this directory, and it is not a duplicate,
+       so let's change its group ids, setgid bit and rstprod tagging
+       if relevant */
+
+    /* Should we turn on the setgid bit? */
+    if(S_ISDIR(statbuf->st_mode) && required_gid!=(gid_t)-1 && !(statbuf->st_mode&S_ISGID)) {
+      debug("%s: set gid\n",ENTRY_PATH);
+      COUNT(setgid_count);
+      start=op_start();
+      ret=fchmodat(fd,name,(statbuf->st_mode&0777)|S_ISGID,0);
+      op_done(MT_CHMOD,start);
+      if(ret)
+        warn("%s: cannot add setgid bit: %s\n",ENTRY_PATH,strerror(errno));
+    }
+      
+    /* Should we tag the directory as rstprod via ACLs? */
+    rstokay=1; /* set to 1 if rstprod tagging worked */
+    if(rstprod_gid!=(gid_t)-1 && statbuf->st_gid==rstprod_gid && !S_ISLNK(statbuf->st_mode)) {
+      debug("%s: tag rstprod\n",ENTRY_PATH);
+      COUNT(acl_count);
+      rstokay=!tag_rstprod(ENTRY_PATH,statbuf->st_mode);
+    }
 
-    /* Append the file basename to the pathbuf: */
-    newpathlen=pathlen+basenamelen;
-    memcpy(pathbuf+pathlen,dent->d_name,basenamelen);
-    pathbuf[newpathlen]='\0';
+    /* Should we chgrp the file/dir? */
+    if(rstokay && required_gid!=(gid_t)-1 && statbuf->st_gid!=required_gid) {
+      debug("%s: chgrp\n",ENTRY_PATH);
+      COUNT(chgrp_count);
+      start=op_start();
+      ret=fchownat(fd,name,(uid_t)-1,required_gid,AT_SYMLINK_NOFOLLOW);
+      op_done(MT_CHOWN,start);
+      if(ret)
+        warn("%s: cannot chgrp: %s\n",ENTRY_PATH,strerror(errno));
+    }
+  }
 
-    debugn(VERB_DEBUG_HIGH,"%s: process file\n",pathbuf);
+  /* Throttle file accessing speed if requested: */
+  throttle();
 
-    /* Check for duplicate device/inode if requested: */
-#ifdef ENABLE_CHECK_DUP
-    if((duplicate=hit_file(statbuf.st_dev,statbuf.st_ino)))
-      debug("%s: already processed.  Hard link?\n",
-            pathbuf);
+  if(deleted) {
+    /* File was deleted, so call the us_file_deleted to record usage information: */
+#ifdef ENABLE_DISK_USAGE
+    if(disk_usage)
+      us_file_deleted(dir->usage,ENTRY_PATH,statbuf);
 #endif
+  } else if(!duplicate)
+    /* The file was not deleted, and is not a duplicate, so call all
+       relevant per-file routines. */
+    file_found(dir->usage,disk_usage ? ENTRY_PATH : NULL,statbuf,
+               find_layout(dir,name,namelen,statbuf));
+}
 
-    /* Indicate that the file has not been deleted: */
-    deleted=0;
+/* dir_release: drops one reference to dir.  If that was the last one,
+   then dir and everything in it have been processed, so we leave the
+   directory, finish its entry in the parent directory, and release
+   our reference to the parent. */
+static void dir_release(walk_dir *dir) {
+  walk_dir *parent;
+  int emptied;
+  uint64_t sim_emptied;
+  size_t c;
+
+  /* Loop, rather than recurse, up the chain of finished directories */
+  while(dir && !__sync_sub_and_fetch(&dir->pending,1)) {
+    parent=dir->parent;
+    emptied=0;
+    sim_emptied=0;
+
+    if(dir->fd>=0) {
+      /* indicate that we're leaving this directory */
+      dir_leave(dir->usage,dir_path(dir),&dir->dirstat);
+      debug("%s: leaving directory\n",dir_path(dir));
+
+      /* If deletions are enabled, indicate whether this directory's
+         entire contents have been deleted. */
+#ifdef ENABLE_DELETION
+      if(delete_files) {
+        if(dir->deletions>=dir->files_seen) {
+          debug("%s: deleted all files\n",dir_path(dir));
+          emptied=1;
+        } else {
+          debug("%s: %llu of %llu files not deleted\n",dir_path(dir),
+                (unsigned long long)dir->deletions,(unsigned long long)dir->files_seen);
+          emptied=0;
+        }
+      }
+      for(c=0;c<nsim;c++)
+        if(dir->sim_deletions[c]>=dir->files_seen)
+          sim_emptied|=((uint64_t)1)<<c;
+#endif
 
-    /* recurse into this subdirectory if allowed and possible */
-    if(S_ISDIR(statbuf.st_mode)) {
+      /* Close the directory: */
+      close(dir->fd);
+    }
+
+    if(parent) {
+      /* Finish this directory's entry in its parent: */
 #ifdef ENABLE_DELETION
-      can_delete=0;
-      subdir_emptied=0;
+      debugn(VERB_DEBUG_HIGH,"%s: setting can_delete=subdir_emptied=%d\n",
+             entry_path(parent,dir->name,dir->namelen),emptied);
 #endif
-      if(!duplicate) {
-        if(depth<MAX_PATH_DEPTH) {
-          if((subdir_opened=opendir(pathbuf))) {
-            /* We can recurse into this directory. */
+      finish_entry(parent,dir->name,dir->namelen,&dir->dirstat,emptied,sim_emptied,0);
+    }
 
-            /* Append a / to the path */
-            pathbuf[newpathlen]='/';
-            pathbuf[newpathlen+1]='\0';
+    free(dir->sim_deletions);
+    free(dir->name);
+    free(dir);
+    dir=parent;
+  }
+}
 
-            /* Recurse: */
-            walk_impl(newpathlen+1,subdir_opened,depth+1,&statbuf,&subdir_emptied);
+/* spoil_record: something in dir cannot be replayed from the
+   incremental index, so dir must be scanned next time */
+static void spoil_record(walk_dir *dir) {
+#ifdef ENABLE_DISK_USAGE
+  if(dir->record)
+    us_record_spoil(dir->record);
+#endif
+}
 
-            /* Close the directory: */
-            closedir(subdir_opened);
+/* check_entry: makes sure a directory entry's name, and the path
+   made by appending it to the directory, are within the allowed
+   limits, and counts the entry.  Returns 0 if the entry must be
+   skipped. */
+static int check_entry(walk_dir *dir,const dir_entry *ent) {
+  /* Make sure the file basename is within the allowed limits */
+  if(ent->namelen>MAX_BASENAME_LEN) {
+    warn("%s%.*s...: skipping: file basename is too long",dir_path(dir),
+         (int)MAX_BASENAME_LEN,ent->name);
+    spoil_record(dir);
+#ifdef ENABLE_DISK_USAGE
+    if(disk_usage)
+      us_filename_too_long(dir->usage,dir_path(dir),ent->name,&dir->dirstat);
+#endif
+    return 0;
+  }
 
-            /* Remove the / from the path */
-            pathbuf[newpathlen]='\0';
+  /* Count the entry, so we know if the directory was emptied */
+  dir->files_seen++;
 
-            /* Indicate whether we can delete the directory.  */
-#ifdef ENABLE_DELETION
-            can_delete=subdir_emptied;
-            debugn(VERB_DEBUG_HIGH,"%s: setting can_delete=subdir_emptied=%d\n",pathbuf,subdir_emptied);
+  /* Make sure the path, after appending the file basename, is
+     within allowed limits: */
+  if(ent->namelen+dir->pathlen>MAX_PATH_LEN_CHAR) {
+    warn("%s%s...: skipping: path length is too long",dir_path(dir),ent->name);
+    spoil_record(dir);
+#ifdef ENABLE_DISK_USAGE
+    if(disk_usage)
+      us_path_too_long(dir->usage,dir_path(dir),ent->name,&dir->dirstat);
 #endif
-          } else {
-            warn("%s: opendir failed: %s\n",pathbuf,strerror(errno));
-            us_dir_unopenable(pathbuf,&statbuf);
-          }
-        } else {
-          warn("%s: owned by %llu is beyond maximum allowed directory depth of %llu\n",
-               pathbuf,(unsigned long long)statbuf.st_uid,MAX_PATH_DEPTH);
-          us_dir_too_deep(pathbuf,&statbuf);
-        }
-      } else
-        debug("%s: duplicate directory, not recursing\n",pathbuf);
-    }
-#ifdef ENABLE_DELETION
+    return 0;
+  }
+  return 1;
+}
+
+/* process_entry: handles a directory entry once it has been statted.
+   Files are finished immediately.  Subdirectories are pushed on to
+   walk_queue. */
+static void process_entry(walk_dir *dir,const dir_entry *ent,const struct stat *statbuf) {
+  size_t depth=dir->depth;
+  int duplicate=0;
+  walk_dir *subdir;
+
+  debugn(VERB_DEBUG_HIGH,"%s%s: process file\n",dir_path(dir),ent->name);
+
+  /* Check for duplicate device/inode if requested: */
+#ifdef ENABLE_CHECK_DUP
+  if(check_dup && !hit_file_tracked(statbuf))
+    COUNT(untracked_count);
+  else if(check_dup && (duplicate=hit_file(statbuf->st_dev,statbuf->st_ino)))
+    debug("%s%s: already processed.  Hard link?\n",
+          dir_path(dir),ent->name);
+#endif
+
+#ifdef ENABLE_DISK_USAGE
+  /* Record it for the incremental index.  Hard links could be
+     counted elsewhere, so they cannot be replayed. */
+  if(dir->record) {
+    if(duplicate || (!S_ISDIR(statbuf->st_mode) && statbuf->st_nlink>1))
+      us_record_spoil(dir->record);
+    else if(S_ISDIR(statbuf->st_mode))
+      us_record_subdir_found(dir->record,ent->name,ent->namelen);
     else
-      /* This is not a directory.  That means, so far, we are allowed to delete it. */
-      can_delete=1;
-
-    /* Can we delete this file? */
-    if(delete_files && can_delete && (int64_t)depth>=(int64_t)delete_min_depth) {
-      /* Yes, so far.  The only check left is the age. */
-      time_t now=time(NULL);
-      int64_t m_age=((int64_t)now)-((int64_t)statbuf.st_mtime);
-      //int64_t c_age=((int64_t)now)-((int64_t)statbuf.st_ctime);
-      int64_t age;
-
-      /* Age check: 
-         links: age is the lesser of access age and modify age
-         others: age is the modification age
-      */
-
-      if(S_ISDIR(statbuf.st_mode))
-        age=m_age; //(m_age<c_age) ? m_age : c_age;
-      else
-        age=m_age;
-      if(age>=delete_age) {
-        /* The file can be deleted. */
-        debug("%s: age %llds >= %llds; delete file\n",pathbuf,age,delete_age);
-        del_count++;
-        if(unlinkat(dirfd(d),dent->d_name,
-                    (S_ISDIR(statbuf.st_mode)) ? AT_REMOVEDIR : 0))
-          warn("%s: unlinkat failed: %s\n",pathbuf,strerror(errno));
-        else {
-          /* Unlink succeeded.  This file has been deleted. */
-          deletions++;
-          deleted=1;
-        }
-      } else {
-        debugn(VERB_DEBUG_HIGH,"%s: age %llds < %llds; not deleting file\n",pathbuf,age,delete_age);
-      }
-    } else if(delete_files) {
-      /* We are not allowed to delete this file.  If debug level is
-         very high (-v -v) then print out a reason why */
-      if((int64_t)depth<(int64_t)delete_min_depth)
-        debugn(VERB_DEBUG_HIGH,"%s: cannot delete: not past min depth (%d<%d)\n",
-               pathbuf,depth,delete_min_depth);
-      else if(!subdir_emptied)
-        debugn(VERB_DEBUG_HIGH,"%s: cannot delete: subdirectory is not empty\n",pathbuf);
-      else if(S_ISDIR(statbuf.st_mode) && duplicate)
-        debugn(VERB_DEBUG_HIGH,"%s: cannot delete: did not recurse into duplicate directory\n",pathbuf);
-      else
-        debugn(VERB_DEBUG_HIGH,"%s: cannot delete or deletion is disabled\n",pathbuf);
-    }
+      us_record_file(dir->record,ent->name,statbuf);
+  }
 #endif
 
-    if(!duplicate && !deleted) {
-      /* We did not delete this directory, and it is not a duplicate,
-         so let's change its group ids, setgid bit and rstprod tagging
-         if relevant */
+  if(!S_ISDIR(statbuf->st_mode))
+    /* This is not a directory.  That means, so far, we are allowed
+       to delete it. */
+    finish_entry(dir,ent->name,ent->namelen,statbuf,1,SIM_ALL,duplicate);
+  else if(duplicate) {
+    debug("%s%s: duplicate directory, not recursing\n",dir_path(dir),ent->name);
+    finish_entry(dir,ent->name,ent->namelen,statbuf,0,0,duplicate);
+  } else if(depth>=MAX_PATH_DEPTH) {
+    warn("%s%s: owned by %llu is beyond maximum allowed directory depth of %llu\n",
+         dir_path(dir),ent->name,(unsigned long long)statbuf->st_uid,
+         (unsigned long long)MAX_PATH_DEPTH);
+#ifdef ENABLE_DISK_USAGE
+    if(disk_usage)
+      us_dir_too_deep(dir->usage,entry_path(dir,ent->name,ent->namelen),statbuf);
+#endif
+    finish_entry(dir,ent->name,ent->namelen,statbuf,0,0,duplicate);
+  } else {
+    /* Queue this subdirectory for walking.  It holds a reference
+       to us until it is finished. */
+    subdir=new_walk_dir(dir,ent->name,ent->namelen,depth+1,statbuf);
+    __sync_fetch_and_add(&dir->pending,1);
+    tq_push(walk_queue,subdir);
+  }
+}
 
-      /* Should we turn on the setgid bit? */
-      if(S_ISDIR(statbuf.st_mode) && required_gid!=(gid_t)-1 && !(statbuf.st_mode&S_ISGID)) {
-        debug("%s: set gid\n",pathbuf);
-        setgid_count++;
-        if(fchmodat(dirfd(d),dent->d_name,(statbuf.st_mode&0777)|S_ISGID,0))
-          warn("%s: cannot add setgid bit: %s\n",pathbuf,strerror(errno));
-      }
-      
-      /* Should we tag the directory as rstprod via ACLs? */
-      rstokay=1; /* set to 1 if rstprod tagging worked */
-      if(rstprod_gid!=(gid_t)-1 && statbuf.st_gid==rstprod_gid && !S_ISLNK(statbuf.st_mode)) {
-        debug("%s: tag rstprod\n",pathbuf);
-        acl_count++;
-        rstokay=!tag_rstprod(pathbuf,statbuf.st_mode);
-      }
+/* ring_stat_done: stat_ring callback, called as each stat of a batch
+   completes.  The argument is the walk_dir. */
+static void ring_stat_done(void *arg,const dir_entry *ent,int err,const struct stat *sb,
+                           double seconds) {
+  walk_dir *dir=(walk_dir*)arg;
+  op_took(MT_STATX,seconds);
+  if(err) {
+    warn("%s%s: cannot stat using statx: %s\n",dir_path(dir),ent->name,strerror(err));
+    spoil_record(dir);
+  } else
+    process_entry(dir,ent,sb);
+}
 
-      /* Should we chgrp the file/dir? */
-      if(rstokay && required_gid!=(gid_t)-1 && statbuf.st_gid!=required_gid) {
-        debug("%s: chgrp\n",pathbuf);
-        chgrp_count++;
-        if(fchownat(dirfd(d),dent->d_name,(uid_t)-1,required_gid,AT_SYMLINK_NOFOLLOW))
-          warn("%s: cannot chgrp: %s\n",pathbuf,strerror(errno));
-      }
-    }
+/* thread_ring: returns this thread's stat_ring, creating it the
+   first time, or NULL if stats should be done synchronously.  If
+   io_uring is unavailable, we say so once and use synchronous
+   stats. */
+static stat_ring *thread_ring(void) {
+  static int warned=0;
+  if(!ring_tried) {
+    ring_tried=1;
+    if(!(ring=sr_create(ring_depth)) && __sync_bool_compare_and_swap(&warned,0,1))
+      warn("Cannot use io_uring for stats (%s).  Using synchronous stats instead.\n",
+           strerror(errno));
+  }
+  return ring;
+}
+
+/* do_stat_entry: stats entry ent of dir with the selected stat method.
+   Returns the result, or NULL after a warning.  The result is in
+   statbuf, except with the Lustre stat, which is read in place from
+   the ioctl reply and is only valid until this thread's next stat. */
+static const struct stat *do_stat_entry(walk_dir *dir,const dir_entry *ent,struct stat *statbuf) {
+  const struct stat *reply;
+  if(get_use_lustre_stat()) {
+#ifdef ENABLE_DISK_USAGE
+    if(layouts) {
+      if((reply=entry_layout_stat=lustre_stat(dir->fd,ent->name,ent->namelen,&entry_layout)))
+        return reply;
+    } else
+#endif
+    if((reply=lustre_stat(dir->fd,ent->name,ent->namelen,NULL)))
+      return reply;
+    warn("%s%s: cannot stat using lustre stat: %s\n",dir_path(dir),ent->name,strerror(errno));
+  } else if(get_statx_mask()) {
+    if(!statx_lstatfd(dir->fd,ent->name,statbuf))
+      return statbuf;
+    warn("%s%s: cannot stat using statx: %s\n",dir_path(dir),ent->name,strerror(errno));
+  } else {
+    if(!fstatat(dir->fd,ent->name,statbuf,AT_SYMLINK_NOFOLLOW))
+      return statbuf;
+    warn("%s%s: cannot stat: %s\n",dir_path(dir),ent->name,strerror(errno));
+  }
+  spoil_record(dir);
+  return NULL;
+}
 
-    /* Throttle file accessing speed if requested: */
-    throttle();
+/* stat_entry: do_stat_entry, timed if timing */
+static const struct stat *stat_entry(walk_dir *dir,const dir_entry *ent,struct stat *statbuf) {
+  const struct stat *ok;
+  double start;
+  if(!timing)
+    return do_stat_entry(dir,ent,statbuf);
+  start=op_start();
+  ok=do_stat_entry(dir,ent,statbuf);
+  op_done(get_use_lustre_stat() ? MT_LUSTRE_STAT : get_statx_mask() ? MT_STATX : MT_STAT,start);
+  return ok;
+}
 
-    if(deleted)
-      /* File was deleted, so call the us_file_deleted to record usage information: */
-      us_file_deleted(pathbuf,&statbuf);
-    else if(!duplicate)
-      /* The file was not deleted, and is not a duplicate, so call all
-         relevant per-file routines. */
-      file_found(pathbuf,&statbuf);
+/* read_batch: dr_read_batch on this thread's reader, timed if
+   timing */
+static ssize_t read_batch(const dir_entry **ents) {
+  double start=op_start();
+  ssize_t n=dr_read_batch(reader,ents);
+  op_done(MT_READDIR,start);
+  return n;
+}
 
-    /* Clip the pathbuf so it only contains the directory path */
-    pathbuf[pathlen]='\0';
+/* walk_impl: this routine does the actual walking of one directory.
+   Entries are read in large batches with this thread's dir_reader.
+   Each entry is statted, if needed, and passed to process_entry.
+   With -A, the stats for a batch are done at once with io_uring and
+   the entries are processed in the order the stats complete.
+     dir -- the directory to walk.  dir->fd must be open. */
+void walk_impl(walk_dir *dir) {
+  const dir_entry *ents,*ent;
+  ssize_t nents,i;
+  size_t nstat;
+  struct stat statbuf;
+  const struct stat *sb;
+  int use_lustre_stat=get_use_lustre_stat();
+  int use_statx=(get_statx_mask()!=0);
+  int fd=dir->fd;
+  stat_ring *r=NULL;
+
+  /* Check assumptions: */
+  assert(dir->depth<=MAX_PATH_DEPTH);
+  assert(fd>=0);
+  assert(dir->pathlen>0);
+  assert(dir->pathlen<MAX_PATH_LEN_CHAR);
+
+  debugn(VERB_DEBUG_HIGH,"%s: entering directory\n",dir_path(dir));
+  COUNT(dir_count);
+
+  if(!reader)
+    reader=dr_create(dir_buffer_size);
+  dr_start(reader,fd);
+  if(ring_depth && use_statx && !use_lustre_stat && stat_fields!=STAT_TYPE)
+    r=thread_ring();
+
+  /* Loop over all batches of entries in this directory, and all
+     entries in each batch.  The reader skips . and .. for us. */
+  while( (nents=read_batch(&ents))>0 ) {
+    if(r && stat_list_size<(size_t)nents) {
+      free(stat_list);
+      stat_list_size=nents;
+      if(!(stat_list=(const dir_entry**)malloc(stat_list_size*sizeof(const dir_entry*))))
+        fail("Cannot allocate %llu bytes: %s\n",
+             (unsigned long long)(stat_list_size*sizeof(const dir_entry*)),strerror(errno));
+    }
+    nstat=0;
+
+    for(i=0;i<nents;i++) {
+      ent=ents+i;
+      if(!check_entry(dir,ent))
+        continue;
+
+      /* Stat the file, unless the directory read told us all we need: */
+      if(stat_fields==STAT_TYPE && ent->type!=DT_UNKNOWN) {
+        type_stat(&statbuf,ent,&dir->dirstat);
+        COUNT(stat_skip_count);
+        process_entry(dir,ent,&statbuf);
+      } else if(r)
+        stat_list[nstat++]=ent; /* stat later, with the rest of the batch */
+      else if((sb=stat_entry(dir,ent,&statbuf)))
+        process_entry(dir,ent,sb);
+    }
+
+    /* Stat everything left in this batch at once */
+    if(nstat)
+      sr_stat_batch(r,fd,stat_list,nstat,ring_stat_done,dir);
+  }
+  if(nents<0) {
+    warn("%s: cannot read directory: %s\n",dir_path(dir),strerror(errno));
+    spoil_record(dir);
   }
+}
 
-  /* indicate that we're leaving this directory */
-  dir_leave(pathbuf,dirstat);
-  debug("%s: leaving directory\n",pathbuf);
+#ifdef ENABLE_DISK_USAGE
+/* walk_cached: the incremental index's replacement for walk_impl,
+   for a directory that has not changed since the index was written.
+   The usage of its files is taken from the index record, so only its
+   subdirectories are statted and processed.  The record goes in the
+   new index unchanged. */
+static void walk_cached(walk_dir *dir,const us_record *rec) {
+  size_t i,n=us_record_nsubdirs(rec),nfiles;
+  struct stat statbuf;
+  const struct stat *sb;
+  dir_entry ent;
+
+  debugn(VERB_DEBUG_HIGH,"%s: unchanged; using index\n",dir_path(dir));
+  COUNT(dir_count);
+  COUNT(index_dir_count);
+  nfiles=us_record_replay(dir->usage,dir_path(dir),rec);
+  __sync_fetch_and_add(&index_file_count,nfiles);
+
+  for(i=0;i<n;i++) {
+    ent.name=us_record_subdir(rec,i,&ent.namelen);
+    ent.ino=0;
+    ent.type=DT_DIR;
+    if(check_entry(dir,&ent) && (sb=stat_entry(dir,&ent,&statbuf)))
+      process_entry(dir,&ent,sb);
+  }
+  us_record_save(rec);
+}
+#endif /* ENABLE_DISK_USAGE */
 
-  /* If deletions are enabled, indicate whether this directory's
-     entire contents have been deleted. */
-#ifdef ENABLE_DELETION
-  if(delete_files) {
-    if(deletions>=files_seen) {
-      debug("%s: deleted all files\n",pathbuf);
-      *emptied=1;
-    } else {
-      debug("%s: %llu of %llu files not deleted\n",pathbuf,deletions,files_seen);
-      *emptied=0;
+/* open_subdir: opens a subdirectory relative to its parent's open
+   directory.  O_NOFOLLOW and O_DIRECTORY refuse anything that was
+   replaced by a symlink or non-directory since we statted it.  When
+   using the full stat, the device and inode numbers are also checked
+   against that stat, in case the directory was replaced by another
+   directory.  (The Lustre stat's device and inode numbers do not
+   match fstat's, and there is no stat to check against if the walk
+   only needed d_type.)  Returns -1 and sets errno on failure. */
+static int open_subdir(walk_dir *dir) {
+  struct stat fdstat;
+  double start=op_start();
+  int fd=openat(dir->parent->fd,dir->name,
+                O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+  op_done(MT_OPENDIR,start);
+  if(fd<0)
+    return -1;
+  if(!get_use_lustre_stat() && stat_fields!=STAT_TYPE) {
+    if(fstat(fd,&fdstat)) {
+      close(fd);
+      return -1;
+    }
+    if(fdstat.st_dev!=dir->dirstat.st_dev || fdstat.st_ino!=dir->dirstat.st_ino) {
+      close(fd);
+      errno=ESTALE;
+      return -1;
     }
   }
-#else
-  *emptied=0;
+  return fd;
+}
+
+static void maybe_checkpoint(void);
+
+/* run_dir: walk_queue task routine.  Opens the directory if needed,
+   walks it, and releases the scan's reference to it. */
+static void run_dir(void *task) {
+  walk_dir *dir=(walk_dir*)task;
+  us_frame *parent_usage=dir->parent ? dir->parent->usage : NULL;
+  if(dir->fd<0 && (dir->fd=open_subdir(dir))<0) {
+    warn("%s: opendir failed: %s\n",
+         entry_path(dir->parent,dir->name,dir->namelen),strerror(errno));
+#ifdef ENABLE_DISK_USAGE
+    if(disk_usage)
+      us_dir_unopenable(parent_usage,entry_path(dir->parent,dir->name,dir->namelen),
+                        &dir->dirstat);
+#endif
+  }
+  if(dir->fd>=0) {
+    /* Indicate that we're entering this directory, then walk it,
+       using the incremental index if it has not changed. */
+    dir->usage=dir_enter(parent_usage,dir_path(dir),&dir->dirstat);
+#ifdef ENABLE_DISK_USAGE
+    if(index_file) {
+      const us_record *rec=index_exact ? NULL : us_index_lookup(&dir->dirstat);
+      if(rec)
+        walk_cached(dir,rec);
+      else {
+        dir->record=us_record_new(&dir->dirstat);
+        walk_impl(dir);
+        us_record_save(dir->record);
+        us_record_free(dir->record);
+        dir->record=NULL;
+      }
+    } else
 #endif
+      walk_impl(dir);
+  }
+  dir_release(dir);
+  maybe_checkpoint();
 }
 
 /* walk: recurses through a directory tree, processing all files.  The
@@ -574,23 +1210,310 @@ void walk_impl(size_t pathlen,DIR *d,size_t depth,
    the device and inode numbers match what is seen internally in
    walk_impl. */
 void walk(const char *dirname) {
-  DIR *d;
+  int fd;
   size_t len=path_length(dirname,1);
   struct stat statbuf;
-  int emptied;
-  memcpy(pathbuf,dirname,len);
-  pathbuf[len]='/';
-  pathbuf[len+1]='\0';
+  walk_dir *dir;
   if(similar_lstat(dirname,&statbuf)) {
     warn("%s: cannot stat: %s\n",dirname,strerror(errno));
     return;
   }
-  if(!(d=opendir(dirname))) {
+  if((fd=open(dirname,O_RDONLY|O_DIRECTORY|O_NONBLOCK|O_CLOEXEC))<0) {
     warn("%s: cannot open directory: %s\n",dirname,strerror(errno));
     return;
   }
-  walk_impl(len+1,d,1,&statbuf,&emptied);
-  closedir(d);
+  dir=new_walk_dir(NULL,dirname,len,1,&statbuf);
+  dir->fd=fd;
+  tq_push(walk_queue,dir);
+  tq_run(walk_queue);
+}
+
+/**********************************************************************/
+
+/* Checkpoints.  A checkpoint is written between tasks, while the
+   other walker threads are paused, so no directory is partly
+   scanned.  Every directory still in memory is then either waiting
+   in walk_queue to be scanned, or has been scanned and is waiting for
+   its subdirectories to finish; the latter are all ancestors of the
+   former.  A checkpoint holds those directories, which are the
+   frontier of the walk, along with the counters, the duplicate file
+   set and the usage statistics, all of which reflect exactly the
+   entries processed so far.  Resuming rebuilds the frontier and
+   carries on from there.  See checkpoint.h for the file format. */
+
+/* save_dir: writes dir, and any ancestors not yet written, to a
+   checkpoint.  Parents are always written before their children, so
+   a child can refer to its parent by index.
+     scanned -- 1 if dir has been scanned, 0 if it is queued */
+static void save_dir(FILE *f,walk_dir *dir,int scanned) {
+  size_t c;
+  if(dir->ckpt_gen==ckpt_gen)
+    return; /* already written */
+  if(dir->parent)
+    save_dir(f,dir->parent,1);
+  ckpt_put_u64(f,1); /* another directory follows */
+  ckpt_put_u64(f,dir->parent ? dir->parent->ckpt_index+1 : 0);
+  ckpt_put_str(f,dir->name,dir->namelen);
+  ckpt_put_u64(f,dir->depth);
+  ckpt_put_u64(f,scanned);
+  ckpt_put_u64(f,dir->files_seen);
+  ckpt_put_u64(f,dir->deletions);
+#ifdef ENABLE_DELETION
+  for(c=0;c<nsim;c++)
+    ckpt_put_u64(f,dir->sim_deletions[c]);
+#endif
+  ckpt_put(f,&dir->dirstat,sizeof(struct stat));
+  dir->ckpt_gen=ckpt_gen;
+  dir->ckpt_index=ckpt_count++;
+}
+
+/* save_queued: tq_foreach callback that writes a queued directory
+   and its ancestors */
+static void save_queued(void *task,void *arg) {
+  save_dir((FILE*)arg,(walk_dir*)task,0);
+}
+
+/* write_checkpoint: writes a checkpoint.  The walker must be paused. */
+static void write_checkpoint(void) {
+  double now=fulltime();
+  size_t i;
+  FILE *f;
+
+  debug("%s: writing checkpoint\n",checkpoint_file);
+  if((f=ckpt_create(checkpoint_file))) {
+    ckpt_put_tag(f,"ARGS");
+    ckpt_put_u64(f,nwalk_args);
+    for(i=0;i<nwalk_args;i++)
+      ckpt_put_str(f,walk_args[i],strlen(walk_args[i]));
+    ckpt_put_u64(f,walk_arg);
+    ckpt_put_double(f,now-start_time);
+#ifdef ENABLE_DISK_USAGE
+    ckpt_put_u64(f,disk_usage);
+#else
+    ckpt_put_u64(f,0);
+#endif
+#ifdef ENABLE_CHECK_DUP
+    ckpt_put_u64(f,check_dup);
+#else
+    ckpt_put_u64(f,0);
+#endif
+
+    ckpt_put_tag(f,"CNTS");
+    ckpt_put_u64(f,file_count);
+    ckpt_put_double(f,th_sleep_time());
+    ckpt_put_u64(f,setgid_count);
+    ckpt_put_u64(f,chgrp_count);
+    ckpt_put_u64(f,acl_count);
+    ckpt_put_u64(f,dir_count);
+    ckpt_put_u64(f,del_count);
+    ckpt_put_u64(f,stat_skip_count);
+    ckpt_put_u64(f,index_dir_count);
+    ckpt_put_u64(f,index_file_count);
+    ckpt_put_u64(f,untracked_count);
+
+#ifdef ENABLE_CHECK_DUP
+    if(check_dup)
+      hit_file_save(f);
+#endif
+#ifdef ENABLE_DISK_USAGE
+    if(disk_usage)
+      us_checkpoint(f);
+#endif
+
+    ckpt_put_tag(f,"DIRS");
+    ckpt_gen++;
+    ckpt_count=0;
+    tq_foreach(walk_queue,save_queued,f);
+    ckpt_put_u64(f,0); /* no more directories */
+
+    if(!ckpt_commit(f,checkpoint_file))
+      debug("%s: wrote checkpoint with %llu directories after %llu files\n",checkpoint_file,
+            (unsigned long long)ckpt_count,(unsigned long long)file_count);
+  }
+  next_checkpoint=now+checkpoint_interval;
+}
+
+/* maybe_checkpoint: called between tasks.  Writes a checkpoint if one
+   is due, or was requested by a signal. */
+static void maybe_checkpoint(void) {
+  int request;
+  if(!checkpoint_file)
+    return;
+  if(!checkpoint_request && fulltime()<next_checkpoint)
+    return;
+  if(!tq_pause(walk_queue))
+    return; /* someone else is writing it */
+  request=checkpoint_request;
+  checkpoint_request=0;
+  write_checkpoint();
+  if(request==CKPT_REQUEST_EXIT)
+    fail("%s: checkpoint written.  Exiting due to SIGTERM.  Use --resume to continue.\n",
+         checkpoint_file);
+  tq_unpause(walk_queue);
+}
+
+/* checkpoint_signal: signal handler for SIGUSR1 and SIGTERM */
+static void checkpoint_signal(int sig) {
+  if(sig==SIGTERM)
+    checkpoint_request=CKPT_REQUEST_EXIT;
+  else if(!checkpoint_request)
+    checkpoint_request=CKPT_REQUEST_NOW;
+}
+
+/* restore_checkpoint: reads a checkpoint written by an earlier run of
+   the walker with the same arguments.  Restores the counters,
+   duplicate file set and usage statistics, rebuilds the frontier of
+   the walk, and pushes the directories that were waiting to be
+   scanned on to walk_queue.  Returns the index (in walk_args) of the
+   directory that was being walked, whose walk should be continued by
+   calling tq_run.
+     prefix -- the -x report prefix */
+static size_t restore_checkpoint(const char *prefix) {
+  FILE *f=ckpt_open(checkpoint_file);
+  walk_dir **dirs=NULL, *dir, *parent;
+  size_t ndirs=0, alloc=0, i, n, parent_index, depth, len, resume_arg;
+  size_t files_seen, deletions;
+#ifdef ENABLE_DELETION
+  size_t sim_deletions[MAX_SIM_CANDIDATES];
+#endif
+  int scanned;
+  struct stat dirstat;
+  char *name;
+
+  /* The checkpointed run must have been walking the same directories,
+     with the same kind of bookkeeping. */
+  ckpt_get_tag(f,"ARGS");
+  n=ckpt_get_u64(f);
+  if(n!=nwalk_args)
+    fail("%s: checkpoint was for %llu directories, not %llu\n",checkpoint_file,
+         (unsigned long long)n,(unsigned long long)nwalk_args);
+  for(i=0;i<n;i++) {
+    name=ckpt_get_str(f,NULL);
+    if(strcmp(name,walk_args[i]))
+      fail("%s: checkpoint was for directory %s, not %s\n",checkpoint_file,name,walk_args[i]);
+    free(name);
+  }
+  resume_arg=ckpt_get_u64(f);
+  start_time=fulltime()-ckpt_get_double(f);
+#ifdef ENABLE_DISK_USAGE
+  if((int)ckpt_get_u64(f)!=disk_usage)
+    fail("%s: checkpoint was written with different -u/-U options\n",checkpoint_file);
+#else
+  ckpt_get_u64(f);
+#endif
+#ifdef ENABLE_CHECK_DUP
+  if((int)ckpt_get_u64(f)!=check_dup)
+    fail("%s: checkpoint was written with a different -n option\n",checkpoint_file);
+#else
+  ckpt_get_u64(f);
+#endif
+
+  ckpt_get_tag(f,"CNTS");
+  file_count=ckpt_get_u64(f);
+  th_set_sleep_time(ckpt_get_double(f));
+  setgid_count=ckpt_get_u64(f);
+  chgrp_count=ckpt_get_u64(f);
+  acl_count=ckpt_get_u64(f);
+  dir_count=ckpt_get_u64(f);
+  del_count=ckpt_get_u64(f);
+  stat_skip_count=ckpt_get_u64(f);
+  index_dir_count=ckpt_get_u64(f);
+  index_file_count=ckpt_get_u64(f);
+  untracked_count=ckpt_get_u64(f);
+
+#ifdef ENABLE_CHECK_DUP
+  if(check_dup)
+    hit_file_load(f);
+#endif
+#ifdef ENABLE_DISK_USAGE
+  if(disk_usage)
+    us_restore(f,prefix);
+#endif
+
+  /* Rebuild the frontier.  Scanned directories are reopened, since
+     their entries are finished relative to their file descriptors. */
+  ckpt_get_tag(f,"DIRS");
+  while(ckpt_get_u64(f)) {
+    parent_index=ckpt_get_u64(f);
+    if(parent_index>ndirs)
+      fail("%s: checkpoint is corrupt: bad parent directory\n",checkpoint_file);
+    parent=parent_index ? dirs[parent_index-1] : NULL;
+    name=ckpt_get_str(f,&len);
+    depth=ckpt_get_u64(f);
+    scanned=(int)ckpt_get_u64(f);
+    files_seen=ckpt_get_u64(f);
+    deletions=ckpt_get_u64(f);
+#ifdef ENABLE_DELETION
+    for(i=0;i<nsim;i++)
+      sim_deletions[i]=ckpt_get_u64(f);
+#endif
+    ckpt_get(f,&dirstat,sizeof(struct stat));
+    dir=new_walk_dir(parent,name,len,depth,&dirstat);
+    dir->files_seen=files_seen;
+    dir->deletions=deletions;
+#ifdef ENABLE_DELETION
+    for(i=0;i<nsim;i++)
+      dir->sim_deletions[i]=sim_deletions[i];
+#endif
+    free(name);
+    if(parent)
+      parent->pending++;
+
+    if(!parent || scanned) {
+      if(parent)
+        dir->fd=open_subdir(dir);
+      else
+        dir->fd=open(dir->name,O_RDONLY|O_DIRECTORY|O_NONBLOCK|O_CLOEXEC);
+      if(dir->fd<0)
+        warn("%s: cannot reopen directory: %s\n",dir_path(dir),strerror(errno));
+    }
+    if(scanned) {
+      /* The scan is done, so only unfinished subdirectories will hold
+         references to this directory. */
+      dir->pending=0;
+      dir->usage=parent ? parent->usage : NULL;
+      if(dir->fd>=0)
+        dir->usage=dir_enter(dir->usage,dir_path(dir),&dir->dirstat);
+    } else
+      /* Queue it.  Nothing runs until tq_run. */
+      tq_push(walk_queue,dir);
+
+    if(ndirs==alloc) {
+      alloc=alloc ? alloc*2 : 64;
+      if(!(dirs=(walk_dir**)realloc(dirs,alloc*sizeof(walk_dir*))))
+        fail("Cannot allocate %llu bytes: %s\n",
+             (unsigned long long)(alloc*sizeof(walk_dir*)),strerror(errno));
+    }
+    dirs[ndirs++]=dir;
+  }
+  ckpt_get_tag(f,"END.");
+  fclose(f);
+
+  /* Every scanned directory must be waiting for a subdirectory, or
+     nothing would ever finish it. */
+  for(i=0;i<ndirs;i++)
+    if(!dirs[i]->pending)
+      fail("%s: checkpoint is corrupt: %s has nothing left to do\n",
+           checkpoint_file,dir_path(dirs[i]));
+  free(dirs);
+
+  warn("%s: resuming walk of %s with %llu directories in progress\n",
+          checkpoint_file,walk_args[resume_arg],(unsigned long long)ndirs);
+  return resume_arg;
+}
+
+/* raise_fd_limit: each directory being walked keeps its directory
+   open until its subdirectories are finished, so with many threads we
+   may need more file descriptors than the default soft limit. */
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+  if(getrlimit(RLIMIT_NOFILE,&rl))
+    warn("Cannot get open file limit: %s\n",strerror(errno));
+  else if(rl.rlim_cur<rl.rlim_max) {
+    rl.rlim_cur=rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE,&rl))
+      warn("Cannot raise open file limit: %s\n",strerror(errno));
+  }
 }
 
 /* usage: print a usage message and exit.
@@ -630,6 +1553,14 @@ void usage(const char *exename,const char *message) {
            "        correct timestamps and file sizes.\n"
            "  -l -- enable use of Lustre stat.  This is fast, but has old\n"
            "        timestamps and file sizes.  File sizes are usually zero.\n"
+           "  -X -- use statx, requesting only the fields needed by the\n"
+           "        enabled features.  When sizes and times are not needed\n"
+           "        (-g and -r runs), cached attributes are accepted, which\n"
+           "        avoids contacting the object servers.  Implies -L.\n"
+           "  -A depth -- use io_uring to keep up to this many stats in\n"
+           "        flight in each thread, from 1 to 32768.  Implies -X.\n"
+           "        Falls back to ordinary stats if io_uring is\n"
+           "        unavailable.\n"
            " NOTE: By default, the code chooses between Lustre and non-Lustre\n"
            "       stat based on whether it needs file sizes or timestamps.\n"
            "       Only use -l or -L if you want to override that decision.\n"
@@ -646,24 +1577,117 @@ void usage(const char *exename,const char *message) {
            "  -b bytesize -- set the size of a file that is considered\n"
            "        \"big\" for the purposes of disk usage accounting\n"
            "        (meaningless without -u or -U).\n"
+           "  --top N -- instead of listing every big file in the big-files\n"
+           "        reports, list the N largest big files of each owner,\n"
+           "        group and -u directory, largest first, in the\n"
+           "        by-user-top-files, by-group-top-files and\n"
+           "        by-dir-top-files reports.\n"
+           "  --layouts -- count the Lustre striping of regular files for\n"
+           "        each owner, group and -u directory: files and bytes by\n"
+           "        stripe count and by OST pool, and objects and bytes by\n"
+           "        OST, in the by-user-layout, by-group-layout and\n"
+           "        by-dir-layout reports.  The layouts come with the\n"
+           "        Lustre stat, so this requires -l and costs no extra\n"
+           "        requests, but file sizes are then usually zero, so\n"
+           "        all byte counts in the usage reports are unreliable.\n"
+           "        Requires -u or -U, and cannot be used with --index.\n"
+           "  --layout-requests -- like --layouts, but keep the exact\n"
+           "        stat, and read each regular file's layout with a\n"
+           "        Lustre stat of its own.  Byte counts are right, but\n"
+           "        this is one more request to the metadata server for\n"
+           "        every regular file.  Cannot be used with -l.\n"
+           "  --sort-reports -- list directories by path, owners by uid and\n"
+           "        groups by gid in the usage reports, so that they do not\n"
+           "        depend on the order of the walk.\n"
            "  -x /prefix/for/usage/reports -- prefix to prepend to filenames\n"
            "        of files that will contain reports of usage stats.\n"
            "        This option is meaningless without -u  or -U\n"
            "  -F -- also generate a list of all files and some attributes\n"
            "        This option has no effect without -u or -U\n"
+           "  --list-format text|binary|columns -- format of the -F list:\n"
+           "        text (all-files.lst, the default), a compact binary\n"
+           "        format (all-files.bin), or chunks of columns with\n"
+           "        per-chunk minimum and maximum, for analysis\n"
+           "        (all-files.col).  See file_list.h for the formats.\n"
+           "        lustre-walker-list converts either to text.\n"
+           "  --index file -- keep an incremental index in this file.  A\n"
+           "        directory whose mtime and ctime have not changed since\n"
+           "        the last run is not read, and its files are not\n"
+           "        statted; their usage is taken from the index.  Only its\n"
+           "        subdirectories are statted.  Files changed in place\n"
+           "        (written, chmoded or chowned) are not noticed until\n"
+           "        their directory changes.  Requires -u or -U, and\n"
+           "        cannot be used with -g, -r, -d, -F or --simulate-purge.\n"
+           "  --index-exact -- scan and stat everything, for exact sizes\n"
+           "        and times, but still write a new --index for later runs.\n"
+           "  --passwd-file file -- read user names from this file, in\n"
+           "        /etc/passwd format (such as from \"getent passwd\"),\n"
+           "        instead of looking each owner up.  Owners not in the\n"
+           "        file are still looked up, once each.\n"
+           "  --group-file file -- the same, for group names, in\n"
+           "        /etc/group format.\n"
 #endif /* ENABLE_DISK_USAGE */
 #ifdef ENABLE_DELETION
            "  -d days -- delete everything older than this number of days.\n"
            "        Fractions are okay.  Cannot use with -L\n"
            "  -D mindepth -- do not delete anything less than this depth\n"
            "        within the file tree.  Useless without -d\n"
+           "  --simulate-purge days[,days...] -- delete nothing, but report\n"
+           "        what -d would delete with each of these ages, in one\n"
+           "        walk: the files and bytes freed for each owner, group\n"
+           "        and -u directory, in the by-user-purge, by-group-purge\n"
+           "        and by-dir-purge reports.  Requires -u or -U, and\n"
+           "        cannot be used with -d or --index.\n"
+           "  --simulate-depths mindepth[,mindepth...] -- the -D values to\n"
+           "        simulate; each is tried with each age.  At most 64\n"
+           "        combinations.  Default: the -D value\n"
 #endif
 #ifdef ENABLE_CHECK_DUP
            "  -n -- disable checking for duplicate files (hard links).  This\n"
-           "        will save a significant amount of memory: ~16B/file\n"
+           "        saves 11-22 bytes per file, or 22-43 bytes per file\n"
+           "        on a filesystem with 64-bit inode numbers above 2^60.\n"
+           "        If nothing else needs file metadata (no -g, -r, -d, -u\n"
+           "        or -U), -n also lets the walker skip stat calls.\n"
+           "  --rename-window seconds -- only check directories, hard links\n"
+           "        and files changed less than this long before the walk\n"
+           "        started for duplicates, to save memory.  This is\n"
+           "        approximate: a file unchanged for longer than that\n"
+           "        which is renamed during the walk into a directory not\n"
+           "        yet walked is counted twice.  Default: -1 (check every\n"
+           "        file exactly)\n"
 #endif
-           "  -t N -- ensure that less than N files will be processed\n"
-           "        per second\n"
+           "  -t N -- throttle to about N files per second.  The rate is\n"
+           "        cut when the metadata server slows down (the 95th\n"
+           "        percentile of stat and directory read times goes over\n"
+           "        --target-latency) and raised again when it recovers,\n"
+           "        up to N, or up to 2N while latency is under half the\n"
+           "        target.  N<10 means no throttling.  At most 100000\n"
+           "  --target-latency ms -- the 95th percentile latency -t aims\n"
+           "        for, in milliseconds.  Default: 20\n"
+           "  --metrics file -- periodically write the latency histogram of\n"
+           "        each kind of metadata operation (directory reads,\n"
+           "        stats, opens, unlinks, chmods, chowns and ACL\n"
+           "        changes), and the walk's progress, to this file in\n"
+           "        the Prometheus text format.  -s prints a summary of\n"
+           "        the same latencies at the end of the walk.\n"
+           "  --metrics-interval seconds -- time between --metrics\n"
+           "        snapshots.  Default: 10\n"
+           "  -j N -- walk N directories at once using N threads, keeping up\n"
+           "        to N metadata requests in flight.  With -u or -U, also\n"
+           "        write up to N usage reports at once.  At most 1024.\n"
+           "        Default: 1\n"
+           "  -B bytes -- size of each thread's directory reading buffer.\n"
+           "        Larger buffers mean fewer readdir requests for large\n"
+           "        directories.  At most 1 GiB.  Default: 1048576 (1 MiB)\n"
+           "  --checkpoint file -- periodically save the state of the walk\n"
+           "        to this file, so that it can be resumed after a crash.\n"
+           "        SIGUSR1 requests a checkpoint now; SIGTERM requests one\n"
+           "        and then exits.  The file is removed when the walk ends.\n"
+           "  --checkpoint-interval seconds -- time between checkpoints.\n"
+           "        Default: 3600\n"
+           "  --resume -- continue the walk saved in the --checkpoint file\n"
+           "        instead of starting over.  All other arguments must be\n"
+           "        the same as for the run that wrote the checkpoint.\n"
            "  -h -- print this help message and exit.\n",
            exename);
   if(message)
@@ -672,13 +1696,122 @@ void usage(const char *exename,const char *message) {
   fail("Exit did not exit: %s\n",strerror(errno));
 }
 
+/* count_arg: parses arg, the argument of option -opt, as a whole
+   number from min to max.  Anything else is an error, reported with
+   usage. */
+static long count_arg(const char *exename,char opt,const char *arg,long min,long max) {
+  static char message[200];
+  char *end;
+  long n;
+  errno=0;
+  n=strtol(arg,&end,10);
+  if(errno || end==arg || *end || n<min || n>max) {
+    snprintf(message,sizeof(message),"\n\nERROR: -%c needs a whole number from %ld to %ld.\n",
+             opt,min,max);
+    usage(exename,message);
+  }
+  return n;
+}
+
+#ifdef ENABLE_DELETION
+/* parse_list: reads a comma-separated list of up to max numbers from
+   arg into values.  Returns the number read, or 0 if arg is not such
+   a list. */
+static size_t parse_list(const char *arg,double *values,size_t max) {
+  size_t n=0;
+  char *end;
+  for(;;) {
+    if(n>=max)
+      return 0;
+    values[n++]=strtod(arg,&end);
+    if(end==arg || (*end && *end!=','))
+      return 0;
+    if(!*end)
+      return n;
+    arg=end+1;
+  }
+}
+
+/* plan_simulation: makes the purge simulation's candidates from
+   every combination of the --simulate-purge ages and
+   --simulate-depths depths.  Ages and depths are clamped as -d and
+   -D clamp them. */
+static void plan_simulation(const char *exename) {
+  double days[MAX_SIM_CANDIDATES], depths[MAX_SIM_CANDIDATES];
+  size_t ndays, ndepths, i, j;
+  if(!(ndays=parse_list(sim_days,days,MAX_SIM_CANDIDATES)))
+    usage(exename,"\n\nERROR: --simulate-purge must be a list of at most 64 ages in days.\n");
+  if(!sim_depths) {
+    depths[0]=delete_min_depth;
+    ndepths=1;
+  } else if(!(ndepths=parse_list(sim_depths,depths,MAX_SIM_CANDIDATES)))
+    usage(exename,"\n\nERROR: --simulate-depths must be a list of at most 64 depths.\n");
+  if(ndays*ndepths>MAX_SIM_CANDIDATES)
+    usage(exename,"\n\nERROR: at most 64 purge candidates (ages times depths) can be simulated.\n");
+  if(delete_files)
+    usage(exename,"\n\nERROR: --simulate-purge cannot be used with -d.\n");
+#ifdef ENABLE_DISK_USAGE
+  if(!disk_usage)
+#endif
+    usage(exename,"\n\nERROR: --simulate-purge requires -u or -U.\n");
+  for(i=0;i<ndays;i++)
+    for(j=0;j<ndepths;j++) {
+      sim_age[nsim]=days[i]*24*3600;
+      if(sim_age[nsim]<=0)
+        sim_age[nsim]=1;
+      sim_min_depth[nsim]=depths[j];
+      if(sim_min_depth[nsim]<1)
+        sim_min_depth[nsim]=1;
+      nsim++;
+    }
+#ifdef ENABLE_DISK_USAGE
+  us_set_purge_candidates(nsim,sim_age,sim_min_depth);
+#endif
+}
+#endif /* ENABLE_DELETION */
+
 /**********************************************************************/
 /**  MAIN PROGRAM  ****************************************************/
 /**********************************************************************/
 
 
+/* Long options, which have no single-letter equivalents: */
+enum { OPT_CHECKPOINT=256, OPT_CHECKPOINT_INTERVAL, OPT_RESUME, OPT_INDEX, OPT_INDEX_EXACT,
+       OPT_RENAME_WINDOW, OPT_PASSWD_FILE, OPT_GROUP_FILE, OPT_LIST_FORMAT, OPT_TOP,
+       OPT_SIMULATE_PURGE, OPT_SIMULATE_DEPTHS, OPT_SORT_REPORTS, OPT_TARGET_LATENCY,
+       OPT_METRICS, OPT_METRICS_INTERVAL, OPT_LAYOUTS, OPT_LAYOUT_REQUESTS };
+static const struct option long_options[]={
+  { "checkpoint",          required_argument, NULL, OPT_CHECKPOINT },
+  { "checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+  { "resume",              no_argument,       NULL, OPT_RESUME },
+  { "target-latency",      required_argument, NULL, OPT_TARGET_LATENCY },
+  { "metrics",             required_argument, NULL, OPT_METRICS },
+  { "metrics-interval",    required_argument, NULL, OPT_METRICS_INTERVAL },
+#ifdef ENABLE_DISK_USAGE
+  { "index",               required_argument, NULL, OPT_INDEX },
+  { "index-exact",         no_argument,       NULL, OPT_INDEX_EXACT },
+  { "passwd-file",         required_argument, NULL, OPT_PASSWD_FILE },
+  { "group-file",          required_argument, NULL, OPT_GROUP_FILE },
+  { "list-format",         required_argument, NULL, OPT_LIST_FORMAT },
+  { "top",                 required_argument, NULL, OPT_TOP },
+  { "sort-reports",        no_argument,       NULL, OPT_SORT_REPORTS },
+  { "layouts",             no_argument,       NULL, OPT_LAYOUTS },
+  { "layout-requests",     no_argument,       NULL, OPT_LAYOUT_REQUESTS },
+#endif
+#ifdef ENABLE_DELETION
+  { "simulate-purge",      required_argument, NULL, OPT_SIMULATE_PURGE },
+  { "simulate-depths",     required_argument, NULL, OPT_SIMULATE_DEPTHS },
+#endif
+#ifdef ENABLE_CHECK_DUP
+  { "rename-window",       required_argument, NULL, OPT_RENAME_WINDOW },
+#endif
+  { NULL, 0, NULL, 0 }
+};
+
 int main(int argc,char **argv) {
-  int opt,arg, have_set_lustre_stat=0, need_sizes_times=0;
+  int opt,arg, have_set_lustre_stat=0, need_sizes_times=0, use_statx=0, resume=0;
+  int outputs_ok=1; /* 0 if the index or a report could not be written */
+  size_t resume_arg=0;
   double end;
 
   /* Calculate argument list to send to getopt */
@@ -692,13 +1825,16 @@ int main(int argc,char **argv) {
 #ifdef ENABLE_DELETION
     "d:D:"
 #endif
-    "g:qt:vlr:hL";
+#ifdef ENABLE_CHECK_DUP
+    "n"
+#endif
+    "g:qt:vlr:hLXA:j:B:";
   const char *rstprod=NULL,*xml_pre="./";
 
   setlinebuf(stdout);
 
   /* Loop over all dash options, processing them via getopt */
-  while((opt=getopt(argc,argv,arglist))!=-1) {
+  while((opt=getopt_long(argc,argv,arglist,long_options,NULL))!=-1) {
     switch(opt) {
     case 'g': required_gid=gid_for(optarg); break;
     case 'r':
@@ -714,6 +1850,17 @@ int main(int argc,char **argv) {
       set_use_lustre_stat(0); 
       have_set_lustre_stat=1;
       break;
+    case 'X':
+      set_use_lustre_stat(0);
+      have_set_lustre_stat=1;
+      use_statx=1;
+      break;
+    case 'A':
+      set_use_lustre_stat(0);
+      have_set_lustre_stat=1;
+      use_statx=1;
+      ring_depth=(unsigned)count_arg(argv[0],'A',optarg,1,MAX_RING_DEPTH);
+      break;
     case 'v': increment_verbosity(); break;
     case 'q': set_verbosity(VERB_FATAL); break;
 #ifdef ENABLE_SPEED_STATS
@@ -736,6 +1883,26 @@ int main(int argc,char **argv) {
       break;
     case 'x': xml_pre=optarg; break;
     case 'F': us_list_all_files(1); break;
+    case OPT_INDEX: index_file=optarg; break;
+    case OPT_INDEX_EXACT: index_exact=1; break;
+    case OPT_PASSWD_FILE: passwd_file=optarg; break;
+    case OPT_GROUP_FILE: group_file=optarg; break;
+    case OPT_TOP:
+      us_set_top_files(atoll(optarg)>0 ? (size_t)atoll(optarg) : 0);
+      break;
+    case OPT_SORT_REPORTS: us_sort_reports(1); break;
+    case OPT_LAYOUTS: layouts=1; break;
+    case OPT_LAYOUT_REQUESTS: layouts=1; layout_requests=1; break;
+    case OPT_LIST_FORMAT:
+      if(!strcmp(optarg,"binary"))
+        us_list_format(FL_BINARY);
+      else if(!strcmp(optarg,"columns"))
+        us_list_format(FL_COLUMNS);
+      else if(!strcmp(optarg,"text"))
+        us_list_format(FL_TEXT);
+      else
+        usage(argv[0],"\n\nERROR: --list-format must be text, binary or columns.\n");
+      break;
 #endif /* ENABLE_DISK_USAGE */
 #ifdef ENABLE_DELETION
     case 'd':
@@ -750,11 +1917,43 @@ int main(int argc,char **argv) {
       if(delete_min_depth<1)
         delete_min_depth=1;
       break;
+    case OPT_SIMULATE_PURGE:
+      sim_days=optarg;
+      need_sizes_times=1;
+      break;
+    case OPT_SIMULATE_DEPTHS: sim_depths=optarg; break;
 #endif
 #ifdef ENABLE_CHECK_DUP
     case 'n': check_dup=0; break;
+    case OPT_RENAME_WINDOW: rename_window=atof(optarg); break;
 #endif
     case 't': throttle_rate=atoi(optarg); break;
+    case OPT_TARGET_LATENCY:
+      target_latency=atof(optarg)/1e3;
+      if(!(target_latency>0))
+        usage(argv[0],"\n\nERROR: --target-latency must be positive.\n");
+      break;
+    case 'j':
+      nthreads=(size_t)count_arg(argv[0],'j',optarg,1,MAX_THREADS);
+      break;
+    case 'B':
+      dir_buffer_size=(size_t)count_arg(argv[0],'B',optarg,1,MAX_DIR_BUFFER);
+      if(dir_buffer_size<DR_MIN_BUFFER)
+        dir_buffer_size=DR_MIN_BUFFER;
+      break;
+    case OPT_CHECKPOINT: checkpoint_file=optarg; break;
+    case OPT_CHECKPOINT_INTERVAL:
+      checkpoint_interval=atof(optarg);
+      if(checkpoint_interval<1)
+        checkpoint_interval=1;
+      break;
+    case OPT_RESUME: resume=1; break;
+    case OPT_METRICS: metrics_file=optarg; break;
+    case OPT_METRICS_INTERVAL:
+      metrics_interval=atof(optarg);
+      if(metrics_interval<1)
+        metrics_interval=1;
+      break;
 
     default:  usage(argv[0],"Invalid argument given.\n");
     }
@@ -763,12 +1962,66 @@ int main(int argc,char **argv) {
   /* Check arguments */
   if(optind>=argc)
     usage(argv[0],"\n\nERROR: Specify at least one directory.\n");
+  if(resume && !checkpoint_file)
+    usage(argv[0],"\n\nERROR: --resume requires --checkpoint.\n");
+  walk_args=argv+optind;
+  nwalk_args=argc-optind;
 
   if(rstprod_gid!=INVALID_GID)
     init_acls(rstprod);
 
+  /* Assume less than MIN_THROTTLE files per second means "don't
+     throttle" */
+  if(throttle_rate>=MIN_THROTTLE) {
+    if(throttle_rate>MAX_THROTTLE) {
+      warn("Changing to maximum allowed throttle of %d files per second.\n",MAX_THROTTLE);
+      throttle_rate=MAX_THROTTLE;
+    }
+    th_init(throttle_rate,target_latency);
+    throttling=1;
+  }
+  timing=throttling || metrics_file
+#ifdef ENABLE_SPEED_STATS
+    || print_stats
+#endif
+    ;
+
+#ifdef ENABLE_DELETION
+  if(sim_days)
+    plan_simulation(argv[0]);
+  else if(sim_depths)
+    usage(argv[0],"\n\nERROR: --simulate-depths requires --simulate-purge.\n");
+#endif
 #ifdef ENABLE_DISK_USAGE
-  if(disk_usage)
+  /* The incremental index only knows about usage, so every other
+     feature needs a full scan. */
+  if(index_file && !disk_usage)
+    usage(argv[0],"\n\nERROR: --index requires -u or -U.\n");
+  if(index_file && (required_gid!=INVALID_GID || rstprod_gid!=INVALID_GID
+                    || us_get_list_all_files()
+#ifdef ENABLE_DELETION
+                    || delete_files || nsim
+#endif
+                    ))
+    usage(argv[0],"\n\nERROR: --index cannot be used with -g, -r, -d, -F or --simulate-purge.\n");
+  /* Layouts are counted with the usage, and the index has none.
+     They come with the Lustre stat (-l), unless --layout-requests
+     asks for a request of their own. */
+  if(layouts && !disk_usage)
+    usage(argv[0],"\n\nERROR: --layouts requires -u or -U.\n");
+  if(layouts && index_file)
+    usage(argv[0],"\n\nERROR: --layouts cannot be used with --index.\n");
+  if(layouts && !layout_requests && !(have_set_lustre_stat && get_use_lustre_stat()))
+    usage(argv[0],"\n\nERROR: --layouts requires -l.  Use --layout-requests to keep the exact stat instead, at one more request per file.\n");
+  if(layout_requests && have_set_lustre_stat && get_use_lustre_stat())
+    usage(argv[0],"\n\nERROR: --layout-requests cannot be used with -l.\n");
+  if(layouts)
+    us_account_layouts(1);
+  if(passwd_file || group_file)
+    us_load_names(passwd_file,group_file);
+  if(index_file)
+    us_index_start(index_file,!index_exact);
+  if(disk_usage && !resume) /* when resuming, restore_checkpoint reopens them */
     us_start_reports(xml_pre,start_time,MAX_PATH_DEPTH);
 #endif /* ENABLE_DISK_USAGE */
 
@@ -781,10 +2034,25 @@ int main(int argc,char **argv) {
   if(delete_files && get_use_lustre_stat()) {
     fail("Error: when deleting files, you must not use -l (enable Lustre stat).  Lustre's metadata server has very out-of-date timestamps, so many files that should not be deleted, will be deleted, with -l.\n");
   }
+  if(nsim && get_use_lustre_stat()) {
+    fail("Error: when simulating purges, you must not use -l (enable Lustre stat).  The simulated purge ages need exact mtimes, and Lustre's metadata server has very out-of-date timestamps, so the simulation would count files that -d would not delete.\n");
+  }
 #endif /* ENABLE_DELETION */
 
+  /* Decide what we need to stat */
+  plan_stat();
+  if(use_statx && !get_use_lustre_stat())
+    plan_statx();
+
+  /* Set up the walker threads */
+  if(nthreads>1)
+    raise_fd_limit();
+  walk_queue=tq_create(nthreads,run_dir);
+
   /* Record walking start time */
   start_time=fulltime();
+  if(metrics_file)
+    mt_start(metrics_file,metrics_interval,walk_metrics);
 
 #ifdef ENABLE_DISK_USAGE
   if(disk_usage && disk_usage_all)
@@ -792,37 +2060,107 @@ int main(int argc,char **argv) {
       us_add_dir(argv[arg]);
 #endif /* ENABLE_DISK_USAGE */
 
-  /* Loop over all given directories */
-  for(arg=optind;arg<argc;arg++)
-    walk(argv[arg]);
+  /* Set up checkpointing, and restore the last checkpoint if asked */
+  if(checkpoint_file) {
+    signal(SIGUSR1,checkpoint_signal);
+    signal(SIGTERM,checkpoint_signal);
+    if(resume)
+      resume_arg=restore_checkpoint(xml_pre);
+    next_checkpoint=fulltime()+checkpoint_interval;
+  }
+
+#ifdef ENABLE_CHECK_DUP
+  if(check_dup)
+    hit_file_policy(start_time,rename_window);
+#endif
+
+  /* Loop over all given directories.  When resuming, skip those that
+     were finished before the checkpoint, and continue the one that
+     was in progress from the restored frontier. */
+  for(arg=optind;arg<argc;arg++) {
+    walk_arg=arg-optind;
+    if(resume && walk_arg<resume_arg)
+      continue;
+    else if(resume && walk_arg==resume_arg)
+      tq_run(walk_queue);
+    else
+      walk(argv[arg]);
+  }
 
   /* Record walking end time */
   end=fulltime();
+  tq_destroy(walk_queue);
+  mt_stop();
+
+  /* Nothing reads checkpoint requests after the walk, so SIGTERM
+     and SIGUSR1 go back to their defaults.  A SIGTERM that came too
+     late for the walk to act on still stops us, and leaves the
+     checkpoint in place. */
+  if(checkpoint_file) {
+    signal(SIGUSR1,SIG_DFL);
+    signal(SIGTERM,SIG_DFL);
+    if(checkpoint_request==CKPT_REQUEST_EXIT)
+      fail("%s: exiting due to SIGTERM before writing the reports.  Use --resume to continue from the last checkpoint, if one was written.\n",
+           checkpoint_file);
+  }
 
-  /* Generate XML usage reports */
+  /* Generate XML usage reports, and keep the new index */
 #ifdef ENABLE_DISK_USAGE
-  if(disk_usage)
-    us_generate_reports(xml_pre,start_time,end,MAX_PATH_DEPTH);
+  if(index_file && us_index_finish())
+    outputs_ok=0;
+  if(disk_usage) {
+    us_report_threads(nthreads);
+    if(us_generate_reports(xml_pre,start_time,end,MAX_PATH_DEPTH))
+      outputs_ok=0;
+  }
 #endif /* ENABLE_DISK_USAGE */
 
+  /* The walk is complete and its results are written, so there is
+     nothing to resume.  If they are not all written, keep the
+     checkpoint so that --resume can make them again. */
+  if(checkpoint_file && !outputs_ok)
+    warn("%s: keeping checkpoint, since the index or reports are incomplete.  Use --resume to make them again.\n",
+         checkpoint_file);
+  else if(checkpoint_file && unlink(checkpoint_file) && errno!=ENOENT)
+    warn("%s: cannot remove checkpoint: %s\n",checkpoint_file,strerror(errno));
+
   /* Output final speed statistics, if requested */
 #ifdef ENABLE_SPEED_STATS
   if(print_stats) {
-    printf("Processed %llu files in %f seconds, sleeping %llu seconds (%f files per second) %s\n",
-           (unsigned long long)file_count,end-start_time,(unsigned long long)sleep_time,
-           file_count/(end-start_time-sleep_time),
-           ( (get_use_lustre_stat()) ? ("using Lustre stat") : ("using full stat") )
+    printf("Processed %llu files in %f seconds, sleeping %f thread-seconds (%f files per second) %s\n",
+           (unsigned long long)file_count,end-start_time,th_sleep_time(),
+           file_count/busy_time(end),
+           ( (get_use_lustre_stat()) ? ("using Lustre stat") :
+             (get_statx_mask() ? ("using statx") : ("using full stat")) )
            );
     printf("  setgid         ... %llu times\n"
            "  chgrp          ... %llu times\n"
            "  tagged rstprod ... %llu times\n"
            "  entered dirs   ... %llu times\n"
-           "  deleted things ... %llu times\n",
+           "  deleted things ... %llu times\n"
+           "  stats avoided  ... %llu times\n"
+           "  indexed dirs   ... %llu times\n"
+           "  indexed files  ... %llu times\n"
+           "  dups untracked ... %llu times\n",
            (unsigned long long)setgid_count,
            (unsigned long long)chgrp_count,
            (unsigned long long)acl_count,
            (unsigned long long)dir_count,
-           (unsigned long long)del_count);
+           (unsigned long long)del_count,
+           (unsigned long long)stat_skip_count,
+           (unsigned long long)index_dir_count,
+           (unsigned long long)index_file_count,
+           (unsigned long long)untracked_count);
+    mt_summary(stdout);
+#ifdef ENABLE_CHECK_DUP
+    if(check_dup) {
+      size_t hit_files,hit_bytes;
+      hit_file_stats(&hit_files,&hit_bytes);
+      printf("  duplicate file table holds %llu files in %llu bytes (%.1f bytes/file)\n",
+             (unsigned long long)hit_files,(unsigned long long)hit_bytes,
+             hit_files ? (double)hit_bytes/hit_files : 0.0);
+    }
+#endif
   }
 #endif
   return 0;
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "basic_utils.h"
+#include "metrics.h"
+
+/* op_names -- the op label of each mt_op in snapshots and summaries */
+static const char *const op_names[MT_NOPS]={
+  "readdir", "stat", "statx", "lustre_stat", "opendir", "unlink", "chmod", "chown", "acl"
+};
+
+/* counts -- the histogram of each kind of operation.  nanos -- the
+   total time of each kind, in nanoseconds.  Both are only updated
+   with atomic adds. */
+static size_t counts[MT_NOPS][MT_BUCKETS];
+static uint64_t nanos[MT_NOPS];
+
+/* Snapshot thread state, protected by lock:
+     path -- where snapshots go, or NULL if mt_start was not called
+     interval -- seconds between snapshots
+     extra -- mt_start's callback
+     stopping -- set by mt_stop to end the thread */
+static const char *path=NULL;
+static double interval=0;
+static void (*extra)(FILE *f)=NULL;
+static int stopping=0;
+static pthread_t thread;
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond=PTHREAD_COND_INITIALIZER;
+
+double mt_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+unsigned mt_bucket(double seconds) {
+  uint64_t us;
+  unsigned octave, frac, b;
+  if(!(seconds>=1e-6))
+    return 0;
+  us=(seconds>=4e15) ? ~(uint64_t)0 : (uint64_t)(seconds*1e6);
+  octave=63-__builtin_clzll(us);
+  frac=(octave>=2) ? (unsigned)(us>>(octave-2))&3 : (unsigned)(us<<(2-octave))&3;
+  b=1+4*octave+frac;
+  return b<MT_BUCKETS ? b : MT_BUCKETS-1;
+}
+
+double mt_bucket_top(unsigned b) {
+  if(!b)
+    return 1e-6;
+  return (5+(b-1)%4)*(double)(((uint64_t)1)<<((b-1)/4))/4*1e-6;
+}
+
+void mt_record(mt_op op,double seconds) {
+  __sync_fetch_and_add(&counts[op][mt_bucket(seconds)],1);
+  if(seconds>0)
+    __sync_fetch_and_add(&nanos[op],(uint64_t)(seconds*1e9));
+}
+
+/* total -- the number of op recorded so far */
+static size_t total(mt_op op) {
+  size_t n=0;
+  unsigned b;
+  for(b=0;b<MT_BUCKETS;b++)
+    n+=counts[op][b];
+  return n;
+}
+
+double mt_quantile(mt_op op,double q) {
+  size_t n=total(op), sum=0;
+  unsigned b;
+  if(!n)
+    return 0;
+  for(b=0;b<MT_BUCKETS-1;b++)
+    if((sum+=counts[op][b])>=q*n)
+      break;
+  return mt_bucket_top(b);
+}
+
+void mt_gauge(FILE *f,const char *name,const char *type,const char *help,double value) {
+  fprintf(f,"# HELP %s %s\n# TYPE %s %s\n%s %.10g\n",name,help,name,type,name,value);
+}
+
+/* write_histograms -- write every histogram to f as one Prometheus
+   histogram, with the operation as a label.  Only the bucket
+   boundaries at powers of two microseconds are written, so that every
+   snapshot has the same buckets and the file stays small. */
+static void write_histograms(FILE *f) {
+  unsigned op,b;
+  size_t sum;
+  fprintf(f,"# HELP lustre_walker_op_seconds Latency of metadata operations.\n"
+          "# TYPE lustre_walker_op_seconds histogram\n");
+  for(op=0;op<MT_NOPS;op++) {
+    sum=0;
+    for(b=0;b<MT_BUCKETS;b++) {
+      sum+=counts[op][b];
+      if(b%4==0 && b<MT_BUCKETS-1)
+        fprintf(f,"lustre_walker_op_seconds_bucket{op=\"%s\",le=\"%.10g\"} %llu\n",
+                op_names[op],mt_bucket_top(b),(unsigned long long)sum);
+    }
+    fprintf(f,"lustre_walker_op_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n"
+            "lustre_walker_op_seconds_sum{op=\"%s\"} %.9f\n"
+            "lustre_walker_op_seconds_count{op=\"%s\"} %llu\n",
+            op_names[op],(unsigned long long)sum,
+            op_names[op],nanos[op]*1e-9,
+            op_names[op],(unsigned long long)sum);
+  }
+}
+
+/* write_snapshot -- write a snapshot to a temporary file next to
+   path, then rename it over path, so a scraper never sees half a
+   snapshot.  Failures are warned about, but do not stop the walk. */
+static void write_snapshot(void) {
+  size_t len=strlen(path);
+  char *tmp=(char*)malloc(len+5);
+  FILE *f;
+  if(!tmp)
+    fail("Cannot allocate %llu bytes: %s\n",(unsigned long long)(len+5),strerror(errno));
+  memcpy(tmp,path,len);
+  memcpy(tmp+len,".tmp",5);
+  if(!(f=fopen(tmp,"w")))
+    warn("%s: cannot write metrics: %s\n",tmp,strerror(errno));
+  else {
+    write_histograms(f);
+    if(extra)
+      extra(f);
+    if(ferror(f) | fclose(f))
+      warn("%s: cannot write metrics: %s\n",tmp,strerror(errno));
+    else if(rename(tmp,path))
+      warn("%s: cannot rename metrics to %s: %s\n",tmp,path,strerror(errno));
+  }
+  free(tmp);
+}
+
+/* snapshot_thread -- writes a snapshot every interval seconds until
+   mt_stop */
+static void *snapshot_thread(void *arg) {
+  struct timespec when;
+  double next=0;
+  (void)arg;
+  pthread_mutex_lock(&lock);
+  while(!stopping) {
+    if(!next)
+      next=fulltime()+interval;
+    when.tv_sec=(time_t)next;
+    when.tv_nsec=(long)((next-when.tv_sec)*1e9);
+    if(pthread_cond_timedwait(&stop_cond,&lock,&when)==ETIMEDOUT) {
+      pthread_mutex_unlock(&lock);
+      write_snapshot();
+      pthread_mutex_lock(&lock);
+      next=0;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void mt_start(const char *where,double seconds,void (*callback)(FILE *f)) {
+  int err;
+  path=where;
+  interval=seconds;
+  extra=callback;
+  write_snapshot();
+  if((err=pthread_create(&thread,NULL,snapshot_thread,NULL)))
+    fail("Cannot create metrics thread: %s\n",strerror(err));
+}
+
+void mt_stop(void) {
+  if(!path)
+    return;
+  pthread_mutex_lock(&lock);
+  stopping=1;
+  pthread_cond_signal(&stop_cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread,NULL);
+  write_snapshot();
+  path=NULL;
+}
+
+void mt_summary(FILE *f) {
+  unsigned op;
+  size_t n;
+  fprintf(f,"  operation        count    mean ms     p50 ms     p95 ms     p99 ms\n");
+  for(op=0;op<MT_NOPS;op++)
+    if((n=total(op)))
+      fprintf(f,"  %-11s %10llu %10.3f %10.3f %10.3f %10.3f\n",op_names[op],
+              (unsigned long long)n,nanos[op]*1e-6/n,
+              mt_quantile(op,0.5)*1e3,mt_quantile(op,0.95)*1e3,mt_quantile(op,0.99)*1e3);
+}
@@ -0,0 +1,91 @@
+#ifndef INC_METRICS
+#define INC_METRICS
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Per-operation latency metrics.  The walker times each metadata
+     operation it makes and records it in a histogram for that kind
+     of operation, so that a slow walk can be traced to the operation
+     that is slow: directory reads, stats, or the changes made with
+     -d, -g and -r.  Stats done through io_uring (-A) are timed from
+     when each is queued until its completion is collected.
+
+     A histogram has one bucket for latencies under a microsecond,
+     then four per power of two microseconds, so each bucket is at
+     most 25% wide, up to 2^32 microseconds (over an hour); the last
+     bucket holds anything longer.  Recording is a few instructions
+     and one atomic add, with no locks, so any thread may record at
+     any time.
+
+     With mt_start, a snapshot of all histograms is written
+     periodically in the Prometheus text exposition format, for a
+     local scraper (such as node_exporter's textfile collector) to
+     pick up.  Each snapshot replaces the last one atomically. */
+
+  /* mt_op -- the kinds of operations timed */
+  typedef enum {
+    MT_READDIR,     /* one batch of directory entries (getdents64) */
+    MT_STAT,        /* fstatat */
+    MT_STATX,       /* statx */
+    MT_LUSTRE_STAT, /* Lustre's IOC_MDC_GETFILEINFO ioctl */
+    MT_OPENDIR,     /* opening a subdirectory */
+    MT_UNLINK,      /* unlinkat, of a file or directory (-d) */
+    MT_CHMOD,       /* fchmodat, to set the setgid bit (-g) */
+    MT_CHOWN,       /* fchownat, to change the group (-g) */
+    MT_ACL,         /* acl_set_file (-r) */
+    MT_NOPS
+  } mt_op;
+
+#define MT_BUCKETS (1+4*32)
+
+  /* mt_now -- monotonic clock in seconds, for timing operations */
+  double mt_now(void);
+
+  /* mt_bucket -- the histogram bucket for a latency in seconds */
+  unsigned mt_bucket(double seconds);
+
+  /* mt_bucket_top -- the upper end of bucket b, in seconds */
+  double mt_bucket_top(unsigned b);
+
+  /* mt_record -- record that an operation took this many seconds */
+  void mt_record(mt_op op,double seconds);
+
+  /* mt_quantile -- the q quantile (0<=q<=1) of op's latencies so far,
+     as the upper end of the bucket it falls in, or 0 if op has not
+     been recorded */
+  double mt_quantile(mt_op op,double q);
+
+  /* mt_gauge -- write one metric to a snapshot, with its HELP and
+     TYPE lines.  For use by mt_start's extra callback. */
+  void mt_gauge(FILE *f,const char *name,const char *type,const char *help,double value);
+
+  /* mt_start -- write a snapshot to path every interval seconds, from
+     a thread of its own, until mt_stop.  If extra is non-NULL, it is
+     called to add more metrics (with mt_gauge) to each snapshot. */
+  void mt_start(const char *path,double interval,void (*extra)(FILE *f));
+
+  /* mt_stop -- write a final snapshot and stop the thread started by
+     mt_start, if any */
+  void mt_stop(void);
+
+  /* mt_summary -- print a table of the count, mean and 50th, 95th and
+     99th percentile latency of each kind of operation seen */
+  void mt_summary(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_METRICS */
@@ -30,13 +30,13 @@ size_t assert_length(const char *str,size_t min,size_t max,const char *what,int
   len=strnlen(str,max+1);
   if(len<min) {
     if(should_fail)
-      fail("%*s: %s invalid: has less than %llu character(s)",str,(int)len,what,(unsigned long long)min);
+      fail("%.*s: %s invalid: has less than %llu character(s)",(int)len,str,what,(unsigned long long)min);
     else
       return BAD_LEN;
   }
   if(len>max) {
     if(should_fail)
-      fail("%*s...: %s invalid: has more than %llu characters",str,(int)max,what,(unsigned long long)max);
+      fail("%.*s...: %s invalid: has more than %llu characters",(int)max,str,what,(unsigned long long)max);
     else
       return BAD_LEN;
   }
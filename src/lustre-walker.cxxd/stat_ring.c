@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "basic_utils.h"
+#include "stat_ring.h"
+#include "metrics.h"
+
+/* HAVE_STAT_RING -- defined if this system's headers have both
+   io_uring and statx.  Otherwise sr_create always fails, and the
+   walker uses synchronous stats. */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(STATX_BASIC_STATS) && defined(__NR_io_uring_setup)
+#define HAVE_STAT_RING
+#endif
+#endif
+
+#ifdef HAVE_STAT_RING
+
+#include <linux/io_uring.h>
+
+struct stat_ring {
+  int fd;                   /* io_uring file descriptor */
+  unsigned depth;           /* number of submission queue entries */
+
+  /* Submission queue, shared with the kernel: */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+
+  /* Completion queue, shared with the kernel: */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Mappings, for sr_destroy: */
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+
+  /* Per-request state.  A slot is in use from submission until its
+     completion is handled.  The kernel writes the result to
+     results[slot], and the completion's user_data is the slot. */
+  struct statx *results;
+  const dir_entry **slot_ent;  /* entry being statted in each slot */
+  double *queued;              /* mt_now when each slot was queued */
+  unsigned *free_slots;        /* stack of unused slots */
+  unsigned nfree;
+};
+
+static int ring_setup(unsigned entries,struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int ring_enter(int fd,unsigned to_submit,unsigned min_complete,unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,NULL,0);
+}
+
+/* statx_supported -- asks the kernel whether the ring can do
+   IORING_OP_STATX.  Kernels too old to have the probe are also too
+   old to have the operation. */
+static int statx_supported(int fd) {
+  size_t len=sizeof(struct io_uring_probe)+256*sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe=(struct io_uring_probe*)calloc(1,len);
+  int ok=0;
+  if(!probe)
+    fail("Cannot allocate %llu bytes: %s\n",(unsigned long long)len,strerror(errno));
+  if(!syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256))
+    ok=(probe->last_op>=IORING_OP_STATX
+        && (probe->ops[IORING_OP_STATX].flags&IO_URING_OP_SUPPORTED));
+  free(probe);
+  return ok;
+}
+
+stat_ring *sr_create(unsigned depth) {
+  struct io_uring_params p;
+  stat_ring *r;
+  unsigned i;
+  int fd;
+
+  memset(&p,0,sizeof(p));
+  if((fd=ring_setup(depth,&p))<0)
+    return NULL;
+  if(!statx_supported(fd)) {
+    close(fd);
+    errno=ENOSYS;
+    return NULL;
+  }
+
+  if(!(r=(stat_ring*)calloc(1,sizeof(stat_ring))))
+    fail("Cannot allocate %llu bytes: %s\n",
+         (unsigned long long)sizeof(stat_ring),strerror(errno));
+  r->fd=fd;
+  r->depth=p.sq_entries;
+
+  /* Map the rings.  Newer kernels put both in one mapping. */
+  r->sq_len=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  r->cq_len=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features&IORING_FEAT_SINGLE_MMAP) {
+    if(r->cq_len>r->sq_len)
+      r->sq_len=r->cq_len;
+    r->cq_len=0;
+  }
+  r->sq_ptr=mmap(NULL,r->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+  if(r->sq_ptr==MAP_FAILED)
+    fail("Cannot map io_uring submission queue: %s\n",strerror(errno));
+  if(r->cq_len) {
+    r->cq_ptr=mmap(NULL,r->cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+    if(r->cq_ptr==MAP_FAILED)
+      fail("Cannot map io_uring completion queue: %s\n",strerror(errno));
+  } else
+    r->cq_ptr=r->sq_ptr;
+  r->sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sqes=(struct io_uring_sqe*)mmap(NULL,r->sqes_len,PROT_READ|PROT_WRITE,
+                                     MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+  if(r->sqes==MAP_FAILED)
+    fail("Cannot map io_uring submission entries: %s\n",strerror(errno));
+
+  r->sq_head=(unsigned*)((char*)r->sq_ptr+p.sq_off.head);
+  r->sq_tail=(unsigned*)((char*)r->sq_ptr+p.sq_off.tail);
+  r->sq_mask=(unsigned*)((char*)r->sq_ptr+p.sq_off.ring_mask);
+  r->sq_array=(unsigned*)((char*)r->sq_ptr+p.sq_off.array);
+  r->cq_head=(unsigned*)((char*)r->cq_ptr+p.cq_off.head);
+  r->cq_tail=(unsigned*)((char*)r->cq_ptr+p.cq_off.tail);
+  r->cq_mask=(unsigned*)((char*)r->cq_ptr+p.cq_off.ring_mask);
+  r->cqes=(struct io_uring_cqe*)((char*)r->cq_ptr+p.cq_off.cqes);
+
+  /* Per-request state.  The completion queue is at least as large as
+     the submission queue, so it cannot overflow when at most depth
+     requests are in flight. */
+  r->results=(struct statx*)malloc(r->depth*sizeof(struct statx));
+  r->slot_ent=(const dir_entry**)malloc(r->depth*sizeof(const dir_entry*));
+  r->queued=(double*)malloc(r->depth*sizeof(double));
+  r->free_slots=(unsigned*)malloc(r->depth*sizeof(unsigned));
+  if(!r->results || !r->slot_ent || !r->queued || !r->free_slots)
+    fail("Cannot allocate memory for %u stat requests: %s\n",r->depth,strerror(errno));
+  for(i=0;i<r->depth;i++)
+    r->free_slots[i]=i;
+  r->nfree=r->depth;
+  return r;
+}
+
+void sr_destroy(stat_ring *r) {
+  if(!r) return;
+  munmap(r->sqes,r->sqes_len);
+  if(r->cq_ptr!=r->sq_ptr)
+    munmap(r->cq_ptr,r->cq_len);
+  munmap(r->sq_ptr,r->sq_len);
+  close(r->fd);
+  free(r->results);
+  free(r->slot_ent);
+  free(r->queued);
+  free(r->free_slots);
+  free(r);
+}
+
+/* queue_statx -- add a statx request for ent to the submission queue.
+   There must be a free slot.  The request is not submitted to the
+   kernel until the next ring_enter. */
+static void queue_statx(stat_ring *r,int dirfd,const dir_entry *ent) {
+  unsigned tail=*r->sq_tail, index=tail&*r->sq_mask, slot;
+  struct io_uring_sqe *sqe=&r->sqes[index];
+  assert(r->nfree);
+  slot=r->free_slots[--r->nfree];
+  r->slot_ent[slot]=ent;
+  r->queued[slot]=mt_now();
+
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode=IORING_OP_STATX;
+  sqe->fd=dirfd;
+  sqe->addr=(uint64_t)(uintptr_t)ent->name;
+  sqe->len=get_statx_mask();
+  sqe->off=(uint64_t)(uintptr_t)&r->results[slot];
+  sqe->statx_flags=(uint32_t)get_statx_flags();
+  sqe->user_data=slot;
+  r->sq_array[index]=index;
+
+  /* Make the entry visible to the kernel before the new tail */
+  __atomic_store_n(r->sq_tail,tail+1,__ATOMIC_RELEASE);
+}
+
+/* reap -- handle every completion that is ready.  now is when
+   ring_enter returned; each stat's time is measured up to then, so
+   that time spent in the callbacks (such as throttle sleeps) is not
+   counted.  Returns the number handled. */
+static unsigned reap(stat_ring *r,double now,sr_callback cb,void *arg) {
+  unsigned head=*r->cq_head, tail=__atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE);
+  unsigned done=0, slot;
+  struct io_uring_cqe *cqe;
+  struct stat sb;
+  int res;
+
+  while(head!=tail) {
+    cqe=&r->cqes[head&*r->cq_mask];
+    slot=(unsigned)cqe->user_data;
+    res=cqe->res;
+    assert(slot<r->depth);
+    head++;
+    /* Release the completion entry before running the callback, which
+       may take a while.  The slot's result stays put until the slot
+       is reused, which cannot happen until we return. */
+    __atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+
+    if(res<0)
+      cb(arg,r->slot_ent[slot],-res,NULL,now-r->queued[slot]);
+    else {
+      statx_to_stat(&r->results[slot],&sb);
+      cb(arg,r->slot_ent[slot],0,&sb,now-r->queued[slot]);
+    }
+    r->free_slots[r->nfree++]=slot;
+    done++;
+  }
+  return done;
+}
+
+void sr_stat_batch(stat_ring *r,int dirfd,const dir_entry *const *ents,size_t n,
+                   sr_callback cb,void *arg) {
+  size_t next=0, completed=0;
+  unsigned unsubmitted=0, done;
+  int ret;
+
+  while(completed<n) {
+    /* Fill any free slots with new requests */
+    while(next<n && r->nfree) {
+      queue_statx(r,dirfd,ents[next++]);
+      unsubmitted++;
+    }
+
+    /* Submit them, and wait for at least one completion.  The kernel
+       may accept fewer requests than we queued; the rest stay in the
+       submission queue for next time. */
+    ret=ring_enter(r->fd,unsubmitted,1,IORING_ENTER_GETEVENTS);
+    if(ret<0) {
+      if(errno==EINTR)
+        continue;
+      if(errno!=EAGAIN && errno!=EBUSY)
+        fail("io_uring_enter failed: %s\n",strerror(errno));
+      /* EBUSY: the completion queue is full.  EAGAIN: the kernel is
+         short of memory for new requests.  Either way, retrying at
+         once would spin, so first handle what has completed.  If
+         nothing has, wait for a request in flight to finish without
+         submitting more, or sleep briefly if none is in flight. */
+      if(!(done=reap(r,mt_now(),cb,arg))) {
+        if(r->depth-r->nfree>unsubmitted)
+          ring_enter(r->fd,0,1,IORING_ENTER_GETEVENTS);
+        else
+          usleep(1000);
+        done=reap(r,mt_now(),cb,arg);
+      }
+      completed+=done;
+      continue;
+    }
+    unsubmitted-=ret;
+
+    completed+=reap(r,mt_now(),cb,arg);
+  }
+  assert(r->nfree==r->depth);
+}
+
+#else /* HAVE_STAT_RING */
+
+/* No io_uring: the walker will fall back to synchronous stats. */
+
+stat_ring *sr_create(unsigned depth) {
+  (void)depth;
+  errno=ENOSYS;
+  return NULL;
+}
+
+void sr_destroy(stat_ring *r) {
+  (void)r;
+}
+
+void sr_stat_batch(stat_ring *r,int dirfd,const dir_entry *const *ents,size_t n,
+                   sr_callback cb,void *arg) {
+  (void)r; (void)dirfd; (void)ents; (void)n; (void)cb; (void)arg;
+  fail("sr_stat_batch called without io_uring support.\n");
+}
+
+#endif /* HAVE_STAT_RING */
@@ -0,0 +1,60 @@
+#ifndef INC_STAT_RING
+#define INC_STAT_RING
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dir_reader.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* stat_ring -- an io_uring instance used to stat many entries of
+     one directory at once.  Instead of waiting for each stat in turn,
+     the walker submits IORING_OP_STATX requests for a whole batch of
+     entries, keeping up to the ring depth in flight, and handles each
+     result as it completes.  This hides metadata server latency
+     without more threads.  Each walker thread needs its own ring.
+
+     The raw io_uring system calls are used, so liburing is not
+     needed.  The statx mask and flags are the ones given to
+     set_statx_mask. */
+  typedef struct stat_ring stat_ring;
+
+  /* sr_callback -- called once per entry as its stat completes.  err
+     is 0 on success, in which case sb holds the result, or an errno
+     value on failure, in which case sb is NULL.  Only the fields
+     requested in the statx mask are guaranteed to be filled in.
+     seconds is how long the stat took: from when it was queued until
+     the kernel returned its completion, measured before any callback
+     of that completion batch runs. */
+  typedef void (*sr_callback)(void *arg,const dir_entry *ent,int err,const struct stat *sb,
+                              double seconds);
+
+  /* sr_create -- set up a ring that can have depth stats in flight.
+     Returns NULL and sets errno if io_uring or IORING_OP_STATX is
+     unavailable, so the caller can fall back to synchronous stats. */
+  stat_ring *sr_create(unsigned depth);
+  void sr_destroy(stat_ring *r);
+
+  /* sr_stat_batch -- stat the n entries in ents, which are relative to
+     the open directory dirfd, calling cb for each one as it
+     completes.  Completion order is not submission order.  Returns
+     once all n callbacks have been made.  System call failures other
+     than interruptions call fail(). */
+  void sr_stat_batch(stat_ring *r,int dirfd,const dir_entry *const *ents,size_t n,
+                     sr_callback cb,void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_STAT_RING */
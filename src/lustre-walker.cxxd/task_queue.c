@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "basic_utils.h"
+#include "task_queue.h"
+
+/* deque -- one worker's double-ended queue of tasks.  This is a
+   growable circular buffer protected by a mutex.  The owner pushes
+   and pops at the bottom; thieves take from the top.  Contention is
+   low since thieves only come calling when they have nothing else to
+   do. */
+typedef struct deque {
+  pthread_mutex_t lock;
+  void **items;  /* circular buffer of tasks */
+  size_t cap;    /* allocated size of items */
+  size_t top;    /* index of the oldest task */
+  size_t count;  /* number of tasks in the deque */
+} deque;
+
+struct task_queue {
+  size_t nthreads;
+  tq_runner runner;
+  deque *deques;       /* one per worker */
+
+  /* queued -- number of tasks sitting in deques.  outstanding --
+     number of tasks pushed but not yet finished running.  Both are
+     modified with atomic builtins.  The walk is over when outstanding
+     reaches zero. */
+  size_t queued, outstanding;
+
+  /* idle workers wait on wakeup, protected by idle_lock */
+  pthread_mutex_t idle_lock;
+  pthread_cond_t wakeup;
+  size_t idle;
+
+  /* Pausing, for tq_pause.  pausing is set (atomically) while a task
+     has the pool paused.  parked is the number of workers waiting
+     between tasks, either idle or paused, and nworkers is the number
+     of workers started by tq_run.  Both are protected by idle_lock.
+     The pausing task waits on parked_cond until every other worker is
+     parked. */
+  int pausing;
+  size_t parked, nworkers;
+  pthread_cond_t parked_cond;
+};
+
+/* worker_index -- index of the worker running in this thread */
+static __thread size_t worker_index=0;
+
+/* Helper routines for deques: */
+
+static void deque_init(deque *d) {
+  pthread_mutex_init(&d->lock,NULL);
+  d->cap=64;
+  d->top=0;
+  d->count=0;
+  if(!(d->items=(void**)malloc(d->cap*sizeof(void*))))
+    fail("Cannot allocate %llu bytes: %s\n",
+         (unsigned long long)(d->cap*sizeof(void*)),strerror(errno));
+}
+
+static void deque_push_bottom(deque *d,void *task) {
+  pthread_mutex_lock(&d->lock);
+  if(d->count==d->cap) {
+    /* Full.  Double the size, unwrapping the circular buffer. */
+    size_t i, newcap=d->cap*2;
+    void **newitems=(void**)malloc(newcap*sizeof(void*));
+    if(!newitems)
+      fail("Cannot allocate %llu bytes: %s\n",
+           (unsigned long long)(newcap*sizeof(void*)),strerror(errno));
+    for(i=0;i<d->count;i++)
+      newitems[i]=d->items[(d->top+i)%d->cap];
+    free(d->items);
+    d->items=newitems;
+    d->cap=newcap;
+    d->top=0;
+  }
+  d->items[(d->top+d->count)%d->cap]=task;
+  d->count++;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static void *deque_pop_bottom(deque *d) {
+  void *task=NULL;
+  pthread_mutex_lock(&d->lock);
+  if(d->count) {
+    d->count--;
+    task=d->items[(d->top+d->count)%d->cap];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+static void *deque_steal_top(deque *d) {
+  void *task=NULL;
+  pthread_mutex_lock(&d->lock);
+  if(d->count) {
+    task=d->items[d->top];
+    d->top=(d->top+1)%d->cap;
+    d->count--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+/**********************************************************************/
+
+task_queue *tq_create(size_t nthreads,tq_runner runner) {
+  task_queue *q;
+  size_t i;
+  assert(runner);
+  if(nthreads<1)
+    nthreads=1;
+  if(!(q=(task_queue*)calloc(1,sizeof(task_queue))))
+    fail("Cannot allocate %llu bytes: %s\n",
+         (unsigned long long)sizeof(task_queue),strerror(errno));
+  if(!(q->deques=(deque*)calloc(nthreads,sizeof(deque))))
+    fail("Cannot allocate %llu bytes: %s\n",
+         (unsigned long long)(nthreads*sizeof(deque)),strerror(errno));
+  for(i=0;i<nthreads;i++)
+    deque_init(&q->deques[i]);
+  q->nthreads=nthreads;
+  q->runner=runner;
+  pthread_mutex_init(&q->idle_lock,NULL);
+  pthread_cond_init(&q->wakeup,NULL);
+  pthread_cond_init(&q->parked_cond,NULL);
+  return q;
+}
+
+void tq_destroy(task_queue *q) {
+  size_t i;
+  if(!q) return;
+  for(i=0;i<q->nthreads;i++) {
+    pthread_mutex_destroy(&q->deques[i].lock);
+    free(q->deques[i].items);
+  }
+  free(q->deques);
+  pthread_mutex_destroy(&q->idle_lock);
+  pthread_cond_destroy(&q->wakeup);
+  pthread_cond_destroy(&q->parked_cond);
+  free(q);
+}
+
+size_t tq_nthreads(const task_queue *q) {
+  return q->nthreads;
+}
+
+size_t tq_worker_index(void) {
+  return worker_index;
+}
+
+void tq_push(task_queue *q,void *task) {
+  size_t me=worker_index<q->nthreads ? worker_index : 0;
+  __sync_add_and_fetch(&q->outstanding,1);
+  deque_push_bottom(&q->deques[me],task);
+  __sync_add_and_fetch(&q->queued,1);
+  /* Wake an idle worker if there is one.  The idle count is checked
+     without the lock; a worker increments it under the lock before
+     re-checking queued, so no wakeup can be lost. */
+  if(__sync_add_and_fetch(&q->idle,0)) {
+    pthread_mutex_lock(&q->idle_lock);
+    pthread_cond_signal(&q->wakeup);
+    pthread_mutex_unlock(&q->idle_lock);
+  }
+}
+
+/* find_task -- get a task from our own deque, or steal one.  Returns
+   NULL if every deque was empty when we looked. */
+static void *find_task(task_queue *q,size_t me) {
+  void *task;
+  size_t i;
+  if((task=deque_pop_bottom(&q->deques[me])))
+    return task;
+  for(i=1;i<q->nthreads;i++)
+    if((task=deque_steal_top(&q->deques[(me+i)%q->nthreads])))
+      return task;
+  return NULL;
+}
+
+int tq_pause(task_queue *q) {
+  if(!__sync_bool_compare_and_swap(&q->pausing,0,1))
+    return 0;
+  pthread_mutex_lock(&q->idle_lock);
+  while(q->parked+1<q->nworkers)
+    pthread_cond_wait(&q->parked_cond,&q->idle_lock);
+  pthread_mutex_unlock(&q->idle_lock);
+  return 1;
+}
+
+void tq_unpause(task_queue *q) {
+  pthread_mutex_lock(&q->idle_lock);
+  __sync_bool_compare_and_swap(&q->pausing,1,0);
+  pthread_cond_broadcast(&q->wakeup);
+  pthread_mutex_unlock(&q->idle_lock);
+}
+
+void tq_foreach(task_queue *q,void (*fn)(void *task,void *arg),void *arg) {
+  size_t i,j;
+  deque *d;
+  for(i=0;i<q->nthreads;i++) {
+    d=&q->deques[i];
+    pthread_mutex_lock(&d->lock);
+    for(j=0;j<d->count;j++)
+      fn(d->items[(d->top+j)%d->cap],arg);
+    pthread_mutex_unlock(&d->lock);
+  }
+}
+
+/* park -- wait while another worker has the pool paused.  Called with
+   idle_lock held. */
+static void park(task_queue *q) {
+  q->parked++;
+  pthread_cond_broadcast(&q->parked_cond);
+  while(__sync_add_and_fetch(&q->pausing,0))
+    pthread_cond_wait(&q->wakeup,&q->idle_lock);
+  q->parked--;
+}
+
+/* worker -- main loop of each worker thread */
+static void worker(task_queue *q,size_t me) {
+  void *task;
+  worker_index=me;
+  for(;;) {
+    if(__sync_add_and_fetch(&q->pausing,0)) {
+      /* Another task is pausing the pool.  Do not start a new task. */
+      pthread_mutex_lock(&q->idle_lock);
+      park(q);
+      pthread_mutex_unlock(&q->idle_lock);
+      continue;
+    }
+    if((task=find_task(q,me))) {
+      __sync_sub_and_fetch(&q->queued,1);
+      q->runner(task);
+      if(!__sync_sub_and_fetch(&q->outstanding,1)) {
+        /* That was the last task.  Wake everyone so they can exit. */
+        pthread_mutex_lock(&q->idle_lock);
+        pthread_cond_broadcast(&q->wakeup);
+        pthread_mutex_unlock(&q->idle_lock);
+      }
+      continue;
+    }
+
+    /* Nothing to do.  Wait for a push or for the end of the walk.  An
+       idle worker is between tasks, so it counts as parked. */
+    pthread_mutex_lock(&q->idle_lock);
+    __sync_add_and_fetch(&q->idle,1);
+    q->parked++;
+    pthread_cond_broadcast(&q->parked_cond);
+    while(!__sync_add_and_fetch(&q->queued,0)
+          && __sync_add_and_fetch(&q->outstanding,0))
+      pthread_cond_wait(&q->wakeup,&q->idle_lock);
+    q->parked--;
+    __sync_sub_and_fetch(&q->idle,1);
+    pthread_mutex_unlock(&q->idle_lock);
+
+    if(!__sync_add_and_fetch(&q->outstanding,0))
+      break;
+  }
+  worker_index=0;
+}
+
+typedef struct worker_args {
+  task_queue *q;
+  size_t me;
+} worker_args;
+
+static void *worker_thread(void *vargs) {
+  worker_args *args=(worker_args*)vargs;
+  worker(args->q,args->me);
+  return NULL;
+}
+
+void tq_run(task_queue *q) {
+  pthread_t *threads=NULL;
+  worker_args *args=NULL;
+  size_t i,started=0;
+  int err;
+
+  pthread_mutex_lock(&q->idle_lock);
+  q->nworkers=1;
+  pthread_mutex_unlock(&q->idle_lock);
+
+  if(q->nthreads>1) {
+    threads=(pthread_t*)malloc(q->nthreads*sizeof(pthread_t));
+    args=(worker_args*)malloc(q->nthreads*sizeof(worker_args));
+    if(!threads || !args)
+      fail("Cannot allocate memory for %llu threads: %s\n",
+           (unsigned long long)q->nthreads,strerror(errno));
+    for(i=1;i<q->nthreads;i++) {
+      args[i].q=q;
+      args[i].me=i;
+      if((err=pthread_create(&threads[i],NULL,worker_thread,&args[i]))) {
+        warn("Cannot start worker thread %llu: %s\n",
+             (unsigned long long)i,strerror(err));
+        break;
+      }
+      started=i;
+      pthread_mutex_lock(&q->idle_lock);
+      q->nworkers++;
+      pthread_mutex_unlock(&q->idle_lock);
+    }
+  }
+
+  worker(q,0);
+
+  for(i=1;i<=started;i++)
+    pthread_join(threads[i],NULL);
+  free(threads);
+  free(args);
+}
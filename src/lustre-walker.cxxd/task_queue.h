@@ -0,0 +1,70 @@
+#ifndef INC_TASK_QUEUE
+#define INC_TASK_QUEUE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* task_queue -- a pool of worker threads, each of which has its own
+     double-ended queue (deque) of tasks.  A worker pushes and pops
+     tasks at the bottom of its own deque (LIFO), which keeps each
+     worker's walk roughly depth-first.  When a worker's deque is
+     empty, it steals from the top of another worker's deque (FIFO),
+     which hands it the oldest, and usually largest, pending subtree.
+
+     Tasks are opaque pointers; the pool calls the runner function
+     given to tq_create on each one exactly once. */
+  typedef struct task_queue task_queue;
+  typedef void (*tq_runner)(void *task);
+
+  /* tq_create -- create a pool with nthreads workers (at least 1).
+     No threads are started until tq_run is called. */
+  task_queue *tq_create(size_t nthreads,tq_runner runner);
+
+  /* tq_destroy -- free the pool.  Must not be called during tq_run. */
+  void tq_destroy(task_queue *q);
+
+  /* tq_push -- add a task.  Called from a worker, this pushes onto the
+     bottom of that worker's deque; called from any other thread, it
+     pushes onto worker 0's deque. */
+  void tq_push(task_queue *q,void *task);
+
+  /* tq_run -- start nthreads-1 additional threads and use the calling
+     thread as worker 0.  Returns once every pushed task has been run,
+     including tasks pushed by other tasks. */
+  void tq_run(task_queue *q);
+
+  /* tq_pause -- called by a task to stop the other workers between
+     tasks, so that the state of the walk can be examined.  Returns 1
+     once every other worker is waiting, or 0 without waiting if
+     another task is already pausing the pool.  After a 1 return, the
+     caller must call tq_unpause. */
+  int tq_pause(task_queue *q);
+  void tq_unpause(task_queue *q);
+
+  /* tq_foreach -- calls fn(task,arg) on every task waiting in a deque.
+     Only call this while the pool is paused, or when it is not
+     running. */
+  void tq_foreach(task_queue *q,void (*fn)(void *task,void *arg),void *arg);
+
+  /* tq_nthreads -- number of workers in the pool */
+  size_t tq_nthreads(const task_queue *q);
+
+  /* tq_worker_index -- index of the calling worker (0 if the caller is
+     not a worker thread) */
+  size_t tq_worker_index(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_TASK_QUEUE */
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#define _ATFILE_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "basic_utils.h"
+#include "throttle.h"
+#include "metrics.h"
+
+/* Throttle state.  counts, a histogram like those in metrics.c, is
+   updated by every thread without a lock; everything else is
+   protected by lock.
+     max_rate, target -- the -t rate and target p95 latency
+     rate -- current rate, in files per second
+     p95 -- moving p95 latency, or 0 if none yet
+     next_start -- when the next file may start
+     next_adjust -- when the rate is next adjusted
+     seen -- counts at the last adjustment
+     slept -- total seconds slept in th_wait */
+static size_t counts[MT_BUCKETS];
+static size_t seen[MT_BUCKETS];
+static double max_rate=0, target=0, rate=0, p95=0;
+static double next_start=0, next_adjust=0, slept=0;
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+
+void th_init(double max,double goal) {
+  pthread_mutex_lock(&lock);
+  max_rate=rate=max;
+  target=goal;
+  next_start=next_adjust=mt_now();
+  pthread_mutex_unlock(&lock);
+}
+
+void th_latency(double seconds) {
+  __sync_fetch_and_add(&counts[mt_bucket(seconds)],1);
+}
+
+/* adjust -- one step of the AIMD loop: work out the p95 of the
+   latencies since the last step, fold it into the moving p95, and
+   change the rate.  Caller must hold the lock. */
+static void adjust(void) {
+  size_t window[MT_BUCKETS], n=0, sum=0, c;
+  double cap, old=rate;
+  unsigned b;
+  for(b=0;b<MT_BUCKETS;b++) {
+    c=counts[b];
+    window[b]=c-seen[b];
+    seen[b]=c;
+    n+=window[b];
+  }
+  if(!n)
+    return; /* nothing measured; leave the rate alone */
+  for(b=0;b<MT_BUCKETS-1;b++)
+    if((sum+=window[b])*20>=n*19)
+      break;
+  p95 = p95>0 ? (p95+mt_bucket_top(b))/2 : mt_bucket_top(b);
+
+  if(p95>target)
+    rate*=TH_DECREASE;
+  else {
+    cap = (p95<target/2) ? max_rate*TH_BURST : max_rate;
+    rate+=max_rate*TH_INCREASE;
+    if(rate>cap)
+      rate=cap;
+  }
+  if(rate<TH_MIN_RATE)
+    rate=TH_MIN_RATE;
+  if(rate!=old)
+    debugn(VERB_DEBUG_HIGH,"throttle: p95 latency %.3f ms; rate %.0f -> %.0f files/sec\n",
+           p95*1e3,old,rate);
+}
+
+void th_wait(void) {
+  double now, start, wait;
+  pthread_mutex_lock(&lock);
+  now=mt_now();
+  if(now>=next_adjust) {
+    adjust();
+    next_adjust=now+TH_INTERVAL;
+  }
+  /* Take the next start time.  Time not used while nothing was
+     waiting is not saved up for later. */
+  start = (next_start>now) ? next_start : now;
+  next_start=start+1/rate;
+  pthread_mutex_unlock(&lock);
+
+  /* Sleep until the start time, however far off it is; usleep is
+     only given less than a second at a time. */
+  if(start-now>=TH_MIN_SLEEP) {
+    for(wait=start-now; wait>0; wait=start-mt_now())
+      usleep((useconds_t)((wait<0.999999 ? wait : 0.999999)*1e6));
+    pthread_mutex_lock(&lock);
+    slept+=start-now;
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+double th_rate(void) {
+  double r;
+  pthread_mutex_lock(&lock);
+  r=rate;
+  pthread_mutex_unlock(&lock);
+  return r;
+}
+
+double th_p95(void) {
+  double p;
+  pthread_mutex_lock(&lock);
+  p=p95;
+  pthread_mutex_unlock(&lock);
+  return p;
+}
+
+double th_sleep_time(void) {
+  double s;
+  pthread_mutex_lock(&lock);
+  s=slept;
+  pthread_mutex_unlock(&lock);
+  return s;
+}
+
+void th_set_sleep_time(double seconds) {
+  pthread_mutex_lock(&lock);
+  slept=seconds;
+  pthread_mutex_unlock(&lock);
+}
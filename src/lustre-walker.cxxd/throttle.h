@@ -0,0 +1,73 @@
+#ifndef INC_THROTTLE
+#define INC_THROTTLE
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _ATFILE_SOURCE
+#define _ATFILE_SOURCE
+#endif
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Adaptive throttle (-t).  Rather than holding the walk to a fixed
+     rate however the metadata server is doing, the walker measures
+     how long its stats and directory reads take, and paces files to
+     keep the 95th percentile of those latencies near a target.
+
+     Every TH_INTERVAL seconds, the 95th percentile of the latencies
+     reported since the last adjustment is smoothed into a moving
+     p95.  If that is above the target, the rate is cut by a
+     multiple (TH_DECREASE); otherwise it grows by a fixed step
+     (TH_INCREASE of the -t rate).  This is AIMD, as in TCP
+     congestion control: the server gets relief at once when it is
+     slow, and the rate creeps back up when it recovers.  The rate
+     never goes above the -t rate unless the moving p95 is under half
+     the target, and never above TH_BURST times the -t rate.
+
+     Files are paced by handing out start times 1/rate apart.  A
+     thread sleeps until its file's start time, without holding any
+     lock, so several threads can wait at once; it never starts early,
+     even when there are more threads than files per second.  Waits under
+     TH_MIN_SLEEP are not slept but carried over, so fast rates do not
+     turn into a flood of tiny sleeps. */
+
+#define TH_INTERVAL 0.5     /* seconds between rate adjustments */
+#define TH_DECREASE 0.7     /* rate multiplier when latency is too high */
+#define TH_INCREASE 0.05    /* step, as a fraction of the -t rate, when it is not */
+#define TH_BURST 2.0        /* the most the rate can exceed -t by */
+#define TH_MIN_SLEEP 0.001  /* shortest sleep, in seconds */
+#define TH_MIN_RATE 10.0    /* lowest rate, in files per second */
+
+  /* th_init -- start throttling to max_rate files per second (the -t
+     rate), aiming for a p95 latency of target seconds */
+  void th_init(double max_rate,double target);
+
+  /* th_latency -- report that a stat or directory read took this many
+     seconds.  Thread-safe and lock-free. */
+  void th_latency(double seconds);
+
+  /* th_wait -- called before each file is processed.  Adjusts the
+     rate if it is time, and sleeps until the file may start.
+     Thread-safe. */
+  void th_wait(void);
+
+  /* th_rate, th_p95 -- the current rate in files per second, and the
+     moving p95 latency in seconds (0 if nothing has been measured) */
+  double th_rate(void);
+  double th_p95(void);
+
+  /* th_sleep_time -- total seconds slept by all threads in th_wait.
+     th_set_sleep_time sets it, when resuming a walk. */
+  double th_sleep_time(void);
+  void th_set_sleep_time(double seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_THROTTLE */